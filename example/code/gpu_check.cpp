@@ -0,0 +1,165 @@
+//
+// Checks that GPU systems simulate their particles like the CPU would. Run the sandbox with --check-gpu-simulation to use it.
+// The same particles spawn into a CPU system, which runs the sandbox's simulation loop, and into a GPU one, which gets the same physics from the sandbox.
+// After a few seconds, we bring the GPU particles back and compare them.
+// It doesn't show anything, so it also runs on software drivers like Mesa's llvmpipe. (See the README.)
+//
+
+#include "glad/gl.h" // Before GLFW, which sandbox.h includes.
+#include "sandbox.h"
+
+constexpr float    gpu_check_dt = 1.0f / 60.0f;
+constexpr uint32_t gpu_check_step_count = 240;
+constexpr uint32_t gpu_check_spawn_period = 10; // In steps.
+constexpr uint32_t gpu_check_spawn_count = 1500;
+constexpr uint32_t gpu_check_max_id = (gpu_check_step_count / gpu_check_spawn_period) * gpu_check_spawn_count;
+
+// Both simulations run the same float operations, but the GPU may fuse or reorder some of them.
+constexpr float gpu_check_position_tolerance = 1e-3f;
+constexpr float gpu_check_life_tolerance = 1e-4f;
+
+// Particles that end up right on a kill volume's boundary can die on one side and not on the other.
+constexpr float gpu_check_max_mismatch_ratio = 0.001f;
+
+// The sandbox's own simulation, which we check the GPU against. (See sandbox.cpp.)
+extern SandboxState state;
+struct ParticleEventQueue;
+void simulate_system(ParticleSystem* system, float dt, ParticleEventQueue* events, SubEmitterTrigger trigger);
+void sandbox_get_gpu_simulation_params(GpuSimulationParams* gpu);
+
+static uint32_t gpu_check_random_state;
+
+// Our own generator, so that both systems (and every platform) get the same particles.
+static float gpu_check_random() {
+	gpu_check_random_state = gpu_check_random_state * 1664525u + 1013904223u;
+	return (gpu_check_random_state >> 8) / 16777216.0f;
+}
+
+// Each particle carries its id in its blue channel, which neither simulation touches, so that we can match them up wherever each side keeps them.
+static void gpu_check_spawn(ParticleSystem* system, uint32_t first_id) {
+	gpu_check_random_state = first_id;
+	
+	for (uint32_t k = 0; k < gpu_check_spawn_count; k += 1) {
+		Particle* p = particle_system_spawn(system);
+		p->position = {gpu_check_random() * 2 - 1, gpu_check_random() * 2 - 1, 0};
+		p->velocity = {gpu_check_random() - 0.5f, gpu_check_random(), 0};
+		p->life = 0.2f + gpu_check_random() * 2;
+		p->scale = 0.02f;
+		p->color = {1, 0.5f, (first_id + k + 1) / 65536.0f, 1};
+	}
+}
+
+// Gathers the live particles of a CPU system by id.
+static uint32_t gpu_check_gather(ParticleSystem* system, Particle* by_id[]) {
+	uint32_t count = 0;
+	for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+		ParticleChunk* chunk = system->chunks[c];
+		for (uint32_t i = 0; i < chunk->used; i += 1) {
+			Particle* p = &chunk->particles[i];
+			if (p->life < 0) continue;
+			
+			uint32_t id = (uint32_t) (p->color.z * 65536.0f + 0.5f) - 1;
+			if (id < gpu_check_max_id) by_id[id] = p;
+			count += 1;
+		}
+	}
+	return count;
+}
+
+// Returns the exit code of the sandbox: 0 if both simulations agree.
+int gpu_simulation_check() {
+	Sparkles::initialize();
+	
+	if (!particle_gpu_simulation_supported()) {
+		printf("GPU simulation is not supported by %s.\n", (const char*) glGetString(GL_RENDERER));
+		return 1;
+	}
+	printf("Checking GPU simulation on %s.\n", (const char*) glGetString(GL_RENDERER));
+	
+	sandbox_state_init(&state);
+	
+	auto physics = &state.physics;
+	physics->gravity = {0, -1};
+	physics->friction = 0.99f;
+	
+	// One attractor of each falloff, one of them pushing.
+	vec2 positions[] = {{0.3f, 0.2f}, {-0.5f, 0}, {0, 0.8f}};
+	ForceType force_types[] = {ForceType::INVERSE_SQUARED, ForceType::LINEAR, ForceType::INVERSE};
+	float radii[] = {0.8f, 0.6f, 1.0f};
+	float factors[] = {0.5f, -1.0f, 0.3f};
+	float magnitude_caps[] = {2.0f, 3.0f, 1.0f};
+	
+	physics->attractor_count = 3;
+	for (int a = 0; a < physics->attractor_count; a += 1) {
+		Attractor* attractor = &physics->attractors[a];
+		attractor_init(attractor);
+		attractor->position = positions[a];
+		attractor->force_type = force_types[a];
+		attractor->radius = radii[a];
+		attractor->factor = factors[a];
+		attractor->magnitude_cap = magnitude_caps[a];
+	}
+	
+	// The world bounds, and a line across a corner.
+	state.space_width = 2.4f;
+	state.space_height = 2.4f;
+	state.kill_volumes.kill_outside_world = true;
+	state.kill_volumes.volume_count = 1;
+	kill_volume_init(&state.kill_volumes.volumes[0]);
+	state.kill_volumes.volumes[0].type = KillVolumeType::HALF_PLANE;
+	state.kill_volumes.volumes[0].normal = {1, 1};
+	state.kill_volumes.volumes[0].distance = 1.5f;
+	
+	ParticleSystem* cpu_system = particle_system_create(gpu_check_spawn_count);
+	ParticleSystem* gpu_system = particle_system_create(gpu_check_spawn_count);
+	particle_system_set_simulation(gpu_system, ParticleSimulation::GPU);
+	sandbox_get_gpu_simulation_params(&gpu_system->gpu);
+	
+	// Like the sandbox: spawns happen after the step, and are simulated from the next one on.
+	for (uint32_t step = 0; step < gpu_check_step_count; step += 1) {
+		particle_system_advance(cpu_system, gpu_check_dt);
+		simulate_system(cpu_system, gpu_check_dt, nullptr, SubEmitterTrigger::NONE);
+		particle_system_advance(gpu_system, gpu_check_dt);
+		
+		if (step % gpu_check_spawn_period == 0) {
+			uint32_t first_id = (step / gpu_check_spawn_period) * gpu_check_spawn_count;
+			gpu_check_spawn(cpu_system, first_id);
+			gpu_check_spawn(gpu_system, first_id);
+		}
+	}
+	
+	uint32_t gpu_alive_count = particle_system_alive_count(gpu_system); // Before the GPU particles come back.
+	particle_system_set_simulation(gpu_system, ParticleSimulation::CPU);
+	
+	auto cpu_particles = new Particle*[gpu_check_max_id]();
+	auto gpu_particles = new Particle*[gpu_check_max_id]();
+	uint32_t cpu_count = gpu_check_gather(cpu_system, cpu_particles);
+	uint32_t gpu_count = gpu_check_gather(gpu_system, gpu_particles);
+	
+	uint32_t mismatch_count = 0; // Alive on one side only.
+	float max_position_error = 0;
+	float max_life_error = 0;
+	for (uint32_t id = 0; id < gpu_check_max_id; id += 1) {
+		Particle* expected = cpu_particles[id];
+		Particle* actual = gpu_particles[id];
+		if (!expected != !actual) mismatch_count += 1;
+		if (!expected || !actual) continue;
+		
+		max_position_error = fmaxf(max_position_error, norm(expected->position.xy - actual->position.xy));
+		max_life_error = fmaxf(max_life_error, fabsf(expected->life - actual->life));
+	}
+	
+	printf("Alive: %u on the CPU, %u on the GPU (which counted at most %u), %u on one side only.\n", cpu_count, gpu_count, gpu_alive_count, mismatch_count);
+	printf("Largest difference: %g in position, %g in life.\n", max_position_error, max_life_error);
+	
+	bool passed = cpu_count > 0 && gpu_alive_count >= gpu_count
+		&& mismatch_count <= gpu_check_max_mismatch_ratio * cpu_count
+		&& max_position_error <= gpu_check_position_tolerance && max_life_error <= gpu_check_life_tolerance;
+	printf(passed ? "GPU simulation matches the CPU.\n" : "GPU simulation does NOT match the CPU!\n");
+	
+	delete[] cpu_particles;
+	delete[] gpu_particles;
+	particle_system_destroy(cpu_system);
+	particle_system_destroy(gpu_system);
+	return passed ? 0 : 1;
+}
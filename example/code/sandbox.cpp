@@ -2,12 +2,49 @@
 
 Mesh* mesh_presets[NUM_MESH_PRESETS];
 Texture* texture_presets[NUM_TEXTURE_PRESETS];
+EmissionShape* shape_presets[NUM_SHAPE_PRESETS];
 
 // 
 // Graphics variables.
 //
 RenderTarget* hdr_render_target;
 RenderState hdr_blit_render_state;
+DrawQueue* draw_queue; // Our particles and trails, sorted by their state before we draw them.
+
+// Our particles spin their mesh by a random angle, which they keep in a custom attribute.
+// Only our CPU systems draw with this shader: BALLISTIC and GPU ones need the backend's, which work out where their particles are now.
+const char* spinning_particle_vertex_shader_source = R"glsl(
+#version 410
+
+layout (location = 0) in vec3 vertex_position;
+layout (location = 1) in vec4 vertex_color;
+layout (location = 2) in vec2 vertex_uv;
+
+layout (location = 3) in vec4 instance_position; // The current alpha is in w.
+layout (location = 4) in float instance_scale;
+layout (location = 5) in vec4 instance_color;
+layout (location = 9) in float instance_rotation; // Our "rotation" attribute.
+
+uniform mat4 projection;
+
+out vec2 pixel_uv;
+out vec4 pixel_color;
+
+void main() {
+	// Dead particles have 0 alpha. They collapse to a point, so they are never rasterized.
+	float scale = (instance_position.w <= 0) ? 0 : instance_scale;
+	
+	float c = cos(instance_rotation);
+	float s = sin(instance_rotation);
+	vec2 offset = vec2(c * vertex_position.x - s * vertex_position.y, s * vertex_position.x + c * vertex_position.y);
+	
+	gl_Position = projection * vec4(instance_position.xyz + vec3(offset, vertex_position.z) * scale, 1);
+	pixel_color = vertex_color * vec4(instance_color.rgb, instance_position.w);
+	pixel_uv = vertex_uv;
+}
+)glsl";
+
+Shader* spinning_particle_vertex_shader;
 
 //
 // Particle simulation variables.
@@ -16,9 +53,63 @@ RenderState hdr_blit_render_state;
 SandboxState state;
 
 // We do not store our system in the Emitter struct, so we create our simulation variables for each emitter as an external variable.
-ParticleSystem* systems[max_emitter_count];
-float emission_accumulation_timer[max_emitter_count];
-float next_emission_interval[max_emitter_count];
+ParticleSystem* systems[max_emitter_count]; // Created lazily, the first time their emitter is active.
+ParticleAttribute particle_attributes[] = {
+	{"rotation", 1, AttributeType::HALF, AttributeVisibility::GPU}, // Radians. A half is plenty for an angle, and takes 2 bytes per particle to upload.
+};
+EmitterStats emitter_stats[max_emitter_count];
+
+// Where each instance of an emitter is in its emissions.
+struct EmissionState {
+	float timer;  // Time since the current emission started.
+	float period; // Period of the current emission. Negative to start a new one right away.
+	int to_emit;  // Particles in the current emission.
+	int emitted;  // How many of them we have spawned so far.
+};
+
+EmissionState emission_states[max_emitter_count]; // Of emitters without instances.
+
+struct EmitterInstances {
+	int count;
+	int capacity;
+	EffectInstance* instances;
+	EmissionState* emission; // One per instance.
+	
+	float emission_rate_sum; // To scale the pool estimate.
+	int first_to_emit; // Instances take turns being first, so that a spawn budget does not always run out on the same ones.
+};
+
+EmitterInstances emitter_instances[max_emitter_count];
+
+bool prewarm_pending; // Set when a new state is loaded.
+bool reorder_particles = false;
+uint32_t reorder_frame = 0;
+bool gpu_simulation = false;
+bool particle_ropes = false;
+
+// Deaths and collisions gathered while simulating, so that sub-emitters can spawn their particles in one batch afterwards, instead of from the simulation loop.
+// It is a structure of arrays, with a fixed range of slots per chunk ('chunk_capacity' slots, at most one event per particle and step), so that chunks can record events in parallel without any synchronization.
+struct ParticleEventQueue {
+	uint32_t capacity;
+	uint32_t chunk_capacity;
+	uint32_t* counts; // One per chunk.
+	vec2* positions;
+	vec2* velocities;
+};
+
+ParticleEventQueue event_queues[max_emitter_count];
+ParticleEventQueue unheard_events; // For simulations whose events nobody reads.
+
+float skipped_time[max_emitter_count]; // Time an off-screen emitter still has to catch up on.
+float ballistic_kill_timer[max_emitter_count]; // Time since we last tested a BALLISTIC emitter against the kill volumes.
+
+// See particle_ropes.
+struct EmitterRope {
+	ConstraintSolver* solver; // Created lazily.
+	uint32_t last; // Solver index of the particle the emitter spawned last, or UINT32_MAX.
+};
+
+EmitterRope emitter_ropes[max_emitter_count];
 
 void sandbox_ui(SandboxState* state, float dt);
 
@@ -31,9 +122,50 @@ bool sandbox_state_load(SandboxState* state, const char* file_path) {
 		auto size = ftell(file);
 		fseek(file, 0, SEEK_SET);
 		
-		if (size == sizeof(SandboxState)) {
-			fread(state, sizeof(SandboxState), 1, file);
+		// Each version appends its fields to SandboxState, so older files are a prefix of it. We load them as such, and default the rest.
+		const long version_sizes[] = {
+			0,
+			offsetof(SandboxState, emitter_options), // Version 1.
+			offsetof(SandboxState, sub_emitters),    // Version 2.
+			offsetof(SandboxState, emitter_lods),    // Version 3.
+			offsetof(SandboxState, emitter_shapes),  // Version 4.
+			offsetof(SandboxState, kill_volumes),    // Version 5.
+			offsetof(SandboxState, emitter_trails),  // Version 6.
+			sizeof(SandboxState),                    // Version 7.
+		};
+		static_assert(array_size(version_sizes) == serialization_version + 1, "Add the size of the new version above.");
+		
+		int file_version = 0;
+		for (int v = 1; v <= serialization_version; v += 1) {
+			if (size == version_sizes[v]) file_version = v;
+		}
+		
+		if (file_version) {
+			fread(state, version_sizes[file_version], 1, file);
+			
+			if (file_version < 2) {
+				for (int e = 0; e < max_emitter_count; e += 1) emitter_options_init(&state->emitter_options[e]);
+			}
+			if (file_version < 3) {
+				for (int e = 0; e < max_emitter_count; e += 1) sub_emitter_init(&state->sub_emitters[e]);
+			}
+			if (file_version < 4) {
+				for (int e = 0; e < max_emitter_count; e += 1) emitter_lod_init(&state->emitter_lods[e]);
+			}
+			if (file_version < 5) {
+				for (int e = 0; e < max_emitter_count; e += 1) emitter_shape_init(&state->emitter_shapes[e]);
+			}
+			if (file_version < 6) {
+				kill_volumes_init(&state->kill_volumes);
+				state->kill_volumes.kill_outside_world = false; // Particles of older files could leave the world and come back.
+			}
+			if (file_version < 7) {
+				for (int e = 0; e < max_emitter_count; e += 1) emitter_trail_init(&state->emitter_trails[e]);
+			}
+			
+			state->version = serialization_version;
 			result = true;
+			prewarm_pending = true;
 		}
 		fclose(file);
 	}
@@ -56,6 +188,11 @@ bool sandbox_init() {
 	
 	Sparkles::initialize();
 	
+	// Skip linking our shaders on later runs.
+	shader_cache_set_directory("shader_cache");
+	
+	draw_queue = draw_queue_create();
+	
 	{
 		//
 		// Initialize our graphics variables.
@@ -72,6 +209,8 @@ bool sandbox_init() {
 		hdr_blit_render_state.projection = orthographic(0, 1, 1, 0, -1, +1);
 		hdr_blit_render_state.viewport = {0, 0, (float) backbuffer_width, (float) backbuffer_height};
 		hdr_blit_render_state.texture0 = nullptr; // Will be our HDR texture.
+		
+		spinning_particle_vertex_shader = shader_create(ShaderLanguage::GLSL, ShaderType::VERTEX, spinning_particle_vertex_shader_source);
 	}
 	
 	{
@@ -96,21 +235,43 @@ bool sandbox_init() {
 	}
 	
 	{
-		// Initialize the sandbox and particle states.
+		// Create our emission shape presets. They are sampled in constant time, so their detail does not matter for spawning costs.
+		shape_presets[0] = nullptr;
 		
-		sandbox_state_init(&state);
+		MeshBuilder builder = mesh_builder_create(64, 64 * 3); // #memory_cleanup
+		put_rect(&builder, {-0.5f, -0.5f, 1.0f, 1.0f});
+		shape_presets[1] = emission_shape_create_from_mesh(&builder);
 		
-		for (int e = 0; e < max_emitter_count; e += 1) {		
-			auto system = particle_system_create(max_particles_per_emitter);
-			
-			for (int i = 0; i < system->count; i += 1) {
-				Particle* p = &system->particles[i];
-				p->scale = 0;
-				p->life = -1;
+		mesh_builder_clear(&builder);
+		put_regular_polygon(&builder, {0, 0}, 0.5f, 40);
+		shape_presets[2] = emission_shape_create_from_mesh(&builder);
+		
+		CubicBezier wave[2] = {
+			{{-0.5f, 0}, {0, 0}, {0.15f, 0.5f}, {-0.15f, 0.5f}},
+			{{0, 0}, {0.5f, 0}, {0.15f, -0.5f}, {-0.15f, -0.5f}},
+		};
+		shape_presets[3] = emission_shape_create_from_curves(wave, array_size(wave));
+		
+		// Also works with the pixels of any image you load, before passing them to texture_create.
+		constexpr int ring_size = 64;
+		float* ring = new float[ring_size * ring_size];
+		for (int j = 0; j < ring_size; j += 1) {
+			for (int i = 0; i < ring_size; i += 1) {
+				float x = (i + 0.5f) / ring_size - 0.5f;
+				float y = (j + 0.5f) / ring_size - 0.5f;
+				float r = sqrt(x * x + y * y);
+				ring[i + j * ring_size] = fmax(0.0f, 1.0f - fabs(r - 0.4f) * 20);
 			}
-			
-			systems[e] = system;
 		}
+		shape_presets[4] = emission_shape_create_from_image(TextureFormat::ALPHA_FLOAT32, ring_size, ring_size, ring, {-0.5f, -0.5f, 1.0f, 1.0f});
+		delete[] ring;
+	}
+	
+	{
+		// Initialize the sandbox and particle states.
+		
+		// Particle systems are only created once their emitters need them. See sandbox_frame.
+		sandbox_state_init(&state);
 	}
 	
 	{
@@ -122,133 +283,863 @@ bool sandbox_init() {
 }
 
 void notify_starvation(int count);
+uint32_t sandbox_get_kill_volumes(KillVolume volumes[max_kill_volume_count + 1]);
+void sandbox_get_gpu_simulation_params(GpuSimulationParams* gpu);
+void event_queue_prepare(ParticleEventQueue* queue, ParticleSystem* system);
 
-void sandbox_frame(float dt) {
-	render_target_clear(nullptr, {0, 0, 0, 1});	
+// Our samples were tuned with friction applied once per frame at this frame rate. 
+// We scale it by the actual time step, so that bigger steps (and the closed-form ballistic trajectories) behave the same.
+constexpr float friction_reference_frame_rate = 60;
+
+float friction_to_drag(float friction) {
+	if (friction >= 1) return 0;
+	return -log(fmax(friction, 0.0001f)) * friction_reference_frame_rate;
+}
+
+float emitter_max_life(Emitter* emitter) {
+	return fmax(emitter->life.min, emitter->life.max);
+}
+
+// Returns the particle system of the given emitter, creating it if needed, and fits its pool to what the emitter can keep alive at once.
+ParticleSystem* emitter_get_system(int emitter_index) {
+	auto emitter = &state.emitters[emitter_index];
+	auto stats = &emitter_stats[emitter_index];
+	
+	auto estimate = particle_count_estimate(emitter->emission_interval, emitter->particles_per_emission, emitter->life);
+	
+	auto instances = &emitter_instances[emitter_index];
+	if (instances->count > 0) {
+		estimate.average *= instances->emission_rate_sum;
+		estimate.peak = (uint32_t) fmin(ceil(estimate.peak * instances->emission_rate_sum), (float) UINT32_MAX);
+	}
+	
+	if (estimate.peak != stats->estimate.peak) stats->peak = 0;
+	stats->estimate = estimate;
+	
+	uint32_t pool_size = estimate.peak < max_particles_per_emitter ? estimate.peak : max_particles_per_emitter;
+	if (!systems[emitter_index]) {
+		systems[emitter_index] = particle_system_create(pool_size, particle_attributes, sizeof(particle_attributes) / sizeof(particle_attributes[0]));
+		systems[emitter_index]->max_particle_count = max_particles_per_emitter;
+	}
+	particle_system_fit(systems[emitter_index], pool_size);
+	
+	return systems[emitter_index];
+}
+
+void emitter_update_simulation_mode(int emitter_index) {
+	auto system = systems[emitter_index];
+	auto physics = &state.physics;
+	
+	// Without attractors, every particle follows a closed-form trajectory, so the GPU can animate it on its own.
+	// We only upload particles when they spawn, and we don't run our simulation loop at all.
+	bool ballistic = true;
+	for (int a = 0; a < physics->attractor_count; a += 1) {
+		if (physics->attractors[a].active) ballistic = false;
+	}
+	
+	// Sub-emitters need to see each particle die or collide, which only our simulation loop does.
+	bool needs_cpu = state.sub_emitters[emitter_index].trigger != SubEmitterTrigger::NONE;
+	
+	// So do trails, which record where each particle is after every step.
+	uint32_t trail_length = (uint32_t) state.emitter_trails[emitter_index].trail_length;
+	if (trail_length > 0) needs_cpu = true;
+	
+	// And ropes, whose solver moves the particles where they are in memory.
+	if (particle_ropes) needs_cpu = true;
+	
+	// Otherwise, the GPU can run our simulation loop too, attractors and all, and the particles never come back to the CPU.
+	auto simulation = ParticleSimulation::CPU;
+	if (!needs_cpu && ballistic) simulation = ParticleSimulation::BALLISTIC;
+	else if (!needs_cpu && gpu_simulation && particle_gpu_simulation_supported()) simulation = ParticleSimulation::GPU;
+	
+	particle_system_set_simulation(system, simulation);
+	if (system->trail_length != trail_length) particle_system_set_trail_length(system, trail_length);
+	system->ballistic.gravity = physics->gravity;
+	system->ballistic.drag = friction_to_drag(physics->friction);
+	
+	if (simulation == ParticleSimulation::GPU) sandbox_get_gpu_simulation_params(&system->gpu);
+}
+
+// Our simulation loop, as the GPU runs it: the physics and kill volumes of the state. (See simulate_chunk for the CPU side.)
+void sandbox_get_gpu_simulation_params(GpuSimulationParams* gpu) {
+	auto physics = &state.physics;
+	
+	gpu->gravity = physics->gravity;
+	gpu->drag = friction_to_drag(physics->friction);
+	
+	gpu->attractor_count = 0;
+	for (int a = 0; a < physics->attractor_count; a += 1) {
+		Attractor* attractor = &physics->attractors[a];
+		if (!attractor->active) continue;
 		
-	RenderState render_state;
-	render_state.render_target = hdr_render_target;
-	render_state.projection = orthographic(-state.space_width * 0.5, +state.space_width * 0.5, +state.space_height * 0.5, -state.space_height * 0.5, -1, +1);
-	render_state.viewport = {0, 0, (float) hdr_render_target->width, (float) hdr_render_target->height};
+		GpuAttractor* destination = &gpu->attractors[gpu->attractor_count++];
+		destination->position = attractor->position;
+		destination->radius = attractor->radius;
+		destination->strength = attractor->factor;
+		destination->max_force = attractor->magnitude_cap;
+		destination->falloff = (GpuForceFalloff) attractor->force_type; // Same values.
+	}
 	
-	render_target_clear(hdr_render_target, {0, 0, 0, 1});
+	KillVolume kill_volumes[max_kill_volume_count + 1];
+	gpu->kill_volume_count = sandbox_get_kill_volumes(kill_volumes);
+	for (uint32_t v = 0; v < gpu->kill_volume_count; v += 1) gpu->kill_volumes[v] = kill_volumes[v];
+}
+
+// The instance that an emitter without instances acts as.
+EffectInstance emitter_implicit_instance(int emitter_index) {
+	EffectInstance result;
+	effect_instance_init(&result);
+	result.position = state.emitters[emitter_index].position;
+	return result;
+}
+
+// Ties a particle the emitter just spawned to the one it spawned before.
+void emitter_rope_add(int emitter_index, Particle* particle) {
+	auto rope = &emitter_ropes[emitter_index];
+	if (!rope->solver) {
+		rope->solver = constraint_solver_create();
+		rope->last = UINT32_MAX;
+	}
 	
-	Physics physics = state.physics;
+	uint32_t index = constraint_solver_add_particle(rope->solver, particle);
+	if (rope->last != UINT32_MAX) constraint_solver_add_distance(rope->solver, rope->last, index, rope_compliance);
+	rope->last = index;
+}
+
+// Drops the particles that died from the emitter's rope, before their slots are handed out again.
+void emitter_rope_remove_dead(int emitter_index) {
+	auto rope = &emitter_ropes[emitter_index];
+	if (!rope->solver) return;
 	
-	// For each emitter, spawn new particles, if it is time to do so.
-	for (int s = 0; s < state.emitter_count; s += 1) {
-		auto system = systems[s];
-		auto emitter = &state.emitters[s];
-		if (!emitter->active) continue;
+	// Backwards, so that the particle that takes the place of a removed one has been checked already.
+	for (uint32_t i = rope->solver->particle_count; i-- > 0; ) {
+		if (rope->solver->particles[i]->life >= 0) continue;
 		
-		emission_accumulation_timer[s] += dt;
-		if (next_emission_interval[s] < 0 || emission_accumulation_timer[s] >= next_emission_interval[s]) {
-			int remaining_particles_to_spawn = random_get1(emitter->particles_per_emission);
-			
-			for (int i = 0; i < system->count && remaining_particles_to_spawn > 0; i += 1) {
-				Particle* p = &system->particles[i];
-				
-				if (p->life < 0) { // Spawn particles in the place of those that have already died.
-					
-					p->position.xy = emitter->position + random_get2(emitter->offset);
-					p->velocity.xy = random_get2(emitter->velocity);
-					p->life = random_get1(emitter->life);
-					p->scale = random_get1(emitter->size);
-					
-					{
-						// Choose color based on the color weights
-						float total = 0;
-						for (int i = 0; i < emitter->color_count; i += 1) total += emitter->color_weights[i];
-						
-						vec4 chosen_color = {};
-						
-						float random_number = total * random_get();
-						float cursor = 0;
-						for (int i = 0; i < emitter->color_count; i += 1) {
-							float weight = emitter->color_weights[i];
-							if (random_number < cursor + weight) {
-								chosen_color = emitter->colors[i];
-								break;
-							}
-							cursor += weight;
-						}
-						
-						p->color = chosen_color;
-					}
-					remaining_particles_to_spawn -= 1;
-				}
+		uint32_t moved = constraint_solver_remove_particle(rope->solver, i);
+		if (rope->last == i) rope->last = UINT32_MAX;
+		else if (rope->last == moved) rope->last = i;
+	}
+}
+
+void emitter_rope_clear(int emitter_index) {
+	auto rope = &emitter_ropes[emitter_index];
+	if (rope->solver) constraint_solver_clear(rope->solver);
+	rope->last = UINT32_MAX;
+}
+
+// Spawns one particle from 'instance', as if it had spawned 'age' seconds ago. Returns false if the system is full.
+bool emitter_spawn(int emitter_index, float age, EffectInstance* instance, vec2 base_velocity) {
+	auto emitter = &state.emitters[emitter_index];
+	auto system = systems[emitter_index];
+	
+	float life = random_get1(emitter->life);
+	if (life <= age) return true; // It would already be dead.
+	
+	Particle* p = particle_system_spawn(system, age); // Reuses the slot of a dead particle, or grows the system.
+	if (!p) return false; // We hit max_particles_per_emitter.
+	
+	vec2 offset = random_get2(emitter->offset);
+	
+	auto shape = &state.emitter_shapes[emitter_index];
+	if (shape->shape_index > 0 && shape->shape_index < NUM_SHAPE_PRESETS) offset += emission_shape_sample(shape_presets[shape->shape_index]) * shape->shape_scale;
+	
+	offset *= instance->scale;
+	vec2 velocity = random_get2(emitter->velocity) * instance->scale;
+	if (instance->rotation != 0) {
+		offset = rotate2(offset, instance->rotation);
+		velocity = rotate2(velocity, instance->rotation);
+	}
+	
+	p->position.xy = instance->position + offset;
+	p->velocity.xy = base_velocity + velocity;
+	p->life = life;
+	p->scale = random_get1(emitter->size) * instance->scale;
+	
+	uint32_t index;
+	ParticleChunk* chunk = particle_system_find_chunk(system, p, &index);
+	float rotation = random_get() * TAU;
+	particle_chunk_set_attribute(system, chunk, 0, index, &rotation);
+	
+	{
+		// Choose color based on the color weights
+		float total = 0;
+		for (int i = 0; i < emitter->color_count; i += 1) total += emitter->color_weights[i];
+		
+		vec4 chosen_color = {};
+		
+		float random_number = total * random_get();
+		float cursor = 0;
+		for (int i = 0; i < emitter->color_count; i += 1) {
+			float weight = emitter->color_weights[i];
+			if (random_number < cursor + weight) {
+				chosen_color = emitter->colors[i];
+				break;
 			}
+			cursor += weight;
+		}
+		
+		p->color = chosen_color * instance->tint;
+	}
+	
+	if (system->simulation != ParticleSimulation::BALLISTIC && age > 0) {
+		// BALLISTIC particles are placed by their backdated birth time. Here, we move the particle ourselves, along the same trajectory.
+		// This ignores attractors for the fraction of a step, which is not noticeable.
+		particle_ballistic_evaluate(system, p, system->time - age, &p->position, &p->velocity);
+		p->life -= age;
+		p->color.w = fmin(p->color.w, p->life);
+	}
+	
+	if (particle_ropes && system->simulation == ParticleSimulation::CPU) emitter_rope_add(emitter_index, p);
+	
+	return true;
+}
+
+// Spawns every particle that 'instance' had due within the last 'dt' seconds, each at its exact time, until 'spawned' reaches 'spawn_budget' (0 means no limit). 
+// The ones over budget stay due, and spawn in the next calls, backdated to when they should have spawned.
+// Returns how many particles we failed to spawn.
+int emitter_emit_instance(int emitter_index, EffectInstance* instance, EmissionState* emission, float dt, int spawn_budget, int* spawned) {
+	auto emitter = &state.emitters[emitter_index];
+	auto options = &state.emitter_options[emitter_index];
+	
+	float* timer = &emission->timer;
+	float* period = &emission->period;
+	int* to_emit = &emission->to_emit;
+	int* emitted = &emission->emitted;
+	
+	// An emitter that has not run for more than a particle's life only needs its last emissions.
+	float max_life = emitter_max_life(emitter);
+	
+	*timer += dt;
+	
+	int starved = 0;
+	
+	while (options->emission_mode != EmissionMode::EVENTS_ONLY) {
+		if (*period < 0 || (*emitted >= *to_emit && *timer >= *period)) {
+			// Start the next emission. It started 'period' seconds after the last one, which may be earlier in this step.
+			if (*period < 0) *timer = 0;
+			else *timer -= *period;
 			
-			notify_starvation(remaining_particles_to_spawn);
+			*period = fmax(random_get1(emitter->emission_interval), 0.001f); // Avoid looping forever if the interval is 0.
+			*to_emit = random_get1(emitter->particles_per_emission) * instance->emission_rate;
+			*emitted = 0;
 			
-			next_emission_interval[s] = random_get1(emitter->emission_interval);
-			emission_accumulation_timer[s] = 0;
+			if (*timer >= max_life + *period) {
+				*emitted = *to_emit; // Every particle of this emission would already be dead.
+				continue;
+			}
 		}
 		
-		// Here is our simple simulation loop.
-		for (int i = 0; i < system->count; i += 1) {
-			Particle* p = &system->particles[i];
+		if (*emitted >= *to_emit) break;
+		
+		float spawn_time = 0; // Since the start of the emission.
+		if (options->emission_mode == EmissionMode::CONTINUOUS) spawn_time = *period * (*emitted / (float) *to_emit);
+		if (spawn_time > *timer) break; // Not due yet.
+		
+		if (spawn_budget > 0 && *spawned >= spawn_budget) break;
+		
+		if (!emitter_spawn(emitter_index, *timer - spawn_time, instance, {0, 0})) starved += 1;
+		*emitted += 1;
+		*spawned += 1;
+	}
+	
+	return starved;
+}
+
+// Spawns the due particles of every instance of an emitter, but no more than 'spawn_budget' of them in total (0 means no limit).
+// Returns how many particles we failed to spawn.
+int emitter_emit(int emitter_index, float dt, int spawn_budget) {
+	auto system = systems[emitter_index];
+	auto instances = &emitter_instances[emitter_index];
+	
+	int starved = 0;
+	int spawned = 0;
+	
+	if (instances->count == 0) {
+		EffectInstance instance = emitter_implicit_instance(emitter_index);
+		starved += emitter_emit_instance(emitter_index, &instance, &emission_states[emitter_index], dt, spawn_budget, &spawned);
+	} else {
+		int first = instances->first_to_emit < instances->count ? instances->first_to_emit : 0;
+		for (int i = 0; i < instances->count; i += 1) {
+			int index = (first + i) % instances->count;
 			
-			if (p->life < 0) continue; // Do not simulate particles that have already died.
+			// Every instance still gets its time, even once the budget has run out, so that its particles stay due.
+			bool had_budget = spawn_budget == 0 || spawned < spawn_budget;
+			starved += emitter_emit_instance(emitter_index, &instances->instances[index], &instances->emission[index], dt, spawn_budget, &spawned);
+			if (had_budget && spawn_budget > 0 && spawned >= spawn_budget) instances->first_to_emit = index;
+		}
+	}
+	
+	auto stats = &emitter_stats[emitter_index];
+	stats->alive = particle_system_alive_count(system);
+	if (stats->alive > stats->peak) stats->peak = stats->alive;
+	
+	return starved;
+}
+
+struct SimulationStep {
+	Physics* physics;
+	float dt;
+	float friction_factor;
+	
+	ParticleSystem* system;
+	KillVolume* kill_volumes;
+	uint32_t kill_volume_count;
+	
+	ParticleEventQueue* events;
+	uint32_t record_deaths; // 0 or 1.
+	uint32_t record_collisions; // 0 or 1. Colliding particles die.
+	vec2 world_half_size;
+};
+
+// Here is our simple simulation loop. Each chunk is simulated independently, so chunks can run in parallel.
+void simulate_chunk(SimulationStep* step, ParticleChunkView view) {
+	Physics* physics = step->physics;
+	float dt = step->dt;
+	
+	ParticleEventQueue* events = step->events;
+	uint32_t event_base = view.chunk_index * events->chunk_capacity;
+	uint32_t event_count = 0;
+	
+	vec2 bounds_min, bounds_max;
+	particle_bounds_empty(&bounds_min, &bounds_max);
+	
+	for (uint32_t i = 0; i < view.count; i += 1) {
+		Particle* p = &view.particles[i];
+		
+		if (p->life < 0) continue; // Do not simulate particles that have already died.
+		
+		// Apply gravity.
+		p->velocity.xy += physics->gravity * dt;
+		
+		// Apply force fields.
+		// #speed: This is not the most optimal thing. 
+		for (int a = 0; a < physics->attractor_count; a += 1) {
+			Attractor attractor = physics->attractors[a];
+			if (!attractor.active) continue;
 			
-			// Apply gravity.
-			p->velocity.xy += physics.gravity * dt;
+			vec2 delta = attractor.position - p->position.xy; // Points to attractor
+			float distance2 = norm2(delta);
+			float distance = sqrt(distance2);
+			vec2 direction = normalize(delta);
 			
-			// Apply force fields.
-			// #speed: This is not the most optimal thing. 
-			for (int a = 0; a < physics.attractor_count; a += 1) {
-				Attractor attractor = physics.attractors[a];
-				if (!attractor.active) continue;
-				
-				vec2 delta = attractor.position - p->position.xy; // Points to attractor
-				float distance2 = norm2(delta);
-				float distance = sqrt(distance2);
-				vec2 direction = normalize(delta);
-				
-				vec2 force = {0, 0};
-				if (distance2 < attractor.radius * attractor.radius) {
-					switch (attractor.force_type) {
-					  case ForceType::INVERSE_SQUARED: force = (attractor.factor / distance2) * direction; break;
-					  case ForceType::INVERSE: force = (attractor.factor / distance) * direction; break;
-					  case ForceType::LINEAR: force = (attractor.factor * distance) * direction; break; 
-					}
+			vec2 force = {0, 0};
+			if (distance2 < attractor.radius * attractor.radius) {
+				switch (attractor.force_type) {
+				  case ForceType::INVERSE_SQUARED: force = (attractor.factor / distance2) * direction; break;
+				  case ForceType::INVERSE: force = (attractor.factor / distance) * direction; break;
+				  case ForceType::LINEAR: force = (attractor.factor * distance) * direction; break; 
 				}
-				
-				auto force_magnitude = norm(force);
-				if (force_magnitude > attractor.magnitude_cap) force *= attractor.magnitude_cap / force_magnitude;
-				
-				p->velocity.xy += force * dt;
 			}
 			
-			// Integrate our position.
-			p->position += p->velocity * dt;
+			auto force_magnitude = norm(force);
+			if (force_magnitude > attractor.magnitude_cap) force *= attractor.magnitude_cap / force_magnitude;
+			
+			p->velocity.xy += force * dt;
+		}
+		
+		// Integrate our position.
+		p->position += p->velocity * dt;
+		
+		// Apply friction.
+		p->velocity *= step->friction_factor;
+		
+		// Decrease the particle's life.
+		p->life -= dt;
+		
+		// Make the particles fade as they die. (A bit of a #hardcoded effect).
+		p->color.w = fmin(p->color.w, p->life);
+		
+		particle_bounds_add(&bounds_min, &bounds_max, p->position.xy); // Nearly free, since the particle is in registers already.
+		
+		// Collisions with the world bounds. The event gets the point of contact, and the velocity bounced off the bounds.
+		vec2 inside = {
+			fmin(fmax(p->position.x, -step->world_half_size.x), step->world_half_size.x),
+			fmin(fmax(p->position.y, -step->world_half_size.y), step->world_half_size.y),
+		};
+		uint32_t collided_x = inside.x != p->position.x;
+		uint32_t collided_y = inside.y != p->position.y;
+		uint32_t died = p->life < 0;
+		uint32_t collided = (collided_x | collided_y) & step->record_collisions;
+		
+		// We always write the event, but only keep it if something happened. This way, recording events does not branch.
+		uint32_t event_index = event_base + event_count;
+		events->positions[event_index] = inside;
+		events->velocities[event_index] = {collided_x ? -p->velocity.x : p->velocity.x, collided_y ? -p->velocity.y : p->velocity.y};
+		event_count += (died & step->record_deaths) | collided;
+		
+		// If the particle is dead, give its slot back to the chunk. This also sets its size to 0, so that it is never rendered.
+		if (died | collided) particle_kill(view.chunk, i);
+	}
+	
+	events->counts[view.chunk_index] = event_count;
+	particle_chunk_store_bounds(view.chunk, bounds_min, bounds_max);
+	
+	// While the chunk is still in cache. Particles that leave this way do not count as deaths for sub-emitters.
+	particle_chunk_kill_in_volumes(step->system, view.chunk, step->kill_volumes, step->kill_volume_count);
+}
+
+// Runs simulate_chunk over every chunk of a CPU system, in parallel. Deaths and collisions go to 'events' (if given), as 'trigger' asks.
+void simulate_system(ParticleSystem* system, float dt, ParticleEventQueue* events, SubEmitterTrigger trigger) {
+	if (!events) {
+		events = &unheard_events;
+		event_queue_prepare(events, system);
+	}
+	
+	KillVolume kill_volumes[max_kill_volume_count + 1];
+	
+	SimulationStep step;
+	step.system = system;
+	step.kill_volumes = kill_volumes;
+	step.kill_volume_count = sandbox_get_kill_volumes(kill_volumes);
+	step.physics = &state.physics;
+	step.dt = dt;
+	step.friction_factor = pow(state.physics.friction, dt * friction_reference_frame_rate);
+	step.events = events;
+	step.record_deaths = trigger == SubEmitterTrigger::DEATH;
+	step.record_collisions = trigger == SubEmitterTrigger::COLLISION;
+	step.world_half_size = {state.space_width * 0.5f, state.space_height * 0.5f};
+	
+	particle_system_for_each_chunk(system, Execution::parallel, [&](ParticleChunkView view) { simulate_chunk(&step, view); });
+}
+
+// The kill volumes of the sandbox, with the world bounds as an extra volume if enabled. Returns how many there are.
+uint32_t sandbox_get_kill_volumes(KillVolume volumes[max_kill_volume_count + 1]) {
+	auto kill_volumes = &state.kill_volumes;
+	
+	uint32_t count = 0;
+	if (kill_volumes->kill_outside_world) {
+		KillVolume world;
+		kill_volume_init(&world);
+		world.type = KillVolumeType::OUTSIDE_BOX;
+		world.min = {-state.space_width * 0.5f, -state.space_height * 0.5f};
+		world.max = {+state.space_width * 0.5f, +state.space_height * 0.5f};
+		volumes[count++] = world;
+	}
+	
+	for (int v = 0; v < kill_volumes->volume_count; v += 1) volumes[count++] = kill_volumes->volumes[v];
+	return count;
+}
+
+// Makes room for one event per particle of 'system', and empties the queue.
+void event_queue_prepare(ParticleEventQueue* queue, ParticleSystem* system) {
+	uint32_t capacity = particle_system_capacity(system);
+	if (queue->capacity < capacity) {
+		delete[] queue->positions;
+		delete[] queue->velocities;
+		delete[] queue->counts;
+		
+		queue->capacity = capacity;
+		queue->positions = new vec2[capacity];
+		queue->velocities = new vec2[capacity];
+		queue->counts = new uint32_t[capacity / system->chunk_capacity];
+	}
+	
+	queue->chunk_capacity = system->chunk_capacity;
+	memset(queue->counts, 0, sizeof(uint32_t) * (queue->capacity / queue->chunk_capacity));
+}
+
+// Spawns the particles of an emitter's sub-emitter for the events gathered in its last update. Returns how many particles we failed to spawn.
+int emitter_process_events(int emitter_index) {
+	auto sub_emitter = &state.sub_emitters[emitter_index];
+	auto events = &event_queues[emitter_index];
+	if (sub_emitter->trigger == SubEmitterTrigger::NONE || !events->capacity) return 0;
+	
+	int target_index = sub_emitter->target_emitter;
+	if (target_index < 0 || target_index >= state.emitter_count || !state.emitters[target_index].active) return 0;
+	
+	emitter_get_system(target_index);
+	emitter_update_simulation_mode(target_index);
+	
+	EffectInstance instance;
+	effect_instance_init(&instance);
+	
+	int starved = 0;
+	
+	uint32_t chunk_count = events->capacity / events->chunk_capacity;
+	for (uint32_t c = 0; c < chunk_count; c += 1) {
+		uint32_t base = c * events->chunk_capacity;
+		for (uint32_t i = base; i < base + events->counts[c]; i += 1) {
+			vec2 base_velocity = events->velocities[i] * sub_emitter->inherited_velocity;
+			instance.position = events->positions[i];
+			
+			int count = random_get1(sub_emitter->particles_per_event);
+			for (int k = 0; k < count; k += 1) {
+				if (!emitter_spawn(target_index, 0, &instance, base_velocity)) starved += 1;
+			}
+		}
+		events->counts[c] = 0;
+	}
+	
+	return starved;
+}
+
+// Advances an emitter by 'dt' seconds: simulates the live particles, then spawns the ones that were due within this step.
+// Returns how many particles we failed to spawn.
+int emitter_update(int emitter_index, float dt, int spawn_budget) {
+	auto system = systems[emitter_index];
+	
+	if (!particle_ropes) emitter_rope_clear(emitter_index);
+	
+	particle_system_advance(system, dt);
+	
+	auto events = &event_queues[emitter_index];
+	event_queue_prepare(events, system);
+	
+	if (system->simulation == ParticleSimulation::CPU) {
+		simulate_system(system, dt, events, state.sub_emitters[emitter_index].trigger);
+		
+		// The simulation moved the particles freely, so the ropes pull them back together, before trails record where they are.
+		if (particle_ropes && emitter_ropes[emitter_index].solver) {
+			emitter_rope_remove_dead(emitter_index);
+			constraint_solver_solve(emitter_ropes[emitter_index].solver, dt);
+		}
+		particle_system_push_trails(system);
+	} else if (system->simulation == ParticleSimulation::BALLISTIC) {
+		ballistic_kill_timer[emitter_index] += dt;
+		if (ballistic_kill_timer[emitter_index] >= ballistic_kill_interval) {
+			ballistic_kill_timer[emitter_index] = 0;
+			
+			KillVolume kill_volumes[max_kill_volume_count + 1];
+			uint32_t kill_volume_count = sandbox_get_kill_volumes(kill_volumes);
+			particle_system_kill_in_volumes(system, kill_volumes, kill_volume_count);
+		}
+	}
+	// GPU systems were simulated by particle_system_advance, kill volumes included.
+	
+	// New particles are already placed where they are at the end of this step, so we spawn them after simulating.
+	return emitter_emit(emitter_index, dt, spawn_budget);
+}
+
+// Finds where an emitter's particles can be, from the bounds its particle system keeps, and where it will spawn next.
+void emitter_update_bounds(int emitter_index) {
+	auto emitter = &state.emitters[emitter_index];
+	auto system = systems[emitter_index];
+	auto stats = &emitter_stats[emitter_index];
+	
+	vec2 bounds_min = {+INFINITY, +INFINITY};
+	vec2 bounds_max = {-INFINITY, -INFINITY};
+	auto add_point = [&](vec2 p) {
+		bounds_min = {fmin(bounds_min.x, p.x), fmin(bounds_min.y, p.y)};
+		bounds_max = {fmax(bounds_max.x, p.x), fmax(bounds_max.y, p.y)};
+	};
+	
+	// Wherever it will spawn next, so that an emitter that is off-screen with no particles still shows up once it moves into view.
+	// Instances can be rotated, so we bound the offset by a circle.
+	float offset_radius;
+	if (emitter->offset.coords == Coords2D::POLAR) {
+		offset_radius = fmax(fabs(emitter->offset.min.x), fabs(emitter->offset.max.x));
+	} else {
+		offset_radius = norm({fmax(fabs(emitter->offset.min.x), fabs(emitter->offset.max.x)), fmax(fabs(emitter->offset.min.y), fabs(emitter->offset.max.y))});
+	}
+	
+	auto shape = &state.emitter_shapes[emitter_index];
+	if (shape->shape_index > 0 && shape->shape_index < NUM_SHAPE_PRESETS) {
+		Rect shape_bounds = shape_presets[shape->shape_index]->bounds;
+		vec2 far_corner = {fmax(fabs(shape_bounds.x), fabs(shape_bounds.x + shape_bounds.w)), fmax(fabs(shape_bounds.y), fabs(shape_bounds.y + shape_bounds.h))};
+		offset_radius += norm(far_corner) * fabs(shape->shape_scale);
+	}
+	
+	auto instances = &emitter_instances[emitter_index];
+	float max_instance_scale = 1;
+	if (instances->count == 0) {
+		add_point(emitter->position - vec2{offset_radius, offset_radius});
+		add_point(emitter->position + vec2{offset_radius, offset_radius});
+	}
+	for (int i = 0; i < instances->count; i += 1) {
+		auto instance = &instances->instances[i];
+		float radius = offset_radius * instance->scale;
+		add_point(instance->position - vec2{radius, radius});
+		add_point(instance->position + vec2{radius, radius});
+		max_instance_scale = i == 0 ? instance->scale : fmax(max_instance_scale, instance->scale);
+	}
+	
+	// Exact for CPU particles, which our simulation loop gathers as it goes. BALLISTIC ones are bounded by how far they can have gone since they spawned.
+	Rect particle_bounds;
+	if (particle_system_bounds(system, &particle_bounds)) {
+		add_point(particle_bounds.position);
+		add_point(particle_bounds.position + particle_bounds.size);
+	}
+	
+	// Positions are particle centers, and our meshes span [-0.5, 0.5] times the particle size.
+	float margin = 0.5f * fmax(emitter->size.min, emitter->size.max) * max_instance_scale;
+	bounds_min -= vec2{margin, margin};
+	bounds_max += vec2{margin, margin};
+	
+	if (state.kill_volumes.kill_outside_world) {
+		// Particles cannot be outside the world for long. (BALLISTIC ones for up to ballistic_kill_interval, which the view is unlikely to notice.)
+		vec2 world_max = {state.space_width * 0.5f + margin, state.space_height * 0.5f + margin};
+		bounds_min = {fmax(bounds_min.x, -world_max.x), fmax(bounds_min.y, -world_max.y)};
+		bounds_max = {fmin(bounds_max.x, +world_max.x), fmin(bounds_max.y, +world_max.y)};
+	}
+	
+	stats->bounds = {bounds_min.x, bounds_min.y, bounds_max.x - bounds_min.x, bounds_max.y - bounds_min.y};
+}
+
+// Whether any part of 'bounds' ends up inside the viewport.
+bool bounds_visible(Rect bounds, mat4 projection) {
+	vec2 ndc_min = {+INFINITY, +INFINITY};
+	vec2 ndc_max = {-INFINITY, -INFINITY};
+	for (int corner = 0; corner < 4; corner += 1) {
+		vec4 p = {bounds.x + (corner & 1) * bounds.w, bounds.y + (corner >> 1) * bounds.h, 0, 1};
+		p = projection * p;
+		ndc_min = {fmin(ndc_min.x, p.x / p.w), fmin(ndc_min.y, p.y / p.w)};
+		ndc_max = {fmax(ndc_max.x, p.x / p.w), fmax(ndc_max.y, p.y / p.w)};
+	}
+	
+	return ndc_min.x <= 1 && ndc_max.x >= -1 && ndc_min.y <= 1 && ndc_max.y >= -1;
+}
+
+// How much time an emitter should be advanced by this frame. Off-screen emitters follow their OffscreenPolicy.
+float emitter_lod_step(int emitter_index, float dt) {
+	auto lod = &state.emitter_lods[emitter_index];
+	
+	if (emitter_stats[emitter_index].visible || lod->offscreen_policy == OffscreenPolicy::FULL) {
+		// Catch up on whatever we skipped while it was off-screen. sandbox_step splits it into substeps.
+		float step = dt + skipped_time[emitter_index];
+		skipped_time[emitter_index] = 0;
+		return step;
+	}
+	
+	if (lod->offscreen_policy == OffscreenPolicy::PAUSE) return 0;
+	
+	skipped_time[emitter_index] += dt;
+	if (skipped_time[emitter_index] < lod->offscreen_update_interval) return 0;
+	
+	float step = skipped_time[emitter_index];
+	skipped_time[emitter_index] = 0;
+	return step;
+}
+
+// How long an emitter needs to run before it looks like it has always been running.
+float emitter_steady_state_time(Emitter* emitter) {
+	return fmax(emitter->life.min, emitter->life.max) + fmax(emitter->emission_interval.min, emitter->emission_interval.max);
+}
+
+// Advances every active emitter by 'dt' seconds, then spawns the particles of their sub-emitters.
+// With 'use_lod', off-screen emitters are advanced as their OffscreenPolicy says instead.
+void sandbox_step(float dt, bool use_spawn_budgets, bool use_lod) {
+	float remaining[max_emitter_count] = {};
+	for (int e = 0; e < state.emitter_count; e += 1) {
+		if (!state.emitters[e].active) continue;
+		remaining[e] = use_lod ? emitter_lod_step(e, dt) : dt;
+	}
+	
+	// Emitters that catch up on skipped time take several substeps of up to lod_max_substep. They all take them together,
+	// so that sub-emitters spawn their particles after each one, from events that the next substep would overwrite.
+	bool pending = true;
+	while (pending) {
+		bool stepped[max_emitter_count] = {};
+		for (int e = 0; e < state.emitter_count; e += 1) {
+			if (remaining[e] <= 0) continue;
 			
-			// Apply friction.
-			p->velocity *= physics.friction;
+			float step = fmin(remaining[e], lod_max_substep);
+			if (remaining[e] - step < lod_max_substep * 0.01f) step = remaining[e]; // Rather than a sliver of a step.
+			remaining[e] -= step;
+			stepped[e] = true;
 			
-			// Decrease the particle's life.
-			p->life -= dt;
+			emitter_get_system(e);
+			emitter_update_simulation_mode(e);
 			
-			// Make the particles fade as they die. (A bit of a #hardcoded effect).
-			p->color.w = fmin(p->color.w, p->life);
+			int starved = emitter_update(e, step, use_spawn_budgets ? state.emitter_options[e].spawn_budget : 0);
+			notify_starvation(starved);
+		}
+		
+		// Every emitter has finished its substep by now, so new particles from sub-emitters are not simulated twice.
+		pending = false;
+		for (int e = 0; e < state.emitter_count; e += 1) {
+			if (stepped[e]) notify_starvation(emitter_process_events(e));
+			if (remaining[e] > 0) pending = true;
+		}
+	}
+}
+
+void sandbox_prewarm(float budget_seconds) {
+	float seconds = 0;
+	for (int e = 0; e < state.emitter_count; e += 1) {
+		if (!state.emitters[e].active) continue;
+		
+		seconds = fmax(seconds, emitter_steady_state_time(&state.emitters[e]));
+		
+		particle_system_clear(emitter_get_system(e));
+		emitter_rope_clear(e);
+		
+		// Emit right away.
+		emission_states[e].period = -1;
+		auto instances = &emitter_instances[e];
+		for (int i = 0; i < instances->count; i += 1) instances->emission[i].period = -1;
+		
+		skipped_time[e] = 0;
+	}
+	
+	double start_time = glfwGetTime();
+	
+	// All emitters advance together, since sub-emitters spawn particles into other emitters.
+	float remaining = seconds;
+	while (remaining > 0) {
+		float step = remaining;
+		for (int e = 0; e < state.emitter_count; e += 1) {
+			if (!state.emitters[e].active) continue;
 			
-			// If the particle is dead, set its size to 0, so that it is never rendered.
-			if (p->life < 0) p->scale = 0;
+			emitter_update_simulation_mode(e);
+			if (systems[e]->simulation == ParticleSimulation::BALLISTIC) {
+				// Ballistic particles need no simulation at all, so we can jump straight from one emission to the next. 
+				// Spawns within an emission are backdated, so this is exact in continuous mode too.
+				// With instances, emissions are everywhere, so we just take steps as big as the others.
+				if (state.emitter_options[e].emission_mode == EmissionMode::EVENTS_ONLY) continue;
+				if (emitter_instances[e].count > 0) {
+					step = fmin(step, prewarm_step);
+					continue;
+				}
+				float emission_step = emission_states[e].period - emission_states[e].timer;
+				step = fmin(step, fmax(emission_step, min_prewarm_step));
+			} else {
+				// Otherwise, we simulate with coarser steps than a frame. Nobody sees these frames, so a bit less accuracy is fine.
+				step = fmin(step, prewarm_step);
+			}
 		}
 		
+		sandbox_step(step, false, false); // Nobody sees these steps, so there is no point in spreading spawns over them.
+		remaining -= step;
+		
+		// Better a colder effect than a frame hitch. The emitters will keep warming up as usual.
+		if (glfwGetTime() - start_time > budget_seconds) break;
+	}
+}
+
+void sandbox_frame(float dt) {
+	render_target_clear(nullptr, {0, 0, 0, 1});	
+		
+	RenderState render_state;
+	render_state.render_target = hdr_render_target;
+	render_state.projection = orthographic(-state.space_width * 0.5, +state.space_width * 0.5, +state.space_height * 0.5, -state.space_height * 0.5, -1, +1);
+	render_state.viewport = {0, 0, (float) hdr_render_target->width, (float) hdr_render_target->height};
+	
+	render_target_clear(hdr_render_target, {0, 0, 0, 1});
+	
+	if (prewarm_pending) {
+		// We just loaded a new state. Make its effects look like they have been running for a while.
+		sandbox_prewarm(prewarm_budget_seconds);
+		prewarm_pending = false;
+	}
+	
+	// Cull emitters against the view, so that off-screen ones can be updated less often.
+	for (int e = 0; e < state.emitter_count; e += 1) {
+		if (!state.emitters[e].active) continue;
+		
+		emitter_get_system(e);
+		emitter_update_bounds(e);
+		emitter_stats[e].visible = bounds_visible(emitter_stats[e].bounds, render_state.projection);
+	}
+	
+	// For each emitter, spawn new particles, if it is time to do so, and simulate them.
+	sandbox_step(dt, true, true);
+	
+	reorder_frame += 1;
+	for (int s = 0; s < state.emitter_count; s += 1) {
+		auto emitter = &state.emitters[s];
+		if (!emitter->active) continue;
+		
+		auto system = systems[s];
+		
+		// Between simulating and uploading, as it moves particles around. Emitters take turns, so the sorting is spread over the interval.
+		bool reorder_turn = (reorder_frame + s) % reorder_interval_frames == 0;
+		if (reorder_particles && !particle_ropes && reorder_turn) particle_system_reorder_step(system, reorder_chunks_per_step);
+		emitter_stats[s].alive = particle_system_alive_count(system);
+		emitter_stats[s].capacity = particle_system_capacity(system);
+		
 		render_state.texture0 = texture_presets[emitter->texture_index];
+		render_state.blend_mode = emitter->texture_index > 0 ? BlendMode::ADDITIVE : BlendMode::ALPHA; // Our textures are glows.
+		
+		render_state.vertex_shader = system->simulation == ParticleSimulation::CPU ? spinning_particle_vertex_shader : nullptr;
+		draw_queue_add_particles(draw_queue, system, mesh_presets[emitter->mesh_index], &render_state);
 		
-		if (emitter->texture_index > 0) glBlendFunc(GL_SRC_ALPHA, GL_ONE); // #temporary
-		particle_system_upload_and_render(system, mesh_presets[emitter->mesh_index], &render_state);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // #temporary: Reset default opengl state
+		render_state.vertex_shader = nullptr; // Trails have a shader of their own.
+		draw_queue_add_trails(draw_queue, system, &render_state);
 	}
 	
+	// Emitters that share a mesh and texture end up next to each other, and are drawn together.
+	draw_queue_submit(draw_queue);
+	
 	hdr_blit_render_state.texture0 = render_target_flush(hdr_render_target);
 	
 	immediate_rect({0, 0, 1, 1});
 	immediate_flush(&hdr_blit_render_state);
 	
 	sandbox_ui(&state, dt);
+	
+	render_state_reset(); // ImGui draws next, with OpenGL directly.
+}
+
+int emitter_add_instance(int emitter_index, EffectInstance* instance) {
+	auto instances = &emitter_instances[emitter_index];
+	if (instances->count >= max_instances_per_emitter) return -1;
+	
+	if (instances->count == instances->capacity) {
+		int capacity = instances->capacity ? instances->capacity * 2 : 64;
+		
+		auto new_instances = new EffectInstance[capacity];
+		auto new_emission = new EmissionState[capacity];
+		if (instances->count) {
+			memcpy(new_instances, instances->instances, instances->count * sizeof(EffectInstance));
+			memcpy(new_emission, instances->emission, instances->count * sizeof(EmissionState));
+		}
+		delete[] instances->instances;
+		delete[] instances->emission;
+		
+		instances->instances = new_instances;
+		instances->emission = new_emission;
+		instances->capacity = capacity;
+	}
+	
+	int index = instances->count;
+	instances->count += 1;
+	
+	instances->instances[index] = *instance;
+	instances->emission[index] = {};
+	instances->emission[index].period = -1; // Emit right away.
+	instances->emission_rate_sum += instance->emission_rate;
+	
+	return index;
+}
+
+void emitter_remove_instance(int emitter_index, int instance_index) {
+	auto instances = &emitter_instances[emitter_index];
+	SPARKLES_ASSERT(instance_index >= 0 && instance_index < instances->count);
+	
+	instances->emission_rate_sum -= instances->instances[instance_index].emission_rate;
+	
+	// Its particles are already in the shared pool, and just live out their lives.
+	instances->count -= 1;
+	instances->instances[instance_index] = instances->instances[instances->count];
+	instances->emission[instance_index] = instances->emission[instances->count];
+	
+	if (instances->count == 0) instances->emission_rate_sum = 0; // Do not let rounding errors pile up.
+}
+
+void emitter_clear_instances(int emitter_index) {
+	auto instances = &emitter_instances[emitter_index];
+	instances->count = 0;
+	instances->emission_rate_sum = 0;
+	instances->first_to_emit = 0;
+}
+
+int emitter_instance_count(int emitter_index) {
+	return emitter_instances[emitter_index].count;
+}
+
+EffectInstance* emitter_get_instance(int emitter_index, int instance_index) {
+	SPARKLES_ASSERT(instance_index >= 0 && instance_index < emitter_instances[emitter_index].count);
+	return &emitter_instances[emitter_index].instances[instance_index];
+}
+
+void emitter_instances_ordered_remove(int emitter_index) {
+	// We keep the storage of the deleted emitter around, for whichever emitter takes the last slot.
+	auto removed = emitter_instances[emitter_index];
+	for (int e = emitter_index; e < max_emitter_count - 1; e += 1) {
+		emitter_instances[e] = emitter_instances[e + 1];
+	}
+	emitter_instances[max_emitter_count - 1] = removed;
+	emitter_clear_instances(max_emitter_count - 1);
 }
 
 void sandbox_state_init(SandboxState* state) {
@@ -263,6 +1154,51 @@ void sandbox_state_init(SandboxState* state) {
 	
 	state->emitter_count = 1;
 	emitter_init(&state->emitters[0]);
+	
+	for (int e = 0; e < max_emitter_count; e += 1) emitter_options_init(&state->emitter_options[e]);
+	for (int e = 0; e < max_emitter_count; e += 1) sub_emitter_init(&state->sub_emitters[e]);
+	for (int e = 0; e < max_emitter_count; e += 1) emitter_lod_init(&state->emitter_lods[e]);
+	for (int e = 0; e < max_emitter_count; e += 1) emitter_shape_init(&state->emitter_shapes[e]);
+	kill_volumes_init(&state->kill_volumes);
+	for (int e = 0; e < max_emitter_count; e += 1) emitter_trail_init(&state->emitter_trails[e]);
+}
+
+void sandbox_remove_emitter(SandboxState* state, int emitter_index) {
+	// Its particles go with it. We keep the storage of its event queue, for the slot past the last emitter.
+	if (systems[emitter_index]) particle_system_destroy(systems[emitter_index]);
+	if (emitter_ropes[emitter_index].solver) constraint_solver_destroy(emitter_ropes[emitter_index].solver);
+	auto removed_events = event_queues[emitter_index];
+	
+	// Every per-emitter array of the state moves down by one, and so does our runtime state, so that each emitter keeps its own pool and timers.
+	for (int e = emitter_index; e < state->emitter_count - 1; e += 1) {
+		state->emitters[e] = state->emitters[e + 1];
+		state->emitter_options[e] = state->emitter_options[e + 1];
+		state->sub_emitters[e] = state->sub_emitters[e + 1];
+		state->emitter_lods[e] = state->emitter_lods[e + 1];
+		state->emitter_shapes[e] = state->emitter_shapes[e + 1];
+		state->emitter_trails[e] = state->emitter_trails[e + 1];
+		
+		systems[e] = systems[e + 1];
+		emission_states[e] = emission_states[e + 1];
+		event_queues[e] = event_queues[e + 1];
+		skipped_time[e] = skipped_time[e + 1];
+		ballistic_kill_timer[e] = ballistic_kill_timer[e + 1];
+		emitter_stats[e] = emitter_stats[e + 1];
+		emitter_ropes[e] = emitter_ropes[e + 1];
+	}
+	state->emitter_count -= 1;
+	
+	// The next emitter added there starts from scratch.
+	int last = state->emitter_count;
+	systems[last] = nullptr;
+	emission_states[last] = {};
+	event_queues[last] = removed_events;
+	skipped_time[last] = 0;
+	ballistic_kill_timer[last] = 0;
+	emitter_stats[last] = {};
+	emitter_ropes[last] = {};
+	
+	emitter_instances_ordered_remove(emitter_index);
 }
 
 void physics_init(Physics* physics) {
@@ -298,3 +1234,64 @@ void emitter_init(Emitter* emitter) {
 	emitter->colors[0] = {1, 1, 1, 1};
 	emitter->color_weights[0] = 1;
 }
+
+void emitter_options_init(EmitterOptions* options) {
+	memset(options, 0, sizeof(EmitterOptions));
+	
+	options->emission_mode = EmissionMode::BURST; // What every version 1 emitter did.
+	options->spawn_budget = default_spawn_budget;
+}
+
+void emitter_lod_init(EmitterLod* lod) {
+	memset(lod, 0, sizeof(EmitterLod));
+	
+	lod->offscreen_policy = OffscreenPolicy::FULL; // What every emitter did before version 4.
+	lod->offscreen_update_interval = 0.25f;
+}
+
+void emitter_shape_init(EmitterShape* shape) {
+	memset(shape, 0, sizeof(EmitterShape));
+	
+	shape->shape_index = 0; // Only the offset, like every emitter before version 5.
+	shape->shape_scale = 4;
+}
+
+void emitter_trail_init(EmitterTrail* trail) {
+	memset(trail, 0, sizeof(EmitterTrail)); // No trails, like before version 7.
+}
+
+void kill_volumes_init(KillVolumes* kill_volumes) {
+	memset(kill_volumes, 0, sizeof(KillVolumes));
+	
+	kill_volumes->kill_outside_world = true;
+	kill_volumes->volume_count = 0;
+}
+
+void kill_volume_init(KillVolume* volume) {
+	memset(volume, 0, sizeof(KillVolume));
+	
+	volume->type = KillVolumeType::INSIDE_BOX;
+	volume->min = {-1, -1};
+	volume->max = {+1, +1};
+	volume->normal = {0, -1}; // Below the floor.
+	volume->distance = 4;
+}
+
+void effect_instance_init(EffectInstance* instance) {
+	memset(instance, 0, sizeof(EffectInstance));
+	
+	instance->position = {0, 0};
+	instance->rotation = 0;
+	instance->scale = 1;
+	instance->tint = {1, 1, 1, 1};
+	instance->emission_rate = 1;
+}
+
+void sub_emitter_init(SubEmitter* sub_emitter) {
+	memset(sub_emitter, 0, sizeof(SubEmitter));
+	
+	sub_emitter->trigger = SubEmitterTrigger::NONE;
+	sub_emitter->target_emitter = 0;
+	sub_emitter->particles_per_event = {10, 20};
+	sub_emitter->inherited_velocity = 0.5f;
+}
@@ -6,6 +6,7 @@
 #include <string.h> // For memset
 #include <math.h>
 #include <stdlib.h> // For _fullpath
+#include <stddef.h> // For offsetof
 
 #define array_size(array) (sizeof(array) / sizeof(array[0]))
 
@@ -16,6 +17,7 @@ extern GLFWwindow* the_window;
 // To use our library, just include these headers.
 #include "sparkles.h"
 #include "sparkles_utils.h"
+#include "sparkles_for_each.h"
 using namespace Sparkles;
 
 // 
@@ -38,16 +40,57 @@ static const char* texture_presets_names[NUM_TEXTURE_PRESETS] = {
 	"Sharpest Light",
 };
 
-constexpr int max_particles_per_emitter = 5000; // Feel free to tweak this.
+// We provide a number of shapes for particles to spawn on. Build your own with the emission_shape_create_ functions.
+constexpr int NUM_SHAPE_PRESETS = 5;
+static const char* shape_presets_names[NUM_SHAPE_PRESETS] = {
+	"None",
+	"Square",
+	"Circle",
+	"Wave",
+	"Ring (image)",
+};
+
+// Particle systems grow on demand, so these are just sanity limits. Feel free to tweak them.
+constexpr int max_particles_per_emission = 5000;
+constexpr int max_particles_per_emitter = 1 << 20;
+
+// Spawning is the most expensive part of a frame, so by default we spread big emissions over a few frames instead of spiking.
+constexpr int default_spawn_budget = 1000;
+
+// When we load a state, we fast-forward its emitters to their steady state, spending at most this long doing so.
+constexpr float prewarm_budget_seconds = 0.05f;
+constexpr float prewarm_step = 1.0f / 20; // Simulation step while prewarming. Coarser than a frame.
+constexpr float min_prewarm_step = 0.001f;
+
+// With spatial reordering on, each emitter sorts this many of its chunks every 'reorder_interval_frames' frames. A sorted chunk is uploaded whole.
+constexpr int reorder_chunks_per_step = 1;
+constexpr int reorder_interval_frames = 30;
+extern bool reorder_particles; // Runtime setting, not saved.
+
+// Emitters that need our simulation loop, but not their particles on the CPU, run it in a compute shader instead. See emitter_update_simulation_mode.
+extern bool gpu_simulation; // Runtime setting, not saved.
+
+// With ropes on, each particle an emitter spawns is tied to the one it spawned before, so that its particles trail along like a rope, solved by a ConstraintSolver.
+// This keeps the emitter on the CPU, and out of spatial reordering, which would move the particles the solver points at.
+extern bool particle_ropes; // Runtime setting, not saved.
+constexpr float rope_compliance = 0.00001f; // A little stretch, so that ropes sway instead of snapping tight.
+
+// Emitters catch up on the time they skipped off-screen in steps no longer than this. Coarser than a frame, but one big step would throw particles off course,
+// let them fly through kill volumes, and spawn everything they missed at once.
+constexpr float lod_max_substep = 1.0f / 20;
+
+// BALLISTIC particles are only tested against kill volumes this often, since it means evaluating every trajectory on the CPU.
+constexpr float ballistic_kill_interval = 0.1f;
 
 // To allow you to save your particle configurations, we provide a very simple serialization system.
 // Our sandbox state's raw memory is directly saved into or loaded from a binary file. For this reason, 
 // we do not store pointers or dynamic arrays into the structs below. Also, be aware that changing any field in these structs may invalidate our simple serialization format.
 
-constexpr int serialization_version = 1;
+constexpr int serialization_version = 7;
 constexpr int max_emitter_count = 8;
 constexpr int max_emitter_color_count = 16;
 constexpr int max_attractor_count = 8;
+constexpr int max_kill_volume_count = 8;
 
 struct Emitter {
 	bool active;
@@ -72,6 +115,83 @@ struct Emitter {
 	Emitter() {}
 };
 
+enum class EmissionMode : uint32_t {
+	BURST = 0,      // Every particle of an emission spawns at once.
+	CONTINUOUS = 1, // The particles of an emission are spread evenly over its period.
+	EVENTS_ONLY = 2, // Only spawns particles for the sub-emitters of other emitters.
+};
+
+static const char* emission_mode_names[] = {
+	"Bursts",
+	"Continuous",
+	"Events only",
+};
+
+// Emitter settings added after version 1. To keep older files loadable, they live in SandboxState::emitter_options, after everything else.
+struct EmitterOptions {
+	EmissionMode emission_mode;
+	int32_t spawn_budget; // Most particles spawned per frame. Bigger emissions are spread over the next frames. 0 means no limit.
+	
+	EmitterOptions() {}
+};
+
+enum class SubEmitterTrigger : uint32_t {
+	NONE = 0,
+	DEATH = 1,
+	COLLISION = 2, // With the world bounds. The particle dies there.
+};
+
+static const char* sub_emitter_trigger_names[] = {
+	"None",
+	"Death",
+	"Collision with world bounds",
+};
+
+// Spawns particles of another emitter wherever the particles of its emitter die or collide, like the second stage of a firework.
+struct SubEmitter {
+	SubEmitterTrigger trigger;
+	int32_t target_emitter; // Index of the emitter whose particle settings are used. Its own position and emission settings are ignored.
+	Range1 particles_per_event;
+	float inherited_velocity; // Fraction of the velocity of the triggering particle that new particles inherit.
+	
+	SubEmitter() {}
+};
+
+// What we do with an emitter whose particles are all outside the view.
+enum class OffscreenPolicy : uint32_t {
+	FULL = 0,     // Update it every frame anyway.
+	LOW_RATE = 1, // Update it every 'offscreen_update_interval' seconds, in steps of up to lod_max_substep.
+	PAUSE = 2,    // Freeze it until it is visible again.
+};
+
+static const char* offscreen_policy_names[] = {
+	"Full rate",
+	"Low rate",
+	"Pause",
+};
+
+struct EmitterLod {
+	OffscreenPolicy offscreen_policy;
+	float offscreen_update_interval; // In seconds. Only used by OffscreenPolicy::LOW_RATE.
+	
+	EmitterLod() {}
+};
+
+// Where particles spawn, before the emitter's offset is added.
+struct EmitterShape {
+	int32_t shape_index; // Into the shape presets. 0 means only the offset.
+	float shape_scale;
+	
+	EmitterShape() {}
+};
+
+// Ribbons drawn behind each particle, from its last positions. They need our CPU simulation, so emitters with trails are never BALLISTIC.
+struct EmitterTrail {
+	int32_t trail_length; // Past positions kept per particle, one per step. 0 means no trail.
+	
+	EmitterTrail() {}
+};
+
 enum class ForceType : uint32_t {
 	LINEAR = 0,
 	INVERSE = 1,
@@ -106,6 +226,21 @@ struct Physics {
 	Physics() {}
 };
 
+static const char* kill_volume_type_names[] = {
+	"Outside a box",
+	"Inside a box",
+	"Past a line",
+};
+
+struct KillVolumes {
+	bool kill_outside_world; // Particles die as soon as they leave the space_width x space_height area.
+	
+	int32_t volume_count;
+	KillVolume volumes[max_kill_volume_count];
+	
+	KillVolumes() {}
+};
+
 struct SandboxState {
 	uint32_t version;
 	
@@ -117,13 +252,75 @@ struct SandboxState {
 	int32_t emitter_count;
 	Emitter emitters[max_emitter_count];
 	
+	// Version 2.
+	EmitterOptions emitter_options[max_emitter_count]; // One per emitter.
+	
+	// Version 3.
+	SubEmitter sub_emitters[max_emitter_count]; // One per emitter.
+	
+	// Version 4.
+	EmitterLod emitter_lods[max_emitter_count]; // One per emitter.
+	
+	// Version 5.
+	EmitterShape emitter_shapes[max_emitter_count]; // One per emitter.
+	
+	// Version 6.
+	KillVolumes kill_volumes;
+	
+	// Version 7.
+	EmitterTrail emitter_trails[max_emitter_count]; // One per emitter.
+	
 	SandboxState() {}	
 };
 
+// Runtime statistics about each emitter's particle pool, so that we can see how well our estimates match reality.
+struct EmitterStats {
+	ParticleCountEstimate estimate;
+	uint32_t alive;
+	uint32_t peak; // Highest alive count since the estimate last changed.
+	uint32_t capacity;
+	
+	Rect bounds; // Where its particles can be, in world space.
+	bool visible;
+};
+
+extern EmitterStats emitter_stats[max_emitter_count];
+
+// A placement of an emitter, such as one bullet impact among thousands.
+// Every instance of an emitter shares its particle system, so they are all simulated in one pass and drawn in one call.
+// Instances are runtime state, like particle systems, so they are not saved with the sandbox state.
+struct EffectInstance {
+	vec2 position;
+	float rotation;      // In radians. Rotates the emitter's offset and velocity.
+	float scale;         // Scales the emitter's offset, velocity and size.
+	vec4 tint;           // Multiplies the color of each particle.
+	float emission_rate; // Multiplies the particles per emission.
+};
+
+constexpr int max_instances_per_emitter = 1 << 16;
+
+// An emitter without instances acts as a single instance at its own position.
+int  emitter_add_instance(int emitter_index, EffectInstance* instance); // Returns the index of the new instance, or -1 if the emitter has too many.
+void emitter_remove_instance(int emitter_index, int instance_index);    // The last instance takes its index.
+void emitter_clear_instances(int emitter_index);
+int  emitter_instance_count(int emitter_index);
+EffectInstance* emitter_get_instance(int emitter_index, int instance_index);
+void emitter_instances_ordered_remove(int emitter_index); // When an emitter is deleted, its instances go with it, and the next emitters' instances move down.
+
 void emitter_init(Emitter* emitter);
+void emitter_options_init(EmitterOptions* options);
+void sub_emitter_init(SubEmitter* sub_emitter);
+void emitter_lod_init(EmitterLod* lod);
+void emitter_shape_init(EmitterShape* shape);
+void emitter_trail_init(EmitterTrail* trail);
+void kill_volumes_init(KillVolumes* kill_volumes);
+void kill_volume_init(KillVolume* volume);
+void effect_instance_init(EffectInstance* instance);
+void sandbox_prewarm(float budget_seconds = prewarm_budget_seconds); // Fast-forwards every active emitter to its steady state.
 void attractor_init(Attractor* attractor);
 void physics_init(Physics* physics);
 void sandbox_state_init(SandboxState* state);
+void sandbox_remove_emitter(SandboxState* state, int emitter_index); // Along with its options, whatever else the state keeps per emitter, and its particles and instances.
 
 void  immediate_init();
 void  immediate_rect(Rect rect, vec4 color = {1, 1, 1, 1});
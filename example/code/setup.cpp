@@ -4,6 +4,7 @@
 //
 
 #include <math.h> // For fmin
+#include <string.h> // For strcmp
 
 #if _WIN32 
 #include <windows.h>
@@ -39,8 +40,12 @@ constexpr float aspect_ratio = 16.0 / 9.0; // #hardcoded #temporary
 void system_sleep_ms(int milliseconds);
 bool sandbox_init();
 void sandbox_frame(float dt);
+int gpu_simulation_check(); // See gpu_check.cpp.
 
-int main() {	
+int main(int argc, char** argv) {	
+	// Compares the GPU simulation to the CPU one, then exits, without showing anything.
+	bool check_gpu_simulation = argc > 1 && strcmp(argv[1], "--check-gpu-simulation") == 0;
+	
 	if (!glfwInit()) return 1;
 	
 	GLFWmonitor* monitor = glfwGetPrimaryMonitor();
@@ -53,6 +58,7 @@ int main() {
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
 	// glfwWindowHint(GLFW_MAXIMIZED, true);
 	glfwWindowHint(GLFW_RESIZABLE, GL_FALSE); // #temporary
+	if (check_gpu_simulation) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 	
 	the_window = glfwCreateWindow(window_width, window_height, "Sparkles!", nullptr, nullptr);
 	
@@ -71,6 +77,13 @@ int main() {
 		return 1;
 	}
 	
+	if (check_gpu_simulation) {
+		int result = gpu_simulation_check();
+		glfwDestroyWindow(the_window);
+		glfwTerminate();
+		return result;
+	}
+	
 	{
 		// Initialize ImGui
 		IMGUI_CHECKVERSION();
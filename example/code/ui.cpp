@@ -24,6 +24,7 @@ bool draw_positions = true;
 bool draw_force_fields = true;
 
 int starvation_count;
+int instances_to_scatter = 1000;
 float starvation_timer = 0;
 
 // Some utility functions
@@ -155,6 +156,17 @@ void sandbox_ui(SandboxState* state, float dt) {
 			EndMenu();
 		}
 		
+		if (BeginMenu("Performance")) {
+			MenuItem("Reorder particles spatially", nullptr, &reorder_particles);
+			MenuItem("Simulate on the GPU", nullptr, &gpu_simulation, particle_gpu_simulation_supported());
+			EndMenu();
+		}
+		
+		if (BeginMenu("Physics")) {
+			MenuItem("Tie particles into ropes", nullptr, &particle_ropes);
+			EndMenu();
+		}
+		
 		EndMainMenuBar();
 	}
 	
@@ -282,12 +294,50 @@ void sandbox_ui(SandboxState* state, float dt) {
 			
 			if (delete_attractor_index >= 0) array_ordered_remove(&physics->attractor_count, physics->attractors, delete_attractor_index);
 			
+			// Kill volumes give the slots of particles that are gone for good back to their pools.
+			auto kill_volumes = &state->kill_volumes;
+			Checkbox("Kill particles outside the world", &kill_volumes->kill_outside_world);
+			
+			int delete_volume_index = -1;
+			for (int i = 0; i < kill_volumes->volume_count; i += 1) {
+				KillVolume* volume = &kill_volumes->volumes[i];
+				
+				PushID(1000 + i); // Apart from the attractors' IDs.
+				
+				if (TreeNodeEx("Kill volume", ImGuiTreeNodeFlags_DefaultOpen, "Kill volume %d", i + 1)) {
+					if (ColoredButton(delete_color, "Delete")) delete_volume_index = i;
+					
+					Combo("Kills", (int*) &volume->type, kill_volume_type_names, array_size(kill_volume_type_names));
+					if (volume->type == KillVolumeType::HALF_PLANE) {
+						float angle = atan2(volume->normal.y, volume->normal.x);
+						SliderAngle("Direction", &angle, -180, 180);
+						volume->normal = polar(1, angle);
+						DragFloat("Distance", &volume->distance, 0.05, -20, +20, "%.1f");
+					} else {
+						DragFloat2("Min (x, y)", &volume->min.x, 0.05, -20, +20, "%.1f");
+						DragFloat2("Max (x, y)", &volume->max.x, 0.05, -20, +20, "%.1f");
+					}
+					TreePop();
+				}
+				PopID();
+			}
+			
+			if (kill_volumes->volume_count < max_kill_volume_count) {
+				if (ColoredButton(add_color, "+ New kill volume")) {
+					kill_volume_init(&kill_volumes->volumes[kill_volumes->volume_count]);
+					kill_volumes->volume_count += 1;
+				}
+			}
+			
+			if (delete_volume_index >= 0) array_ordered_remove(&kill_volumes->volume_count, kill_volumes->volumes, delete_volume_index);
+			
 			TreePop();
 		}
 		
 		int delete_emitter_index = -1;
 		for (int s = 0; s < state->emitter_count; s += 1) {
 			auto emitter = &state->emitters[s];
+			auto options = &state->emitter_options[s];
 			
 			PushID(s);
 			
@@ -304,7 +354,15 @@ void sandbox_ui(SandboxState* state, float dt) {
 				DragFloat2("Position (x, y)", &emitter->position.x, 0.05, -10, +10, "%.1f");
 				
 				DragFloatRange2("Emission period", &emitter->emission_interval.min, &emitter->emission_interval.max, 0.01, 0.05, 10, "min = %.2f s", "max = %.2f s", ImGuiSliderFlags_AlwaysClamp | ImGuiSliderFlags_Logarithmic);
-				DragFloatRange2("Particles per emission", &emitter->particles_per_emission.min, &emitter->particles_per_emission.max, 0.5, 0, max_particles_per_emitter, "min = %.0f", "max = %.0f", ImGuiSliderFlags_AlwaysClamp);
+				DragFloatRange2("Particles per emission", &emitter->particles_per_emission.min, &emitter->particles_per_emission.max, 0.5, 0, max_particles_per_emission, "min = %.0f", "max = %.0f", ImGuiSliderFlags_AlwaysClamp);
+				Combo("Emission mode", (int*) &options->emission_mode, emission_mode_names, array_size(emission_mode_names));
+				DragInt("Spawn budget per frame", &options->spawn_budget, 10, 0, max_particles_per_emission, options->spawn_budget ? "%d" : "No limit", ImGuiSliderFlags_AlwaysClamp);
+				
+				auto lod = &state->emitter_lods[s];
+				Combo("When off-screen", (int*) &lod->offscreen_policy, offscreen_policy_names, array_size(offscreen_policy_names));
+				if (lod->offscreen_policy == OffscreenPolicy::LOW_RATE) {
+					SliderFloat("Off-screen update period", &lod->offscreen_update_interval, 0.05, 2, "%.2f s", ImGuiSliderFlags_AlwaysClamp);
+				}
 				
 				ImGui::BulletText("Visuals");
 				
@@ -370,8 +428,44 @@ void sandbox_ui(SandboxState* state, float dt) {
 				
 				DragFloatRange2("Speed", &emitter->velocity.min.x, &emitter->velocity.max.x, 0.1, 0, 20, "Min: %.1f", "Max: %.1f", ImGuiSliderFlags_AlwaysClamp);
 				DragAngleRange2("Direction", &emitter->velocity.min.y, &emitter->velocity.max.y);
+				auto shape = &state->emitter_shapes[s];
+				Combo("Spawn shape", &shape->shape_index, shape_presets_names, NUM_SHAPE_PRESETS);
+				if (shape->shape_index != 0) SliderFloat("Spawn shape size", &shape->shape_scale, 0.1, 16, "%.1f", ImGuiSliderFlags_Logarithmic);
+				
 				DragFloatRange2("Size", &emitter->size.min, &emitter->size.max, 0.01, 0, 4, "min = %.2f", "max = %.2f", ImGuiSliderFlags_AlwaysClamp);
 				DragFloatRange2("Life", &emitter->life.min, &emitter->life.max, 0.05, 0, 20, "min = %.1f s", "max = %.1f s", ImGuiSliderFlags_AlwaysClamp | ImGuiSliderFlags_Logarithmic);
+				SliderInt("Trail length", &state->emitter_trails[s].trail_length, 0, particle_max_trail_length, state->emitter_trails[s].trail_length ? "%d steps" : "No trail", ImGuiSliderFlags_AlwaysClamp);
+				
+				ImGui::BulletText("Sub-emitter");
+				
+				auto sub_emitter = &state->sub_emitters[s];
+				Combo("Trigger", (int*) &sub_emitter->trigger, sub_emitter_trigger_names, array_size(sub_emitter_trigger_names));
+				if (sub_emitter->trigger != SubEmitterTrigger::NONE) {
+					int target_number = sub_emitter->target_emitter + 1; // Emitters are numbered from 1 in the UI.
+					SliderInt("Spawns particles of", &target_number, 1, state->emitter_count, "Emitter %d", ImGuiSliderFlags_AlwaysClamp);
+					sub_emitter->target_emitter = target_number - 1;
+					DragFloatRange2("Particles per event", &sub_emitter->particles_per_event.min, &sub_emitter->particles_per_event.max, 0.5, 0, max_particles_per_emission, "min = %.0f", "max = %.0f", ImGuiSliderFlags_AlwaysClamp);
+					SliderFloat("Inherited velocity", &sub_emitter->inherited_velocity, 0, 1, "%.2f");
+				}
+				
+				ImGui::BulletText("Instances");
+				
+				// Scattering many small copies of an emitter shows that they cost about as much as one big one.
+				int instance_count = emitter_instance_count(s);
+				Text(instance_count ? "%d instances, sharing one pool and one draw call" : "No instances: the emitter acts as a single one", instance_count);
+				DragInt("Instances to scatter", &instances_to_scatter, 10, 1, max_instances_per_emitter, "%d", ImGuiSliderFlags_AlwaysClamp);
+				if (Button("Scatter")) {
+					for (int i = 0; i < instances_to_scatter; i += 1) {
+						EffectInstance instance;
+						effect_instance_init(&instance);
+						instance.position = {(random_get() - 0.5f) * state->space_width, (random_get() - 0.5f) * state->space_height};
+						instance.rotation = random_get() * TAU;
+						instance.scale = 0.25f + 0.5f * random_get();
+						if (emitter_add_instance(s, &instance) < 0) break;
+					}
+				}
+				SameLine();
+				if (Button("Clear")) emitter_clear_instances(s);
 				
 				TreePop();	
 			}
@@ -382,11 +476,25 @@ void sandbox_ui(SandboxState* state, float dt) {
 		if (state->emitter_count < max_emitter_count) {
 			if (ColoredButton(add_color, "+ New emitter")) {
 				state->emitters[state->emitter_count] = state->emitters[state->emitter_count - 1];
+				state->emitter_options[state->emitter_count] = state->emitter_options[state->emitter_count - 1];
+				state->sub_emitters[state->emitter_count] = state->sub_emitters[state->emitter_count - 1];
+				state->emitter_lods[state->emitter_count] = state->emitter_lods[state->emitter_count - 1];
+				state->emitter_shapes[state->emitter_count] = state->emitter_shapes[state->emitter_count - 1];
+				state->emitter_trails[state->emitter_count] = state->emitter_trails[state->emitter_count - 1];
 				state->emitter_count += 1;
 			}
 		}
 		
-		if (delete_emitter_index >= 0) array_ordered_remove(&state->emitter_count, state->emitters, delete_emitter_index);
+		if (delete_emitter_index >= 0) {
+			sandbox_remove_emitter(state, delete_emitter_index);
+			
+			// Keep sub-emitters pointing at the same emitters.
+			for (int e = 0; e < state->emitter_count; e += 1) {
+				auto sub_emitter = &state->sub_emitters[e];
+				if (sub_emitter->target_emitter == delete_emitter_index) sub_emitter->trigger = SubEmitterTrigger::NONE;
+				if (sub_emitter->target_emitter >= delete_emitter_index && sub_emitter->target_emitter > 0) sub_emitter->target_emitter -= 1;
+			}
+		}
 		
 		End();
 	}
@@ -398,6 +506,13 @@ void sandbox_ui(SandboxState* state, float dt) {
 		SetNextWindowPos(ImVec2(GetMainViewport()->Size.x, menu_bar_size.y), 0, ImVec2(1, 0));
 		Begin("Info", nullptr, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoTitleBar);
 		Text("FPS: %.0f", (1.0f / dt));
+		
+		for (int e = 0; e < state->emitter_count; e += 1) {
+			if (!state->emitters[e].active) continue;
+			auto stats = &emitter_stats[e];
+			Text("Emitter %d: %u alive, peak %u (estimated %u), capacity %u%s", e + 1, stats->alive, stats->peak, stats->estimate.peak, stats->capacity, stats->visible ? "" : " (off-screen)");
+		}
+		
 		if (starvation_timer > 0) {
 			TextColored(ImVec4(0.9, 0.1, 0.1, 1), "There are too many particles! \nDecrease the emission rate!");
 		}
@@ -486,6 +601,33 @@ void sandbox_ui(SandboxState* state, float dt) {
 					world_drag_point(state, &emitter->position, emitter_radius, emitter_color);
 				}
 			}
+			
+			constexpr vec4 kill_volume_color = {0.8, 0.2, 0.1, 0.5};
+			constexpr float kill_volume_line_width = 0.03f;
+			
+			for (int v = 0; v < state->kill_volumes.volume_count; v += 1) {
+				auto volume = &state->kill_volumes.volumes[v];
+				switch (volume->type) {
+				  case KillVolumeType::INSIDE_BOX: {
+						immediate_rect({volume->min.x, volume->min.y, volume->max.x - volume->min.x, volume->max.y - volume->min.y}, vec4(kill_volume_color.xyz, 0.1));
+					} // Fallthrough, for the outline.
+				  case KillVolumeType::OUTSIDE_BOX: {
+						vec2 corners[4] = {volume->min, {volume->max.x, volume->min.y}, volume->max, {volume->min.x, volume->max.y}};
+						for (int c = 0; c < 4; c += 1) immediate_line(corners[c], corners[(c + 1) % 4], kill_volume_line_width, kill_volume_color);
+					} break;
+					
+				  case KillVolumeType::HALF_PLANE: {
+						// The boundary line, long enough to cross the whole world.
+						float length = norm(volume->normal);
+						if (length <= 0) break;
+						vec2 normal = volume->normal / length;
+						vec2 center = normal * (volume->distance / length);
+						vec2 along = rotate2(normal, TAU * 0.25f) * (state->space_width + state->space_height);
+						immediate_line(center - along, center + along, kill_volume_line_width, kill_volume_color);
+						immediate_arrow_head(center + normal * 0.2f, normal, 0.1f, kill_volume_color);
+					} break;
+				}
+			}
 		}
 		
 		immediate_flush(&debug_render_state);
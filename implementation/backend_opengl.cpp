@@ -1,8 +1,18 @@
 #include "sparkles.h"
+#include "sparkles_internal.h"
 #include "glad/gl.h"
 
 #include <stddef.h> // For offsetof
-#include <string> // For memset
+#include <string.h> // For memset, strlen, strcmp
+#include <stdio.h> // For fopen, snprintf
+#include <math.h> // For sqrtf
+#include <stdlib.h> // For qsort, getenv
+
+#if _WIN32
+#include <direct.h> // For _mkdir
+#else
+#include <sys/stat.h> // For mkdir
+#endif
 
 static const char* glsl_default_instancing_vertex_shader_source = R"glsl(
 #version 410
@@ -11,9 +21,102 @@ layout (location = 0) in vec3 vertex_position;
 layout (location = 1) in vec4 vertex_color;
 layout (location = 2) in vec2 vertex_uv;
 
+layout (location = 3) in vec4 instance_position; // The current alpha is in w.
+layout (location = 4) in float instance_scale;
+layout (location = 5) in vec4 instance_color;    // Alpha is always 1 here. It lives with the position, since it changes every frame.
+
+uniform mat4 projection;
+
+out vec2 pixel_uv;
+out vec4 pixel_color;
+
+void main() {
+	// Dead particles have 0 alpha. They collapse to a point, so they are never rasterized.
+	float scale = (instance_position.w <= 0) ? 0 : instance_scale;
+	
+	vec4 world_position = vec4(instance_position.xyz + vertex_position * scale, 1);
+	gl_Position = projection * world_position;
+	pixel_color = vertex_color * vec4(instance_color.rgb, instance_position.w);
+	pixel_uv = vertex_uv;
+}  
+)glsl";
+
+// Particles of BALLISTIC systems are only uploaded when they spawn. Their current state is a closed-form function of their age.
+// The trajectory math must match particle_ballistic_evaluate in particles.cpp.
+// It comes after a #version line. The variant with DRAW_PARAMETERS defined draws several systems at once: each draw command reads its system's parameters from a buffer texture.
+static const char* glsl_ballistic_instancing_vertex_shader_source = R"glsl(
+#ifdef DRAW_PARAMETERS
+#extension GL_ARB_shader_draw_parameters : require
+#endif
+
+layout (location = 0) in vec3 vertex_position;
+layout (location = 1) in vec4 vertex_color;
+layout (location = 2) in vec2 vertex_uv;
+
+layout (location = 3) in vec3 instance_position; // At birth.
+layout (location = 4) in float instance_scale;
+layout (location = 5) in vec4 instance_color;
+layout (location = 6) in vec3 instance_velocity; // At birth.
+layout (location = 7) in float instance_life;    // At birth.
+layout (location = 8) in float instance_birth_time;
+
+uniform mat4 projection;
+
+#ifdef DRAW_PARAMETERS
+uniform samplerBuffer draw_params; // One texel per draw command: time, gravity and drag.
+#else
+uniform float time;
+uniform vec2 gravity;
+uniform float drag;
+#endif
+
+out vec2 pixel_uv;
+out vec4 pixel_color;
+
+void main() {
+#ifdef DRAW_PARAMETERS
+	vec4 params = texelFetch(draw_params, gl_DrawIDARB);
+	float time = params.x;
+	vec2 gravity = params.yz;
+	float drag = params.w;
+#endif
+	
+	float age = time - instance_birth_time;
+	float remaining_life = instance_life - age;
+	
+	vec3 position = instance_position;
+	if (drag > 0) {
+		float decay = exp(-drag * age);
+		vec2 terminal_velocity = gravity / drag;
+		position.xy += terminal_velocity * age + (instance_velocity.xy - terminal_velocity) * ((1 - decay) / drag);
+	} else {
+		position.xy += instance_velocity.xy * age + gravity * (0.5 * age * age);
+	}
+	
+	// Dead particles collapse to a point, so they are never rasterized.
+	float scale = (remaining_life < 0) ? 0 : instance_scale;
+	
+	vec4 world_position = vec4(position + vertex_position * scale, 1);
+	gl_Position = projection * world_position;
+	
+	// Make the particles fade as they die, like our CPU samples do.
+	pixel_color = vertex_color * vec4(instance_color.rgb, min(instance_color.a, remaining_life));
+	pixel_uv = vertex_uv;
+}  
+)glsl";
+
+// Particles of GPU systems are simulated in their instance buffer, and drawn straight from there.
+static const char* glsl_gpu_instancing_vertex_shader_source = R"glsl(
+#version 410
+
+layout (location = 0) in vec3 vertex_position;
+layout (location = 1) in vec4 vertex_color;
+layout (location = 2) in vec2 vertex_uv;
+
 layout (location = 3) in vec3 instance_position;
 layout (location = 4) in float instance_scale;
 layout (location = 5) in vec4 instance_color;
+layout (location = 7) in float instance_life;
 
 uniform mat4 projection;
 
@@ -21,13 +124,383 @@ out vec2 pixel_uv;
 out vec4 pixel_color;
 
 void main() {
-	vec4 world_position = vec4(instance_position + vertex_position * instance_scale, 1);
+	// Dead particles collapse to a point, so they are never rasterized.
+	float scale = (instance_life < 0) ? 0 : instance_scale;
+	
+	vec4 world_position = vec4(instance_position + vertex_position * scale, 1);
 	gl_Position = projection * world_position;
-	pixel_color = vertex_color * instance_color;
+	
+	// Make the particles fade as they die, like our CPU samples do.
+	pixel_color = vertex_color * vec4(instance_color.rgb, min(instance_color.a, instance_life));
 	pixel_uv = vertex_uv;
 }  
 )glsl";
 
+// GPU systems are simulated by a compute shader where we have them (OpenGL 4.3), and by transform feedback otherwise.
+// Both run this one step per particle, after a #version line of their own. It follows the simulation loop of our sandbox, so that both agree with the CPU.
+// SimulationParams must match GpuSimulationParams_GL.
+static const char* glsl_gpu_simulation_common_source = R"glsl(
+struct Particle {
+	vec3 position;
+	float scale;
+	vec4 color;
+	vec3 velocity;
+	float life;
+};
+
+struct Attractor {
+	vec2 position;
+	float radius;
+	float strength;
+	float max_force;
+	uint falloff;
+};
+
+struct KillVolume {
+	vec2 min_corner;
+	vec2 max_corner;
+	vec2 normal;
+	float distance;
+	uint type;
+};
+
+layout (std140) uniform SimulationParams {
+	vec2 gravity;
+	float drag;
+	uint attractor_count;
+	uint kill_volume_count;
+	Attractor attractors[16];
+	KillVolume kill_volumes[16];
+};
+
+uniform float dt;
+
+bool in_kill_volume(KillVolume volume, vec2 position) {
+	switch (volume.type) {
+	  case 0: return any(lessThan(position, volume.min_corner)) || any(greaterThan(position, volume.max_corner)); // OUTSIDE_BOX
+	  case 1: return all(greaterThanEqual(position, volume.min_corner)) && all(lessThanEqual(position, volume.max_corner)); // INSIDE_BOX
+	  case 2: return dot(position, volume.normal) > volume.distance; // HALF_PLANE
+	}
+	return false;
+}
+
+void simulate(inout Particle p) {
+	if (p.life < 0) return; // Dead, or a slot that was never handed out.
+	
+	p.velocity.xy += gravity * dt;
+	
+	for (uint a = 0; a < attractor_count; a += 1) {
+		Attractor attractor = attractors[a];
+		vec2 delta = attractor.position - p.position.xy; // Points to the attractor.
+		float distance2 = dot(delta, delta);
+		if (distance2 >= attractor.radius * attractor.radius || distance2 == 0) continue;
+		
+		float distance = sqrt(distance2);
+		float force = 0;
+		switch (attractor.falloff) {
+		  case 0: force = attractor.strength * distance; break;  // LINEAR
+		  case 1: force = attractor.strength / distance; break;  // INVERSE
+		  case 2: force = attractor.strength / distance2; break; // INVERSE_SQUARED
+		}
+		force = clamp(force, -attractor.max_force, attractor.max_force);
+		
+		p.velocity.xy += (delta / distance) * (force * dt);
+	}
+	
+	p.position += p.velocity * dt;
+	p.velocity *= exp(-drag * dt);
+	p.life -= dt;
+	
+	for (uint v = 0; v < kill_volume_count; v += 1) {
+		if (in_kill_volume(kill_volumes[v], p.position.xy)) p.life = -1;
+	}
+	
+	// Same as particle_kill.
+	if (p.life < 0) {
+		p.life = -1;
+		p.scale = 0;
+	}
+}
+)glsl";
+
+// One particle per invocation, in place, in the chunk's instance buffer. Particles that die push their slot onto the chunk's free list, for the next spawns.
+static const char* glsl_gpu_simulation_compute_shader_source = R"glsl(
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) buffer Particles {
+	Particle particles[];
+};
+
+layout (std430, binding = 4) writeonly buffer FreeSlots {
+	uint free_slots[];
+};
+
+// The chunk's GpuSlotCounters.
+layout (binding = 0, offset = 0) uniform atomic_uint free_count;
+layout (binding = 0, offset = 4) uniform atomic_uint alive_count;
+
+uniform uint particle_count;
+
+void main() {
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count) return;
+	
+	Particle p = particles[index];
+	if (p.life < 0) return; // Nothing to write back.
+	
+	simulate(p);
+	particles[index] = p;
+	
+	if (p.life < 0) {
+		free_slots[atomicCounterIncrement(free_count)] = index; // Returns the count before, which is where the top goes.
+		atomicCounterDecrement(alive_count);
+	}
+}
+)glsl";
+
+// With compute shaders, the GPU hands out the slots of GPU systems. What spawned in a chunk since its last upload comes in a list of its own,
+// and each spawn pops a slot off the chunk's free list, which glsl_gpu_simulation_compute_shader_source pushes back when the particle dies.
+// The CPU never sends more spawns than the chunk has room for, so the list never runs dry.
+static const char* glsl_gpu_spawn_compute_shader_source = R"glsl(
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) writeonly buffer Particles {
+	Particle particles[];
+};
+
+layout (std430, binding = 1) readonly buffer Spawns {
+	Particle spawns[];
+};
+
+// Packed custom attributes, which are aligned to 4 bytes.
+layout (std430, binding = 2) writeonly buffer Attributes {
+	uint attributes[];
+};
+
+layout (std430, binding = 3) readonly buffer SpawnAttributes {
+	uint spawn_attributes[];
+};
+
+layout (std430, binding = 4) readonly buffer FreeSlots {
+	uint free_slots[];
+};
+
+// The chunk's GpuSlotCounters.
+layout (binding = 0, offset = 0) uniform atomic_uint free_count;
+layout (binding = 0, offset = 4) uniform atomic_uint alive_count;
+
+uniform uint spawn_count;
+uniform uint attribute_words; // Size of one particle's attributes, in uints. 0 if there are none.
+
+void main() {
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= spawn_count) return;
+	
+	Particle p = spawns[index];
+	if (p.life < 0) return; // Killed before it got here.
+	
+	uint slot = free_slots[atomicCounterDecrement(free_count)]; // Returns the count after, which is where the top was.
+	particles[slot] = p;
+	for (uint w = 0; w < attribute_words; w += 1) attributes[slot * attribute_words + w] = spawn_attributes[index * attribute_words + w];
+	atomicCounterIncrement(alive_count);
+}
+)glsl";
+
+// Kills every particle of a chunk, and puts all its slots on its free list, the lowest one on top, so that spawns fill the chunk from the start.
+static const char* glsl_gpu_slot_reset_compute_shader_source = R"glsl(
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) buffer Particles {
+	Particle particles[];
+};
+
+layout (std430, binding = 4) writeonly buffer FreeSlots {
+	uint free_slots[];
+};
+
+uniform uint particle_count; // The chunk's capacity.
+
+void main() {
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count) return;
+	
+	particles[index].life = -1;
+	particles[index].scale = 0;
+	free_slots[index] = particle_count - 1 - index;
+}
+)glsl";
+
+// One particle per vertex, from the chunk's instance buffer into its other one, with rasterization off. Dead particles are copied as they are.
+static const char* glsl_gpu_simulation_feedback_vertex_shader_source = R"glsl(
+layout (location = 0) in vec3 particle_position;
+layout (location = 1) in float particle_scale;
+layout (location = 2) in vec4 particle_color;
+layout (location = 3) in vec3 particle_velocity;
+layout (location = 4) in float particle_life;
+
+// Captured one after the other, which is exactly our Particle struct.
+out vec3 next_position;
+out float next_scale;
+out vec4 next_color;
+out vec3 next_velocity;
+out float next_life;
+
+void main() {
+	Particle p = Particle(particle_position, particle_scale, particle_color, particle_velocity, particle_life);
+	simulate(p);
+	
+	next_position = p.position;
+	next_scale = p.scale;
+	next_color = p.color;
+	next_velocity = p.velocity;
+	next_life = p.life;
+}
+)glsl";
+
+// With compute shaders, GPU systems are culled before each draw: one work group per chunk copies the particles that are alive and in view, and their attributes,
+// to the front of the chunk's slots in its arena's visible buffers, in order, and writes the draw command with their count. The CPU never learns how many there are.
+static const char* glsl_gpu_cull_compute_shader_source = R"glsl(
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) readonly buffer Particles {
+	Particle particles[];
+};
+
+layout (std430, binding = 1) writeonly buffer VisibleParticles {
+	Particle visible_particles[];
+};
+
+// Packed custom attributes, which are aligned to 4 bytes.
+layout (std430, binding = 2) readonly buffer Attributes {
+	uint attributes[];
+};
+
+layout (std430, binding = 3) writeonly buffer VisibleAttributes {
+	uint visible_attributes[];
+};
+
+// Same layout as DrawElementsIndirectCommand.
+struct DrawCommand {
+	uint index_count;
+	uint instance_count;
+	uint first_index;
+	int base_vertex;
+	uint base_instance;
+};
+
+layout (std430, binding = 4) writeonly buffer DrawCommands {
+	DrawCommand commands[];
+};
+
+uniform uint particle_count;
+uniform uint visible_base; // Where the chunk's visible particles start.
+uniform uint command_index;
+uniform uint attribute_words; // Size of one particle's attributes, in uints. 0 if there are none.
+uniform uint mesh_index_count;
+uniform float mesh_radius;
+uniform mat4 projection;
+
+shared uint visible_before[256]; // For each invocation, how many particles of the tile are visible up to its own, included.
+
+// Culls the cube that holds the particle's mesh, when all its corners are past the same clip plane.
+bool is_visible(Particle p) {
+	if (p.life < 0) return false;
+	
+	float extent = mesh_radius * abs(p.scale);
+	bvec3 all_below = bvec3(true);
+	bvec3 all_above = bvec3(true);
+	for (int k = 0; k < 8; k += 1) {
+		vec3 corner = vec3((k & 1) != 0 ? extent : -extent, (k & 2) != 0 ? extent : -extent, (k & 4) != 0 ? extent : -extent);
+		vec4 clip = projection * vec4(p.position + corner, 1);
+		all_below = bvec3(ivec3(all_below) & ivec3(lessThan(clip.xyz, vec3(-clip.w))));
+		all_above = bvec3(ivec3(all_above) & ivec3(greaterThan(clip.xyz, vec3(clip.w))));
+	}
+	return !any(all_below) && !any(all_above);
+}
+
+void main() {
+	uint local = gl_LocalInvocationID.x;
+	uint visible_count = 0;
+	
+	for (uint tile = 0; tile < particle_count; tile += 256) {
+		uint index = tile + local;
+		bool visible = index < particle_count && is_visible(particles[index]);
+		
+		// Scan the tile, so that visible particles keep their order, and draw like they would on the CPU.
+		visible_before[local] = visible ? 1 : 0;
+		barrier();
+		for (uint step = 1; step < 256; step *= 2) {
+			uint previous = local >= step ? visible_before[local - step] : 0;
+			barrier();
+			visible_before[local] += previous;
+			barrier();
+		}
+		
+		if (visible) {
+			uint slot = visible_base + visible_count + visible_before[local] - 1;
+			visible_particles[slot] = particles[index];
+			for (uint w = 0; w < attribute_words; w += 1) visible_attributes[slot * attribute_words + w] = attributes[index * attribute_words + w];
+		}
+		
+		visible_count += visible_before[255];
+		barrier(); // The next tile overwrites visible_before.
+	}
+	
+	if (local == 0) {
+		commands[command_index] = DrawCommand(mesh_index_count, visible_count, 0, 0, visible_base);
+	}
+}
+)glsl";
+
+// Trails have no mesh: each particle is one triangle strip, two vertices per point, from its current position back through its history.
+// The history is a ring of rows, one row per push, in a buffer texture. Point k > 0 is the (k - 1)th latest push.
+static const char* glsl_trail_vertex_shader_source = R"glsl(
+#version 410
+
+layout (location = 3) in vec4 instance_position; // The current alpha is in w.
+layout (location = 4) in float instance_scale;
+layout (location = 5) in vec4 instance_color;
+
+uniform mat4 projection;
+uniform samplerBuffer trail_positions; // 'trail_length' rows of 'chunk_capacity' positions.
+uniform usamplerBuffer trail_counts;   // Valid rows per particle.
+uniform int trail_length;
+uniform int trail_head;
+uniform int chunk_capacity;
+
+out vec2 pixel_uv;
+out vec4 pixel_color;
+
+vec2 trail_point(int k, int count) {
+	// Points older than the particle's history repeat its oldest one, which collapses the rest of the strip.
+	int age = min(k - 1, count - 1);
+	if (age < 0) return instance_position.xy;
+	
+	int row = (trail_head - age + trail_length) % trail_length;
+	return texelFetch(trail_positions, row * chunk_capacity + gl_InstanceID).xy;
+}
+
+void main() {
+	int point_count = trail_length + 1;
+	int k = gl_VertexID / 2;
+	float side = (gl_VertexID % 2 == 0) ? -1 : 1;
+	int count = int(texelFetch(trail_counts, gl_InstanceID).r);
+	
+	vec2 position = trail_point(k, count);
+	vec2 direction = trail_point(max(k - 1, 0), count) - trail_point(min(k + 1, point_count - 1), count);
+	
+	// Taper towards the tail. Where the trail has no direction, it has no width either.
+	float t = float(k) / float(point_count - 1);
+	float half_width = (length(direction) > 1e-6 && instance_position.w > 0) ? 0.5 * instance_scale * (1 - t) : 0;
+	vec2 normal = (half_width > 0) ? normalize(vec2(-direction.y, direction.x)) : vec2(0);
+	
+	vec4 world_position = vec4(position + normal * (side * half_width), instance_position.z, 1);
+	gl_Position = projection * world_position;
+	pixel_color = vec4(instance_color.rgb, instance_position.w * (1 - t));
+	pixel_uv = vec2(t, side * 0.5 + 0.5);
+}  
+)glsl";
+
 static const char* glsl_default_vertex_shader_source = R"glsl(
 #version 410
 
@@ -80,295 +553,2092 @@ namespace Sparkles {
 		GLuint ibo = 0; // Index buffer object
 		uint32_t vertex_count = 0;
 		uint32_t index_count = 0;
+		float radius = 0; // Furthest distance of a vertex from the origin, which particles scale their mesh around. Used to cull them.
 	};
 	
 	struct Shader {
 		GLuint handle = 0; // OpenGL shader handle.
+		uint64_t source_hash = 0; // Keys the program binaries it is linked into.
 	};
 	
 	struct Texture_GL : Texture {
 		GLuint handle = 0; // OpenGL texture handle.
 	};
 	
-	struct RenderTarget_GL : RenderTarget {
-		GLuint fbo = 0; // Framebuffer buffer object.
-		Texture* color_attachment;
-	};
+	struct RenderTarget_GL : RenderTarget {
+		GLuint fbo = 0; // Framebuffer buffer object.
+		Texture* color_attachment;
+	};
+	
+	// A VAO, and what each of its locations reads. OpenGL 4.1 has no separate vertex bindings, so opengl_bind_vertex_buffer gives a buffer to the locations that read it, along with their formats.
+	struct VertexAttribute_GL {
+		GLuint location;
+		GLuint binding;
+		GLint components;
+		GLenum type;
+		GLboolean normalized;
+		GLuint offset;
+	};
+	
+	struct VertexArray_GL {
+		GLuint vao = 0;
+		uint32_t attribute_count = 0;
+		VertexAttribute_GL attributes[16]; // OpenGL only guarantees 16 vertex attribute locations.
+	};
+	
+	// How a system packs its GPU-visible custom attributes. Systems that pack them the same way share an arena.
+	struct ArenaAttribute_GL {
+		AttributeType type;
+		uint32_t components;
+		uint32_t offset;
+	};
+	
+	struct ArenaLayout_GL {
+		uint32_t attribute_stride; // 0 if there are none.
+		uint32_t attribute_count;
+		ArenaAttribute_GL attributes[particle_max_attribute_count];
+	};
+	
+	// Slots of an arena, which a chunk gave back.
+	struct ArenaRange_GL {
+		uint32_t base;
+		uint32_t count;
+	};
+	
+	//
+	// The instance data of every chunk of the systems with the same layout, in buffers they share, so that particle_systems_upload_and_render draws the chunks
+	// of several systems with one glMultiDrawElementsIndirect, right where they were uploaded: each chunk owns 'chunk_capacity' slots from its 'base' on,
+	// which its draw command passes as the base instance.
+	// Chunk capacities are powers of two of at least particle_chunk_min_capacity, so bases are multiples of it, and so are the offsets of the ranges we bind for compute shaders.
+	//
+	struct ParticleArena_GL {
+		ArenaLayout_GL layout;
+		uint32_t system_count = 0; // The last one to go deletes the arena.
+		ParticleArena_GL* next = nullptr; // See particle_arenas.
+		
+		uint32_t capacity = 0; // Slots in each buffer.
+		uint32_t top = 0; // Slots from here on have never been handed out, or were all given back.
+		ArenaRange_GL* free_ranges = nullptr; // The other ones that were given back, merged with their neighbors.
+		uint32_t free_range_count = 0;
+		uint32_t free_range_capacity = 0;
+		
+		GLuint particles_vbo = 0;   // A Particle per slot.
+		GLuint birth_times_vbo = 0; // A birth time per slot, for BALLISTIC systems.
+		GLuint frame_vbo = 0;       // The position and alpha of each slot, for CPU systems, uploaded every frame.
+		GLuint attributes_vbo = 0;  // The packed custom attributes of each slot, if the layout has any.
+		
+		// Culled GPU systems: the visible particles of each chunk, at the front of its slots. Created on their first render.
+		GLuint visible_vbo = 0;
+		GLuint visible_attributes_vbo = 0;
+		
+		VertexArray_GL instancing_vao;
+		VertexArray_GL ballistic_instancing_vao; // GPU systems too, whose particles are laid out the same way.
+	};
+	
+	struct ParticleSystem_GL : ParticleSystem {
+		ParticleArena_GL* arena = nullptr; // Where its chunks' instance data lives.
+		
+		// Only for systems with GPU-visible custom attributes.
+		uint32_t attribute_stride = 0; // Size of the packed attributes of one particle. 0 if there are none.
+		uint32_t attribute_offsets[particle_max_attribute_count];
+		uint8_t* packing_buffer = nullptr; // Room for a chunk's worth of packed attributes.
+		vec4* frame_packing_buffer = nullptr; // Room for a chunk's worth of per-frame instance data. CPU systems only.
+		
+		GLuint feedback_vbo = 0; // GPU systems simulated by transform feedback: where a chunk's step goes, before we copy it back to the arena. Up to a chunk's worth of Particles.
+		GLuint simulation_params_buffer = 0; // GPU systems: their GpuSimulationParams, as GpuSimulationParams_GL, in a uniform buffer. Created on their first step.
+		
+		// GPU systems with compute shaders: what spawned in a chunk, on its way to glsl_gpu_spawn_compute_shader_source. Created on their first spawns.
+		GLuint spawn_vbo = 0; // Up to a chunk's worth of Particles.
+		GLuint spawn_attributes_vbo = 0; // Their packed custom attributes, if the system has GPU-visible ones.
+		GLsync slot_counters_fence = 0; // Signaled once the GPU has copied the counters of the chunks that wait for it. See opengl_read_slot_counters.
+	};
+	
+	struct ParticleChunk_GL : ParticleChunk {
+		// Its 'chunk_capacity' slots in the system's arena start here. Only the slots that spawned (or changed) are uploaded.
+		// Eventually we will want to use multiple buffers to avoid OpenGL synchronization delays. #opengl_sync_performance
+		uint32_t base = 0;
+		
+		// GPU systems with compute shaders: the free list of slots the GPU hands out, created on the chunk's first spawns. See glsl_gpu_spawn_compute_shader_source.
+		GLuint free_slots_buffer = 0;      // 'chunk_capacity' slots, a stack whose top is at the free_count of the counters.
+		GLuint slot_counters_buffer = 0;   // GpuSlotCounters, which the shaders update atomically.
+		GLuint slot_counters_readback = 0; // Where we copy them, to read them later without waiting for the GPU.
+		bool slots_reset_pending = true;   // The GPU still has particles the CPU forgot about. See backend_particle_chunk_reset.
+		bool slot_counters_in_flight = false; // Being copied to slot_counters_readback, before the system's fence.
+		uint32_t spawns_since_copy = 0;    // Sent to the GPU after that copy, so it doesn't count them.
+		
+		// Trail history, created on the first render of a system with trails. See particle_system_render_trails.
+		uint32_t trail_length = 0; // What the buffers below were created for.
+		GLuint trail_positions_vbo = 0;
+		GLuint trail_counts_vbo = 0;
+		GLuint trail_positions_texture = 0;
+		GLuint trail_counts_texture = 0;
+	};
+	
+	struct ShaderLinkage {
+		GLuint program = 0;
+		Shader* vertex_shader = nullptr;
+		Shader* pixel_shader = nullptr;
+		
+		// Uniform locations, looked up once when linking. -1 for the ones the program doesn't have.
+		GLint projection_loc = -1;
+		GLint use_texture_loc = -1;
+		GLint time_loc = -1; // Ballistic particles.
+		GLint gravity_loc = -1;
+		GLint drag_loc = -1;
+		GLint draw_params_loc = -1; // Ballistic particles of several systems.
+		GLint trail_positions_loc = -1; // Trails.
+		GLint trail_counts_loc = -1;
+		GLint trail_length_loc = -1;
+		GLint trail_head_loc = -1;
+		GLint chunk_capacity_loc = -1;
+	};
+	
+	// GpuSimulationParams, in the std140 layout of the SimulationParams block of glsl_gpu_simulation_common_source, where array elements are padded to 16 bytes.
+	// The compute shader's Particles block and the transform feedback outputs are our Particle struct as is.
+	struct GpuAttractor_GL {
+		GpuAttractor attractor;
+		float padding[2];
+	};
+	
+	struct KillVolume_GL {
+		vec2 min;
+		vec2 max;
+		vec2 normal;
+		float distance;
+		uint32_t type;
+	};
+	
+	struct GpuSimulationParams_GL {
+		vec2 gravity;
+		float drag;
+		uint32_t attractor_count;
+		uint32_t kill_volume_count;
+		uint32_t padding[3]; // The arrays start on 16 bytes.
+		GpuAttractor_GL attractors[particle_gpu_max_attractor_count];
+		KillVolume_GL kill_volumes[particle_gpu_max_kill_volume_count];
+	};
+	
+	static_assert(sizeof(Particle) == 48 && sizeof(GpuAttractor_GL) == 32 && sizeof(KillVolume_GL) == 32, "Our structs no longer match the layouts of the GPU simulation.");
+	static_assert(sizeof(GpuSimulationParams_GL) == 32 + 32 * 16 + 32 * 16, "Our structs no longer match the layouts of the GPU simulation.");
+	static_assert(particle_gpu_max_attractor_count == 16 && particle_gpu_max_kill_volume_count == 16, "Update the array sizes in glsl_gpu_simulation_common_source.");
+	
+	constexpr GLuint gpu_simulation_params_binding = 0; // Uniform buffer binding of the SimulationParams block.
+	constexpr GLuint gpu_slot_counters_binding = 0; // Atomic counter buffer binding of a chunk's GpuSlotCounters.
+	
+	// The atomic counters of a chunk's free list, in the order the compute shaders declare them.
+	struct GpuSlotCounters {
+		uint32_t free_count; // Slots on the free list.
+		uint32_t alive_count;
+	};
+	
+	constexpr uint32_t gpu_simulation_group_size = 256; // The compute shaders' local_size_x.
+	
+	// What glsl_gpu_cull_compute_shader_source writes, and glDrawElementsIndirect reads.
+	struct DrawElementsIndirectCommand {
+		uint32_t index_count;
+		uint32_t instance_count;
+		uint32_t first_index;
+		int32_t base_vertex;
+		uint32_t base_instance;
+	};
+	
+	// These are global variables. Maybe we should have a backend struct to hold global data?
+	static Shader* default_instancing_vertex_shader;
+	static Shader* ballistic_instancing_vertex_shader;
+	static Shader* ballistic_batch_vertex_shader; // Its DRAW_PARAMETERS variant. nullptr without glMultiDrawElementsIndirect and gl_DrawIDARB.
+	static Shader* gpu_instancing_vertex_shader;
+	static Shader* trail_vertex_shader;
+	static Shader* default_vertex_shader;
+	static Shader* default_pixel_shader;
+	static VertexArray_GL default_vao;
+	static VertexArray_GL trail_vao;
+	static ParticleArena_GL* particle_arenas; // Linked through their 'next'.
+	static GLuint gpu_simulation_program; // 0 without compute shaders.
+	static GLint gpu_simulation_particle_count_loc;
+	static GLint gpu_simulation_dt_loc;
+	static GLuint gpu_feedback_program; // Only without compute shaders.
+	static GLint gpu_feedback_dt_loc;
+	static GLuint gpu_feedback_vao;
+	static GLuint gpu_spawn_program; // 0 without compute shaders, in which case GPU systems take their slots on the CPU.
+	static GLint gpu_spawn_count_loc;
+	static GLint gpu_spawn_attribute_words_loc;
+	static GLuint gpu_slot_reset_program;
+	static GLint gpu_slot_reset_particle_count_loc;
+	static GLuint gpu_cull_program; // 0 without compute shaders, in which case we draw every used slot of GPU systems.
+	static GLint gpu_cull_particle_count_loc;
+	static GLint gpu_cull_visible_base_loc;
+	static GLint gpu_cull_command_index_loc;
+	static GLint gpu_cull_attribute_words_loc;
+	static GLint gpu_cull_mesh_index_count_loc;
+	static GLint gpu_cull_mesh_radius_loc;
+	static GLint gpu_cull_projection_loc;
+	static bool backend_initialized;
+
+	// Linked programs, by their pair of shaders. Open addressing with linear probing, grown when half full so that probes stay short.
+	static ShaderLinkage** shader_linkage_table;
+	static uint32_t shader_linkage_table_capacity; // A power of two, or 0 before our first program.
+	static uint32_t shader_linkage_table_count;
+	
+	//
+	// On-disk program binaries, one file per program, named after the hash of its shaders' sources and of the driver, which is the only one that can load it.
+	//
+	struct ProgramBinaryHeader {
+		uint32_t magic;
+		uint32_t format; // What glGetProgramBinary says.
+		uint32_t size;   // Of the binary that follows.
+		uint64_t key;    // Same as the file name.
+	};
+	
+	constexpr uint32_t program_binary_magic = 0x424B5053; // "SPKB"
+	
+	static char* shader_cache_directory; // nullptr if we don't cache programs on disk.
+	static bool program_binaries_supported; // Some drivers have no binary formats.
+	static uint64_t opengl_driver_hash; // Of its vendor, renderer and version strings.
+	
+	// FNV-1a. 'hash' continues from a previous hash.
+	static uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+		auto bytes = (const uint8_t*) data;
+		for (size_t i = 0; i < size; i += 1) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+	
+	//
+	// What we last bound, so that we only call OpenGL when it changes. Our draws leave their bindings in place for the next one.
+	// opengl_unknown_binding means that we don't know what is bound, e.g. after render_state_reset, so the next bind always goes through.
+	//
+	constexpr GLuint opengl_unknown_binding = ~0u;
+	
+	struct OpenGLStateCache {
+		GLuint program = opengl_unknown_binding;
+		GLuint framebuffer = opengl_unknown_binding;
+		GLuint vao = opengl_unknown_binding;
+		VertexArray_GL* vertex_array = nullptr; // What 'vao' reads, for opengl_bind_vertex_buffer. Set along with it by opengl_apply_render_state.
+		GLuint texture0 = opengl_unknown_binding; // The GL_TEXTURE_2D of texture unit 0.
+		uint32_t blend_mode = opengl_unknown_binding; // A BlendMode.
+		Rect viewport = {-1, -1, -1, -1};
+	};
+	
+	static OpenGLStateCache opengl_state;
+	
+	//
+	// The draw commands of opengl_render_batch, one per chunk. Every batch reuses them, orphaning the previous one's storage.
+	//
+	struct ParticleBatch_GL {
+		GLuint command_buffer = 0; // DrawElementsIndirectCommands, whose base_instance is where the chunk's slots start in its arena.
+		GLuint draw_params_vbo = 0; // BALLISTIC systems: the time, gravity and drag of each command's system, for the DRAW_PARAMETERS variant of their shader.
+		GLuint draw_params_texture = 0;
+		uint32_t command_capacity = 0;
+		DrawElementsIndirectCommand* commands = nullptr; // What we upload to command_buffer. Culled GPU systems have theirs written by culling instead.
+		vec4* draw_params = nullptr;
+	};
+	
+	constexpr GLint draw_params_texture_unit = 3; // Trails use units 1 and 2.
+	
+	static ParticleBatch_GL particle_batch;
+	
+	static void opengl_use_program(GLuint program) {
+		if (opengl_state.program == program) return;
+		glUseProgram(program);
+		opengl_state.program = program;
+	}
+	
+	static void opengl_bind_framebuffer(GLuint framebuffer) {
+		if (opengl_state.framebuffer == framebuffer) return;
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		opengl_state.framebuffer = framebuffer;
+	}
+	
+	static void opengl_bind_vertex_array(GLuint vao) {
+		if (opengl_state.vao == vao) return;
+		glBindVertexArray(vao);
+		opengl_state.vao = vao;
+	}
+	
+	// Texture unit 0 must be the active one, which it is outside of particle_system_render_trails.
+	static void opengl_bind_texture0(GLuint texture) {
+		if (opengl_state.texture0 == texture) return;
+		glBindTexture(GL_TEXTURE_2D, texture);
+		opengl_state.texture0 = texture;
+	}
+	
+	static void opengl_set_blend_mode(BlendMode blend_mode) {
+		if (opengl_state.blend_mode == (uint32_t) blend_mode) return;
+		
+		switch (blend_mode) {
+		  case BlendMode::ALPHA:    glEnable(GL_BLEND); glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); break;
+		  case BlendMode::ADDITIVE: glEnable(GL_BLEND); glBlendFunc(GL_SRC_ALPHA, GL_ONE); break;
+		  case BlendMode::NONE:     glDisable(GL_BLEND); break;
+		  default: SPARKLES_ASSERT(false, "Unknown blend mode.");
+		}
+		opengl_state.blend_mode = (uint32_t) blend_mode;
+	}
+	
+	static void opengl_set_viewport(Rect viewport) {
+		Rect* current = &opengl_state.viewport;
+		if (current->x == viewport.x && current->y == viewport.y && current->w == viewport.w && current->h == viewport.h) return;
+		glViewport(viewport.x, viewport.y, viewport.w, viewport.h);
+		*current = viewport;
+	}
+	
+	//
+	// Vertex formats. These describe the currently bound VAO, which is 'vertex_array'.
+	// With OpenGL 4.3, each location reads from a binding, and opengl_bind_vertex_buffer binds buffers to those. OpenGL 4.1 has no such thing, so we keep the formats for opengl_bind_vertex_buffer instead.
+	//
+	
+	static void opengl_vao_add_attribute(VertexArray_GL* vertex_array, GLuint location, GLuint binding, GLint components, GLenum type, GLboolean normalized, GLuint offset) {
+		glEnableVertexAttribArray(location);
+		
+		if (GLAD_GL_VERSION_4_3) {
+			glVertexAttribBinding(location, binding);
+			glVertexAttribFormat(location, components, type, normalized, offset);
+			return;
+		}
+		
+		SPARKLES_ASSERT(vertex_array->attribute_count < sizeof(vertex_array->attributes) / sizeof(vertex_array->attributes[0]), "Too many vertex attributes.");
+		vertex_array->attributes[vertex_array->attribute_count++] = {location, binding, components, type, normalized, offset};
+	}
+	
+	// Every location that reads from 'binding' advances once per 'divisor' instances. Call it once they are all added.
+	static void opengl_vao_set_divisor(VertexArray_GL* vertex_array, GLuint binding, GLuint divisor) {
+		if (GLAD_GL_VERSION_4_3) {
+			glVertexBindingDivisor(binding, divisor);
+			return;
+		}
+		
+		for (uint32_t a = 0; a < vertex_array->attribute_count; a += 1) {
+			VertexAttribute_GL* attribute = &vertex_array->attributes[a];
+			if (attribute->binding == binding) glVertexAttribDivisor(attribute->location, divisor);
+		}
+	}
+	
+	// Locations 0 to 2: the mesh vertices, from binding 0.
+	static void opengl_vao_add_vertex_format(VertexArray_GL* vertex_array) {
+		opengl_vao_add_attribute(vertex_array, 0, 0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position));
+		opengl_vao_add_attribute(vertex_array, 1, 0, 4, GL_FLOAT, GL_FALSE, offsetof(Vertex, color));
+		opengl_vao_add_attribute(vertex_array, 2, 0, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, uv));
+	}
+	
+	// Locations 3 to 5 (and 6 to 8 for ballistic systems): the particles, from binding 1, and their birth times, from binding 2.
+	// CPU systems take their position and alpha from binding 4 instead, which is uploaded every frame, and leave the rest to spawns.
+	static void opengl_vao_add_particle_format(VertexArray_GL* vertex_array, bool ballistic) {
+		if (ballistic) {
+			// Particle position at birth. Its w is 1.
+			opengl_vao_add_attribute(vertex_array, 3, 1, 3, GL_FLOAT, GL_FALSE, offsetof(Particle, position));
+		} else {
+			// Particle position, and alpha in w.
+			opengl_vao_add_attribute(vertex_array, 3, 4, 4, GL_FLOAT, GL_FALSE, 0);
+			opengl_vao_set_divisor(vertex_array, 4, 1);
+		}
+		
+		// Particle scale
+		opengl_vao_add_attribute(vertex_array, 4, 1, 1, GL_FLOAT, GL_FALSE, offsetof(Particle, scale));
+		
+		// Particle color. CPU systems leave out alpha, which the shader reads as 1.
+		opengl_vao_add_attribute(vertex_array, 5, 1, ballistic ? 4 : 3, GL_FLOAT, GL_FALSE, offsetof(Particle, color));
+		
+		if (ballistic) {
+			// Particle velocity and life at birth
+			opengl_vao_add_attribute(vertex_array, 6, 1, 3, GL_FLOAT, GL_FALSE, offsetof(Particle, velocity));
+			opengl_vao_add_attribute(vertex_array, 7, 1, 1, GL_FLOAT, GL_FALSE, offsetof(Particle, life));
+			
+			// Particle birth time, which comes from a separate array.
+			opengl_vao_add_attribute(vertex_array, 8, 2, 1, GL_FLOAT, GL_FALSE, 0);
+			opengl_vao_set_divisor(vertex_array, 2, 1);
+		}
+		
+		opengl_vao_set_divisor(vertex_array, 1, 1);
+	}
+	
+	// Custom GPU-visible attributes, packed together in binding 3, from location particle_attribute_first_location on.
+	static void opengl_vao_add_attribute_format(VertexArray_GL* vertex_array, ArenaLayout_GL* layout) {
+		for (uint32_t a = 0; a < layout->attribute_count; a += 1) {
+			ArenaAttribute_GL* attribute = &layout->attributes[a];
+			GLuint location = particle_attribute_first_location + a;
+			
+			switch (attribute->type) {
+			  case AttributeType::FLOAT:  opengl_vao_add_attribute(vertex_array, location, 3, attribute->components, GL_FLOAT, GL_FALSE, attribute->offset); break;
+			  case AttributeType::HALF:   opengl_vao_add_attribute(vertex_array, location, 3, attribute->components, GL_HALF_FLOAT, GL_FALSE, attribute->offset); break;
+			  case AttributeType::UNORM8: opengl_vao_add_attribute(vertex_array, location, 3, attribute->components, GL_UNSIGNED_BYTE, GL_TRUE, attribute->offset); break;
+			}
+		}
+		
+		opengl_vao_set_divisor(vertex_array, 3, 1);
+	}
+	
+	// Binds 'buffer' to 'binding' of the current vertex array. On OpenGL 4.1, that means pointing every location that reads from it at the buffer, again.
+	static void opengl_bind_vertex_buffer(GLuint binding, GLuint buffer, GLintptr offset, GLsizei stride) {
+		if (GLAD_GL_VERSION_4_3) {
+			glBindVertexBuffer(binding, buffer, offset, stride);
+			return;
+		}
+		
+		VertexArray_GL* vertex_array = opengl_state.vertex_array;
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		for (uint32_t a = 0; a < vertex_array->attribute_count; a += 1) {
+			VertexAttribute_GL* attribute = &vertex_array->attributes[a];
+			if (attribute->binding != binding) continue;
+			
+			glVertexAttribPointer(attribute->location, attribute->components, attribute->type, attribute->normalized, stride, (void*) (offset + attribute->offset));
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0); // The pointers keep it.
+	}
+	
+	// Interleaves the GPU-visible attributes of particles [begin, end) into the system's packing buffer. They are stored in their GPU types already.
+	static void opengl_pack_attributes(ParticleSystem_GL* system, ParticleChunk* chunk, uint32_t begin, uint32_t end) {
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			ParticleAttribute* attribute = &system->attributes[a];
+			if (attribute->visibility != AttributeVisibility::GPU) continue;
+			
+			uint32_t size = particle_attribute_size(attribute);
+			uint8_t* destination = system->packing_buffer + system->attribute_offsets[a];
+			uint8_t* source = &chunk->attributes[a][begin * size];
+			
+			for (uint32_t i = begin; i < end; i += 1) {
+				memcpy(destination, source, size);
+				destination += system->attribute_stride;
+				source += size;
+			}
+		}
+	}
+	
+	// The opposite of opengl_pack_attributes, for particles [0, count), from the system's packing buffer.
+	static void opengl_unpack_attributes(ParticleSystem_GL* system, ParticleChunk* chunk, uint32_t count) {
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			ParticleAttribute* attribute = &system->attributes[a];
+			if (attribute->visibility != AttributeVisibility::GPU) continue;
+			
+			uint32_t size = particle_attribute_size(attribute);
+			uint8_t* source = system->packing_buffer + system->attribute_offsets[a];
+			uint8_t* destination = chunk->attributes[a];
+			
+			for (uint32_t i = 0; i < count; i += 1) {
+				memcpy(destination, source, size);
+				source += system->attribute_stride;
+				destination += size;
+			}
+		}
+	}
+	
+	// Packs the position and alpha of particles [0, used). Dead particles get 0 alpha, so that killing one needs no other upload.
+	static void opengl_pack_frame(ParticleSystem_GL* system, ParticleChunk* chunk) {
+		vec4* destination = system->frame_packing_buffer;
+		Particle* particles = chunk->particles;
+		uint32_t count = chunk->used;
+		
+		SPARKLES_LOOP_INDEPENDENT
+		for (uint32_t i = 0; i < count; i += 1) {
+			Particle* p = &particles[i];
+			destination[i] = {p->position, p->life < 0 ? 0 : p->color.w};
+		}
+	}
+	
+	// Our GPU simulation programs are only ours, so they don't go through shader_create and the linkage table.
+	// 'shader_source_code' comes after a #version line and glsl_gpu_simulation_common_source. 'feedback_varyings' are captured one after the other into a single buffer.
+	static GLuint opengl_create_simulation_program(GLenum shader_type, const char* version, const char* shader_source_code, const char** feedback_varyings = nullptr, int feedback_varying_count = 0) {
+		const char* sources[] = {version, glsl_gpu_simulation_common_source, shader_source_code};
+		
+		GLuint shader = glCreateShader(shader_type);
+		glShaderSource(shader, 3, sources, nullptr);
+		glCompileShader(shader);
+		
+		int shader_compiled;
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &shader_compiled);
+		if (!shader_compiled) {
+			char message[512];
+			glGetShaderInfoLog(shader, sizeof(message), nullptr, message);
+			SPARKLES_LOG("Failed to compile simulation shader:\n%s\n", message);
+			glDeleteShader(shader);
+			return 0;
+		}
+		
+		GLuint program = glCreateProgram();
+		glAttachShader(program, shader);
+		if (feedback_varying_count) glTransformFeedbackVaryings(program, feedback_varying_count, feedback_varyings, GL_INTERLEAVED_ATTRIBS);
+		glLinkProgram(program);
+		glDeleteShader(shader); // It lives on with the program.
+		
+		int program_linked = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &program_linked);
+		if (!program_linked) {
+			char message[512];
+			glGetProgramInfoLog(program, sizeof(message), nullptr, message);
+			SPARKLES_LOG("Failed to link simulation shader:\n%s\n", message);
+			glDeleteProgram(program);
+			return 0;
+		}
+		
+		GLuint params_block = glGetUniformBlockIndex(program, "SimulationParams");
+		if (params_block != GL_INVALID_INDEX) glUniformBlockBinding(program, params_block, gpu_simulation_params_binding); // Culling and spawning don't use it.
+		return program;
+	}
+	
+	// Locations 0 to 4 of gpu_feedback_vao: one particle per vertex, from 'vbo', from 'offset' on, for transform feedback.
+	// This path is for OpenGL 4.1, which has no separate vertex bindings, so the buffer goes with the pointers, every time it changes.
+	static void opengl_set_feedback_source(GLuint vbo, size_t offset) {
+		GLint sizes[] = {3, 1, 4, 3, 1};
+		size_t offsets[] = {offsetof(Particle, position), offsetof(Particle, scale), offsetof(Particle, color), offsetof(Particle, velocity), offsetof(Particle, life)};
+		
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		for (GLuint location = 0; location < 5; location += 1) {
+			glVertexAttribPointer(location, sizes[location], GL_FLOAT, GL_FALSE, sizeof(Particle), (void*) (offset + offsets[location]));
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0); // The pointers keep it.
+	}
+	
+	// SPARKLES_FORCE_TRANSFORM_FEEDBACK=1 makes us simulate GPU systems like we do on OpenGL 4.1, even where we have compute shaders, so that the fallback can be tested there.
+	static bool opengl_transform_feedback_forced() {
+		const char* value = getenv("SPARKLES_FORCE_TRANSFORM_FEEDBACK");
+		return value && value[0] && strcmp(value, "0") != 0;
+	}
+	
+	static bool opengl_has_extension(const char* name) {
+		GLint extension_count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+		for (GLint i = 0; i < extension_count; i += 1) {
+			if (strcmp((const char*) glGetStringi(GL_EXTENSIONS, i), name) == 0) return true;
+		}
+		return false;
+	}
+	
+	// Compiles 'sources' one after the other, like glShaderSource does, so that our own shaders can have variants.
+	static Shader* opengl_shader_create(ShaderType type, const char** sources, int source_count) {
+		GLenum gl_shader_type = -1;
+		switch (type) {
+		  case ShaderType::VERTEX: gl_shader_type = GL_VERTEX_SHADER;   break;
+		  case ShaderType::PIXEL:  gl_shader_type = GL_FRAGMENT_SHADER; break;
+		  default: SPARKLES_ASSERT(false);
+		}
+		
+		GLuint handle = glCreateShader(gl_shader_type);
+		glShaderSource(handle, source_count, sources, nullptr);
+		glCompileShader(handle);
+		
+		int shader_compiled;
+		glGetShaderiv(handle, GL_COMPILE_STATUS, &shader_compiled);
+		if (!shader_compiled) {
+			char message[512];
+			glGetShaderInfoLog(handle, sizeof(message), nullptr, message);
+			SPARKLES_LOG("Failed to compile vertex shader:\n%s\n", message);
+			glDeleteShader(handle);
+			return nullptr;
+		}
+		
+		Shader* result = new Shader; // #memory_cleanup
+		result->handle = handle;
+		result->source_hash = hash_bytes(&type, sizeof(type));
+		for (int s = 0; s < source_count; s += 1) result->source_hash = hash_bytes(sources[s], strlen(sources[s]), result->source_hash);
+		return result;
+	}
+	
+	bool initialize() {		
+		{
+			// Program binaries only load on the driver that saved them.
+			const char* driver_strings[] = {(const char*) glGetString(GL_VENDOR), (const char*) glGetString(GL_RENDERER), (const char*) glGetString(GL_VERSION)};
+			opengl_driver_hash = hash_bytes(nullptr, 0);
+			for (const char* string : driver_strings) {
+				if (string) opengl_driver_hash = hash_bytes(string, strlen(string) + 1, opengl_driver_hash);
+			}
+			
+			GLint binary_format_count = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binary_format_count);
+			program_binaries_supported = binary_format_count > 0;
+		}
+		
+		{
+			// Create default shader program
+			default_instancing_vertex_shader = shader_create(ShaderLanguage::GLSL, ShaderType::VERTEX, glsl_default_instancing_vertex_shader_source);
+			SPARKLES_ASSERT(default_instancing_vertex_shader);
+			
+			const char* ballistic_sources[] = {"#version 410\n", glsl_ballistic_instancing_vertex_shader_source};
+			ballistic_instancing_vertex_shader = opengl_shader_create(ShaderType::VERTEX, ballistic_sources, 2);
+			SPARKLES_ASSERT(ballistic_instancing_vertex_shader);
+			
+			// Our batches of BALLISTIC systems need it to tell their draws apart. Without it, each system gets its own draw, see opengl_render_batch.
+			if (GLAD_GL_VERSION_4_3 && opengl_has_extension("GL_ARB_shader_draw_parameters")) {
+				const char* batch_sources[] = {"#version 410\n#define DRAW_PARAMETERS\n", glsl_ballistic_instancing_vertex_shader_source};
+				ballistic_batch_vertex_shader = opengl_shader_create(ShaderType::VERTEX, batch_sources, 2);
+				SPARKLES_ASSERT(ballistic_batch_vertex_shader);
+			}
+			
+			gpu_instancing_vertex_shader = shader_create(ShaderLanguage::GLSL, ShaderType::VERTEX, glsl_gpu_instancing_vertex_shader_source);
+			SPARKLES_ASSERT(gpu_instancing_vertex_shader);
+			
+			trail_vertex_shader = shader_create(ShaderLanguage::GLSL, ShaderType::VERTEX, glsl_trail_vertex_shader_source);
+			SPARKLES_ASSERT(trail_vertex_shader);
+			
+			default_vertex_shader = shader_create(ShaderLanguage::GLSL, ShaderType::VERTEX, glsl_default_vertex_shader_source);
+			SPARKLES_ASSERT(default_vertex_shader);
+			
+			default_pixel_shader = shader_create(ShaderLanguage::GLSL, ShaderType::PIXEL, glsl_default_pixel_shader_source);
+			SPARKLES_ASSERT(default_pixel_shader);
+		}
+		
+		if (GLAD_GL_VERSION_4_3 && !opengl_transform_feedback_forced()) {
+			// Compute shaders came with OpenGL 4.3.
+			gpu_simulation_program = opengl_create_simulation_program(GL_COMPUTE_SHADER, "#version 430\n", glsl_gpu_simulation_compute_shader_source);
+			SPARKLES_ASSERT(gpu_simulation_program);
+			
+			gpu_simulation_particle_count_loc = glGetUniformLocation(gpu_simulation_program, "particle_count");
+			gpu_simulation_dt_loc = glGetUniformLocation(gpu_simulation_program, "dt");
+			
+			gpu_spawn_program = opengl_create_simulation_program(GL_COMPUTE_SHADER, "#version 430\n", glsl_gpu_spawn_compute_shader_source);
+			SPARKLES_ASSERT(gpu_spawn_program);
+			
+			gpu_spawn_count_loc = glGetUniformLocation(gpu_spawn_program, "spawn_count");
+			gpu_spawn_attribute_words_loc = glGetUniformLocation(gpu_spawn_program, "attribute_words");
+			
+			gpu_slot_reset_program = opengl_create_simulation_program(GL_COMPUTE_SHADER, "#version 430\n", glsl_gpu_slot_reset_compute_shader_source);
+			SPARKLES_ASSERT(gpu_slot_reset_program);
+			
+			gpu_slot_reset_particle_count_loc = glGetUniformLocation(gpu_slot_reset_program, "particle_count");
+			
+			gpu_cull_program = opengl_create_simulation_program(GL_COMPUTE_SHADER, "#version 430\n", glsl_gpu_cull_compute_shader_source);
+			SPARKLES_ASSERT(gpu_cull_program);
+			
+			gpu_cull_particle_count_loc = glGetUniformLocation(gpu_cull_program, "particle_count");
+			gpu_cull_visible_base_loc = glGetUniformLocation(gpu_cull_program, "visible_base");
+			gpu_cull_command_index_loc = glGetUniformLocation(gpu_cull_program, "command_index");
+			gpu_cull_attribute_words_loc = glGetUniformLocation(gpu_cull_program, "attribute_words");
+			gpu_cull_mesh_index_count_loc = glGetUniformLocation(gpu_cull_program, "mesh_index_count");
+			gpu_cull_mesh_radius_loc = glGetUniformLocation(gpu_cull_program, "mesh_radius");
+			gpu_cull_projection_loc = glGetUniformLocation(gpu_cull_program, "projection");
+			
+			// Chunks take ranges of their arena's buffers, which start on multiples of particle_chunk_min_capacity elements, of 4 bytes or more.
+			GLint storage_alignment = 1;
+			glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_alignment);
+			SPARKLES_ASSERT((particle_chunk_min_capacity * 4) % storage_alignment == 0, "Chunks can't bind their ranges of arena buffers on this driver.");
+		} else {
+			// Before that, a vertex shader simulates the particles, and transform feedback captures them.
+			const char* varyings[] = {"next_position", "next_scale", "next_color", "next_velocity", "next_life"};
+			gpu_feedback_program = opengl_create_simulation_program(GL_VERTEX_SHADER, "#version 410\n", glsl_gpu_simulation_feedback_vertex_shader_source, varyings, 5);
+			SPARKLES_ASSERT(gpu_feedback_program);
+			
+			gpu_feedback_dt_loc = glGetUniformLocation(gpu_feedback_program, "dt");
+			
+			// Its buffers change with every chunk, see opengl_set_feedback_source.
+			glGenVertexArrays(1, &gpu_feedback_vao);
+			opengl_bind_vertex_array(gpu_feedback_vao);
+			for (GLuint location = 0; location < 5; location += 1) glEnableVertexAttribArray(location);
+			opengl_bind_vertex_array(0);
+		}
+		
+		{
+			// Create default VAOs. The ones particles are drawn with belong to their arena.
+			glGenVertexArrays(1, &default_vao.vao);
+			opengl_bind_vertex_array(default_vao.vao);
+			opengl_vao_add_vertex_format(&default_vao);
+			
+			// Trails only read the particles. Their vertices come from gl_VertexID.
+			glGenVertexArrays(1, &trail_vao.vao);
+			opengl_bind_vertex_array(trail_vao.vao);
+			opengl_vao_add_particle_format(&trail_vao, false);
+			
+			opengl_bind_vertex_array(0);
+		}
+		
+		backend_initialized = true;
+		return true;
+	}
+	
+	static uint32_t opengl_shader_linkage_slot(Shader* vertex_shader, Shader* pixel_shader) {
+		uint64_t key = (uint64_t) (uintptr_t) vertex_shader * 0x9E3779B97F4A7C15ull ^ (uint64_t) (uintptr_t) pixel_shader;
+		key ^= key >> 29;
+		key *= 0xBF58476D1CE4E5B9ull;
+		key ^= key >> 32;
+		return (uint32_t) key & (shader_linkage_table_capacity - 1);
+	}
+	
+	static ShaderLinkage* opengl_find_shader_linkage(Shader* vertex_shader, Shader* pixel_shader) {
+		if (!shader_linkage_table_count) return nullptr;
+		
+		for (uint32_t slot = opengl_shader_linkage_slot(vertex_shader, pixel_shader); ; slot = (slot + 1) & (shader_linkage_table_capacity - 1)) {
+			ShaderLinkage* entry = shader_linkage_table[slot];
+			if (!entry) return nullptr;
+			if (entry->vertex_shader == vertex_shader && entry->pixel_shader == pixel_shader) return entry;
+		}
+	}
+	
+	static void opengl_insert_shader_linkage(ShaderLinkage* linkage) {
+		if (2 * (shader_linkage_table_count + 1) > shader_linkage_table_capacity) {
+			ShaderLinkage** old_table = shader_linkage_table;
+			uint32_t old_capacity = shader_linkage_table_capacity;
+			
+			shader_linkage_table_capacity = old_capacity ? old_capacity * 2 : 64;
+			shader_linkage_table = new ShaderLinkage*[shader_linkage_table_capacity](); // #memory_cleanup
+			shader_linkage_table_count = 0;
+			for (uint32_t i = 0; i < old_capacity; i += 1) {
+				if (old_table[i]) opengl_insert_shader_linkage(old_table[i]);
+			}
+			delete[] old_table;
+		}
+		
+		uint32_t slot = opengl_shader_linkage_slot(linkage->vertex_shader, linkage->pixel_shader);
+		while (shader_linkage_table[slot]) slot = (slot + 1) & (shader_linkage_table_capacity - 1);
+		shader_linkage_table[slot] = linkage;
+		shader_linkage_table_count += 1;
+	}
+	
+	static void opengl_program_binary_path(uint64_t key, char* path, size_t path_size) {
+		snprintf(path, path_size, "%s/%016llx.bin", shader_cache_directory, (unsigned long long) key);
+	}
+	
+	// Returns 0 if there is no usable binary for 'key', in which case we link the program ourselves.
+	static GLuint opengl_load_program_binary(uint64_t key) {
+		if (!shader_cache_directory || !program_binaries_supported) return 0;
+		
+		char path[1024];
+		opengl_program_binary_path(key, path, sizeof(path));
+		FILE* file = fopen(path, "rb");
+		if (!file) return 0;
+		
+		GLuint program = 0;
+		ProgramBinaryHeader header;
+		if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == program_binary_magic && header.key == key) {
+			uint8_t* binary = new uint8_t[header.size];
+			if (fread(binary, header.size, 1, file) == 1) {
+				program = glCreateProgram();
+				glProgramBinary(program, header.format, binary, header.size);
+				
+				// Drivers may still refuse it, e.g. after an update that kept their version string. Then we link again, and overwrite it.
+				int program_linked = 0;
+				glGetProgramiv(program, GL_LINK_STATUS, &program_linked);
+				if (!program_linked) {
+					glDeleteProgram(program);
+					program = 0;
+				}
+			}
+			delete[] binary;
+		}
+		
+		fclose(file);
+		return program;
+	}
+	
+	static void opengl_save_program_binary(GLuint program, uint64_t key) {
+		if (!shader_cache_directory || !program_binaries_supported) return;
+		
+		GLint size = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+		if (size <= 0) return;
+		
+		uint8_t* binary = new uint8_t[size];
+		GLsizei written = 0;
+		GLenum format = 0;
+		glGetProgramBinary(program, size, &written, &format, binary);
+		
+		// Zero the padding before 'key' too, so that we never write stack garbage to disk.
+		ProgramBinaryHeader header;
+		memset(&header, 0, sizeof(header));
+		header.magic = program_binary_magic;
+		header.format = format;
+		header.size = (uint32_t) written;
+		header.key = key;
+		
+		char path[1024];
+		opengl_program_binary_path(key, path, sizeof(path));
+		FILE* file = fopen(path, "wb");
+		if (file) {
+			fwrite(&header, sizeof(header), 1, file);
+			fwrite(binary, written, 1, file);
+			fclose(file);
+		} else {
+			SPARKLES_LOG("Failed to write program binary %s\n", path);
+		}
+		
+		delete[] binary;
+	}
+	
+	static ShaderLinkage* opengl_get_or_create_shader_program(Shader* vertex_shader, Shader* pixel_shader, Shader* fallback_vertex_shader) {
+		if (!vertex_shader) vertex_shader = fallback_vertex_shader;
+		if (!pixel_shader)  pixel_shader  = default_pixel_shader;
+		
+		ShaderLinkage* found = opengl_find_shader_linkage(vertex_shader, pixel_shader);
+		if (found) return found;
+		
+		// If we get here, it means we did not find both shaders linked together in a program, so we load it from the shader cache, or link a new one.
+		uint64_t binary_key = hash_bytes(&pixel_shader->source_hash, sizeof(uint64_t), hash_bytes(&vertex_shader->source_hash, sizeof(uint64_t), opengl_driver_hash));
+		GLuint program = opengl_load_program_binary(binary_key);
+		
+		if (!program) {
+			program = glCreateProgram();
+			glAttachShader(program, vertex_shader->handle);
+			glAttachShader(program, pixel_shader->handle);
+			if (shader_cache_directory && program_binaries_supported) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			glLinkProgram(program);
+			
+			int program_linked = 0;
+			glGetProgramiv(program, GL_LINK_STATUS, &program_linked);
+			if (!program_linked) {
+				char message[512];
+				glGetProgramInfoLog(program, sizeof(message), nullptr, message);
+				SPARKLES_LOG("Failed to link vertex and fragment shaders:\n%s\n", message);
+				glDeleteProgram(program);
+				
+				// Draw with our own shaders instead, which read the same vertex format. The entry keeps us from linking these two again every frame.
+				bool ours = vertex_shader == fallback_vertex_shader && pixel_shader == default_pixel_shader;
+				SPARKLES_ASSERT(!ours, "Failed to link our own shaders.");
+				
+				auto entry = new ShaderLinkage; // #memory_cleanup
+				if (!ours) *entry = *opengl_get_or_create_shader_program(fallback_vertex_shader, default_pixel_shader, fallback_vertex_shader);
+				entry->vertex_shader = vertex_shader;
+				entry->pixel_shader = pixel_shader;
+				opengl_insert_shader_linkage(entry);
+				return entry;
+			}
+			
+			opengl_save_program_binary(program, binary_key);
+		}
+		
+		auto entry = new ShaderLinkage; // #memory_cleanup
+		entry->program = program;
+		entry->vertex_shader = vertex_shader;
+		entry->pixel_shader = pixel_shader;
+		opengl_insert_shader_linkage(entry);
+		
+		entry->projection_loc = glGetUniformLocation(program, "projection");
+		entry->use_texture_loc = glGetUniformLocation(program, "use_texture");
+		entry->time_loc = glGetUniformLocation(program, "time");
+		entry->gravity_loc = glGetUniformLocation(program, "gravity");
+		entry->drag_loc = glGetUniformLocation(program, "drag");
+		entry->draw_params_loc = glGetUniformLocation(program, "draw_params");
+		entry->trail_positions_loc = glGetUniformLocation(program, "trail_positions");
+		entry->trail_counts_loc = glGetUniformLocation(program, "trail_counts");
+		entry->trail_length_loc = glGetUniformLocation(program, "trail_length");
+		entry->trail_head_loc = glGetUniformLocation(program, "trail_head");
+		entry->chunk_capacity_loc = glGetUniformLocation(program, "chunk_capacity");
+		return entry;
+	}
+	
+	// 'fallback_vertex_shader' is used when the render state doesn't specify one. It must match the vertex format described by 'vertex_array'.
+	static ShaderLinkage* opengl_apply_render_state(RenderState* render_state, Shader* fallback_vertex_shader, VertexArray_GL* vertex_array) {
+		ShaderLinkage* linkage = opengl_get_or_create_shader_program(render_state->vertex_shader, render_state->pixel_shader, fallback_vertex_shader);
+		opengl_use_program(linkage->program);
+		
+		auto render_target_gl = (RenderTarget_GL*) render_state->render_target;
+		opengl_bind_framebuffer(render_target_gl ? render_target_gl->fbo : 0);
+		
+		opengl_set_viewport(render_state->viewport);
+		opengl_set_blend_mode(render_state->blend_mode);
+		
+		// Apply uniforms
+		if (linkage->projection_loc >= 0) {
+			glUniformMatrix4fv(linkage->projection_loc, 1, GL_TRUE, (float*) &render_state->projection);
+		} else {
+			// #incomplete #robustness: Provide a helpful error message here.
+		}	
+		
+		if (linkage->use_texture_loc >= 0) {
+			glUniform1i(linkage->use_texture_loc, render_state->texture0 != nullptr);
+		} else {
+			// #incomplete #robustness: Provide a helpful error message here.
+		}	
+		
+		
+		if (render_state->texture0) {
+			auto texture0_gl = (Texture_GL*) render_state->texture0;
+			opengl_bind_texture0(texture0_gl->handle);
+		}
+		
+		opengl_bind_vertex_array(vertex_array->vao);
+		opengl_state.vertex_array = vertex_array;
+		return linkage;
+	}
+	
+	void render_state_reset() {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glUseProgram(0);
+		glBindVertexArray(0);
+		glDisable(GL_BLEND);
+		
+		// Whatever you bind next, we will bind ours again.
+		opengl_state = {};
+	}
+	
+	//
+	// Arenas. Their buffers only grow, as systems take more slots than they have. #memory_cleanup
+	//
+	
+	// A new buffer of 'size' bytes, which starts with the first 'copy_size' bytes of 'old_buffer', if there is one. 'old_buffer' is then deleted.
+	static GLuint opengl_grow_buffer(GLuint old_buffer, size_t size, size_t copy_size, GLenum usage) {
+		GLuint buffer;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, usage);
+		
+		if (old_buffer) {
+			if (copy_size) {
+				glBindBuffer(GL_COPY_READ_BUFFER, old_buffer);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, copy_size);
+				glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			}
+			glDeleteBuffers(1, &old_buffer);
+		}
+		
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		return buffer;
+	}
+	
+	// Makes room for at least 'capacity' slots. The slots handed out so far keep what they hold, since GPU systems only have their particles there.
+	static void opengl_arena_grow(ParticleArena_GL* arena, uint32_t capacity) {
+		uint32_t new_capacity = arena->capacity * 2;
+		if (new_capacity < capacity) new_capacity = capacity;
+		
+		uint32_t kept = arena->top;
+		uint32_t stride = arena->layout.attribute_stride;
+		arena->particles_vbo = opengl_grow_buffer(arena->particles_vbo, new_capacity * sizeof(Particle), kept * sizeof(Particle), GL_STREAM_DRAW);
+		arena->birth_times_vbo = opengl_grow_buffer(arena->birth_times_vbo, new_capacity * sizeof(float), kept * sizeof(float), GL_STREAM_DRAW);
+		arena->frame_vbo = opengl_grow_buffer(arena->frame_vbo, new_capacity * sizeof(vec4), kept * sizeof(vec4), GL_STREAM_DRAW);
+		if (stride) arena->attributes_vbo = opengl_grow_buffer(arena->attributes_vbo, new_capacity * stride, kept * stride, GL_STREAM_DRAW);
+		
+		// Culling fills them before every draw, so there is nothing to keep.
+		if (arena->visible_vbo) {
+			arena->visible_vbo = opengl_grow_buffer(arena->visible_vbo, new_capacity * sizeof(Particle), 0, GL_DYNAMIC_COPY);
+			if (stride) arena->visible_attributes_vbo = opengl_grow_buffer(arena->visible_attributes_vbo, new_capacity * stride, 0, GL_DYNAMIC_COPY);
+		}
+		
+		arena->capacity = new_capacity;
+	}
+	
+	// Hands out 'count' slots, from a range that was given back if one is large enough.
+	static uint32_t opengl_arena_allocate(ParticleArena_GL* arena, uint32_t count) {
+		for (uint32_t r = 0; r < arena->free_range_count; r += 1) {
+			ArenaRange_GL* range = &arena->free_ranges[r];
+			if (range->count < count) continue;
+			
+			// From its end, so that the rest of it stays where it is.
+			range->count -= count;
+			uint32_t base = range->base + range->count;
+			if (range->count == 0) *range = arena->free_ranges[--arena->free_range_count];
+			return base;
+		}
+		
+		if (arena->top + count > arena->capacity) opengl_arena_grow(arena, arena->top + count);
+		uint32_t base = arena->top;
+		arena->top += count;
+		return base;
+	}
+	
+	static void opengl_arena_free(ParticleArena_GL* arena, uint32_t base, uint32_t count) {
+		// Merge the slots with the ranges right before and after them, so that chunks of any capacity can reuse them.
+		for (uint32_t r = 0; r < arena->free_range_count; ) {
+			ArenaRange_GL* range = &arena->free_ranges[r];
+			if (range->base + range->count != base && base + count != range->base) {
+				r += 1;
+				continue;
+			}
+			
+			if (range->base < base) base = range->base;
+			count += range->count;
+			*range = arena->free_ranges[--arena->free_range_count]; // Then look at the one that took its place.
+		}
+		
+		if (base + count == arena->top) {
+			arena->top = base;
+			return;
+		}
+		
+		if (arena->free_range_count == arena->free_range_capacity) {
+			uint32_t new_capacity = arena->free_range_capacity ? arena->free_range_capacity * 2 : 16;
+			auto ranges = new ArenaRange_GL[new_capacity];
+			for (uint32_t r = 0; r < arena->free_range_count; r += 1) ranges[r] = arena->free_ranges[r];
+			delete[] arena->free_ranges;
+			arena->free_ranges = ranges;
+			arena->free_range_capacity = new_capacity;
+		}
+		arena->free_ranges[arena->free_range_count++] = {base, count};
+	}
+	
+	static bool opengl_arena_layouts_match(ArenaLayout_GL* a, ArenaLayout_GL* b) {
+		if (a->attribute_stride != b->attribute_stride || a->attribute_count != b->attribute_count) return false;
+		
+		for (uint32_t i = 0; i < a->attribute_count; i += 1) {
+			ArenaAttribute_GL* attribute_a = &a->attributes[i];
+			ArenaAttribute_GL* attribute_b = &b->attributes[i];
+			if (attribute_a->type != attribute_b->type || attribute_a->components != attribute_b->components || attribute_a->offset != attribute_b->offset) return false;
+		}
+		return true;
+	}
+	
+	// The arena of the systems that pack their GPU-visible attributes like 'system' does. Created if there is none yet.
+	static ParticleArena_GL* opengl_arena_acquire(ParticleSystem_GL* system) {
+		ArenaLayout_GL layout = {};
+		layout.attribute_stride = system->attribute_stride;
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			ParticleAttribute* attribute = &system->attributes[a];
+			if (attribute->visibility != AttributeVisibility::GPU) continue;
+			
+			layout.attributes[layout.attribute_count++] = {attribute->type, attribute->components, system->attribute_offsets[a]};
+		}
+		
+		for (ParticleArena_GL* arena = particle_arenas; arena; arena = arena->next) {
+			if (!opengl_arena_layouts_match(&arena->layout, &layout)) continue;
+			
+			arena->system_count += 1;
+			return arena;
+		}
+		
+		auto arena = new ParticleArena_GL; // #memory_cleanup
+		arena->layout = layout;
+		arena->system_count = 1;
+		arena->next = particle_arenas;
+		particle_arenas = arena;
+		
+		// Its vertex formats, with its attributes (if any) on top of ours.
+		glGenVertexArrays(1, &arena->instancing_vao.vao);
+		opengl_bind_vertex_array(arena->instancing_vao.vao);
+		opengl_vao_add_vertex_format(&arena->instancing_vao);
+		opengl_vao_add_particle_format(&arena->instancing_vao, false);
+		if (layout.attribute_stride) opengl_vao_add_attribute_format(&arena->instancing_vao, &arena->layout);
+		
+		glGenVertexArrays(1, &arena->ballistic_instancing_vao.vao);
+		opengl_bind_vertex_array(arena->ballistic_instancing_vao.vao);
+		opengl_vao_add_vertex_format(&arena->ballistic_instancing_vao);
+		opengl_vao_add_particle_format(&arena->ballistic_instancing_vao, true);
+		if (layout.attribute_stride) opengl_vao_add_attribute_format(&arena->ballistic_instancing_vao, &arena->layout);
+		
+		opengl_bind_vertex_array(0);
+		return arena;
+	}
+	
+	static void opengl_arena_release(ParticleArena_GL* arena) {
+		arena->system_count -= 1;
+		if (arena->system_count) return;
+		
+		ParticleArena_GL** link = &particle_arenas;
+		while (*link != arena) link = &(*link)->next;
+		*link = arena->next;
+		
+		// Deleting the bound VAO unbinds it, and its name can come back from glGenVertexArrays.
+		if (opengl_state.vao == arena->instancing_vao.vao || opengl_state.vao == arena->ballistic_instancing_vao.vao) {
+			opengl_state.vao = opengl_unknown_binding;
+			opengl_state.vertex_array = nullptr;
+		}
+		glDeleteVertexArrays(1, &arena->instancing_vao.vao);
+		glDeleteVertexArrays(1, &arena->ballistic_instancing_vao.vao);
+		
+		GLuint buffers[] = {arena->particles_vbo, arena->birth_times_vbo, arena->frame_vbo, arena->attributes_vbo, arena->visible_vbo, arena->visible_attributes_vbo};
+		glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers); // Zeros are ignored.
+		delete[] arena->free_ranges;
+		delete arena;
+	}
+	
+	ParticleSystem* backend_particle_system_allocate() {
+		return new ParticleSystem_GL; // #memory_cleanup
+	}
+	
+	void backend_particle_system_configure(ParticleSystem* system) {
+		auto system_gl = (ParticleSystem_GL*) system;
+		
+		// Lay out the GPU-visible attributes one after the other, each one aligned to 4 bytes.
+		uint32_t stride = 0;
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			ParticleAttribute* attribute = &system->attributes[a];
+			system_gl->attribute_offsets[a] = 0;
+			if (attribute->visibility != AttributeVisibility::GPU) continue;
+			
+			system_gl->attribute_offsets[a] = stride;
+			stride += (particle_attribute_size(attribute) + 3) & ~3u;
+		}
+		
+		system_gl->attribute_stride = stride;
+		system_gl->frame_packing_buffer = new vec4[system->chunk_capacity];
+		if (stride) system_gl->packing_buffer = new uint8_t[system->chunk_capacity * stride];
+		
+		system_gl->arena = opengl_arena_acquire(system_gl);
+	}
+	
+	void backend_particle_system_release(ParticleSystem* system) {
+		auto system_gl = (ParticleSystem_GL*) system;
+		opengl_arena_release(system_gl->arena);
+		delete[] system_gl->packing_buffer;
+		if (system_gl->feedback_vbo) glDeleteBuffers(1, &system_gl->feedback_vbo);
+		if (system_gl->simulation_params_buffer) glDeleteBuffers(1, &system_gl->simulation_params_buffer);
+		if (system_gl->spawn_vbo) glDeleteBuffers(1, &system_gl->spawn_vbo);
+		if (system_gl->spawn_attributes_vbo) glDeleteBuffers(1, &system_gl->spawn_attributes_vbo);
+		if (system_gl->slot_counters_fence) glDeleteSync(system_gl->slot_counters_fence);
+		delete[] system_gl->frame_packing_buffer;
+		delete system_gl;
+	}
+	
+	ParticleChunk* backend_particle_chunk_allocate(ParticleSystem* system) {
+		auto chunk = new ParticleChunk_GL; // #memory_cleanup
+		chunk->base = opengl_arena_allocate(((ParticleSystem_GL*) system)->arena, system->chunk_capacity);
+		return chunk;
+	}
+	
+	static void opengl_release_trail_buffers(ParticleChunk_GL* chunk) {
+		if (!chunk->trail_length) return;
+		
+		glDeleteTextures(1, &chunk->trail_positions_texture);
+		glDeleteTextures(1, &chunk->trail_counts_texture);
+		glDeleteBuffers(1, &chunk->trail_positions_vbo);
+		glDeleteBuffers(1, &chunk->trail_counts_vbo);
+		chunk->trail_length = 0;
+	}
+	
+	static GLuint opengl_create_buffer_texture(GLuint buffer, GLenum internal_format) {
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_BUFFER, texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, internal_format, buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		return texture;
+	}
+	
+	// (Re)creates the chunk's trail buffers if the system's trail length changed, in which case its whole history needs uploading.
+	static void opengl_prepare_trail_buffers(ParticleSystem* system, ParticleChunk_GL* chunk) {
+		if (chunk->trail_length == system->trail_length) return;
+		opengl_release_trail_buffers(chunk);
+		
+		glGenBuffers(1, &chunk->trail_positions_vbo);
+		glBindBuffer(GL_TEXTURE_BUFFER, chunk->trail_positions_vbo);
+		glBufferData(GL_TEXTURE_BUFFER, system->trail_length * system->chunk_capacity * sizeof(vec2), nullptr, GL_STREAM_DRAW);
+		
+		glGenBuffers(1, &chunk->trail_counts_vbo);
+		glBindBuffer(GL_TEXTURE_BUFFER, chunk->trail_counts_vbo);
+		glBufferData(GL_TEXTURE_BUFFER, system->chunk_capacity, nullptr, GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		
+		chunk->trail_positions_texture = opengl_create_buffer_texture(chunk->trail_positions_vbo, GL_RG32F);
+		chunk->trail_counts_texture = opengl_create_buffer_texture(chunk->trail_counts_vbo, GL_R8UI);
+		chunk->trail_length = system->trail_length;
+		chunk->trail_dirty_rows = system->trail_length;
+	}
+	
+	void backend_particle_chunk_release(ParticleSystem* system, ParticleChunk* chunk) {
+		auto chunk_gl = (ParticleChunk_GL*) chunk;
+		opengl_arena_free(((ParticleSystem_GL*) system)->arena, chunk_gl->base, system->chunk_capacity);
+		if (chunk_gl->free_slots_buffer) {
+			glDeleteBuffers(1, &chunk_gl->free_slots_buffer);
+			glDeleteBuffers(1, &chunk_gl->slot_counters_buffer);
+			glDeleteBuffers(1, &chunk_gl->slot_counters_readback);
+		}
+		opengl_release_trail_buffers(chunk_gl);
+		delete chunk_gl;
+	}
+	
+	void backend_particle_chunk_reset(ParticleSystem*, ParticleChunk* chunk) {
+		auto chunk_gl = (ParticleChunk_GL*) chunk;
+		
+		// The GPU catches up before the chunk's next spawns, see opengl_spawn_on_gpu. Until then, its counters mean nothing.
+		chunk_gl->slots_reset_pending = true;
+		chunk_gl->slot_counters_in_flight = false;
+		chunk_gl->spawns_since_copy = 0;
+	}
+	
+	bool backend_particle_gpu_slots_supported() {
+		return gpu_spawn_program != 0;
+	}
+	
+	// Binds the 'count' slots from 'base' on of one of an arena's buffers, whose elements are 'stride' bytes, to a shader storage binding, as if they were a buffer of their own.
+	static void opengl_bind_chunk_storage(GLuint binding, GLuint buffer, uint32_t base, uint32_t count, uint32_t stride) {
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, buffer, (GLintptr) base * stride, (GLsizeiptr) count * stride);
+	}
+	
+	// Creates the chunk's free list if it has none yet, and puts every slot on it, killing whatever was in them.
+	static void opengl_reset_slots(ParticleSystem* system, ParticleChunk_GL* chunk) {
+		if (!chunk->free_slots_buffer) {
+			glGenBuffers(1, &chunk->free_slots_buffer);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, chunk->free_slots_buffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, system->chunk_capacity * sizeof(uint32_t), nullptr, GL_DYNAMIC_COPY);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+			
+			glGenBuffers(1, &chunk->slot_counters_buffer);
+			glGenBuffers(1, &chunk->slot_counters_readback);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, chunk->slot_counters_readback);
+			glBufferData(GL_COPY_WRITE_BUFFER, sizeof(GpuSlotCounters), nullptr, GL_STREAM_READ);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+		
+		GpuSlotCounters counters = {system->chunk_capacity, 0};
+		glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, chunk->slot_counters_buffer);
+		glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(counters), &counters, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+		
+		opengl_use_program(gpu_slot_reset_program);
+		glUniform1ui(gpu_slot_reset_particle_count_loc, system->chunk_capacity);
+		opengl_bind_chunk_storage(0, ((ParticleSystem_GL*) system)->arena->particles_vbo, chunk->base, system->chunk_capacity, sizeof(Particle));
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, chunk->free_slots_buffer);
+		glDispatchCompute((system->chunk_capacity + gpu_simulation_group_size - 1) / gpu_simulation_group_size, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		
+		chunk->slots_reset_pending = false;
+	}
+	
+	// GPU systems with compute shaders: sends what spawned in the chunk since last time to glsl_gpu_spawn_compute_shader_source, which puts them in free slots.
+	static void opengl_spawn_on_gpu(ParticleSystem_GL* system, ParticleChunk_GL* chunk) {
+		uint32_t begin, end;
+		if (!particle_chunk_take_dirty_range(system, chunk, &begin, &end)) return;
+		if (chunk->slots_reset_pending) opengl_reset_slots(system, chunk);
+		
+		// Spawns wait at the front of the chunk, see particle_system_spawn.
+		SPARKLES_ASSERT(begin == 0);
+		uint32_t count = end;
+		bool has_attributes = system->attribute_stride > 0;
+		
+		if (!system->spawn_vbo) {
+			glGenBuffers(1, &system->spawn_vbo);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, system->spawn_vbo);
+			glBufferData(GL_COPY_WRITE_BUFFER, system->chunk_capacity * sizeof(Particle), nullptr, GL_STREAM_DRAW);
+			
+			if (has_attributes) {
+				glGenBuffers(1, &system->spawn_attributes_vbo);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, system->spawn_attributes_vbo);
+				glBufferData(GL_COPY_WRITE_BUFFER, system->chunk_capacity * system->attribute_stride, nullptr, GL_STREAM_DRAW);
+			}
+		}
+		
+		// #opengl_sync_performance: Every chunk of the system goes through the same buffers.
+		glBindBuffer(GL_COPY_WRITE_BUFFER, system->spawn_vbo);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, 0, count * sizeof(Particle), chunk->particles);
+		if (has_attributes) {
+			opengl_pack_attributes(system, chunk, 0, count);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, system->spawn_attributes_vbo);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, 0, count * system->attribute_stride, system->packing_buffer);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		
+		opengl_use_program(gpu_spawn_program);
+		glUniform1ui(gpu_spawn_count_loc, count);
+		glUniform1ui(gpu_spawn_attribute_words_loc, system->attribute_stride / 4);
+		
+		opengl_bind_chunk_storage(0, system->arena->particles_vbo, chunk->base, system->chunk_capacity, sizeof(Particle));
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, system->spawn_vbo);
+		if (has_attributes) {
+			opengl_bind_chunk_storage(2, system->arena->attributes_vbo, chunk->base, system->chunk_capacity, system->attribute_stride);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, system->spawn_attributes_vbo);
+		}
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, chunk->free_slots_buffer);
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, gpu_slot_counters_binding, chunk->slot_counters_buffer);
+		glDispatchCompute((count + gpu_simulation_group_size - 1) / gpu_simulation_group_size, 1, 1);
+		
+		// Simulation, culling, drawing and the next spawns all depend on it.
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_ATOMIC_COUNTER_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+		for (GLuint binding = 0; binding <= 4; binding += 1) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, gpu_slot_counters_binding, 0);
+		
+		chunk->spawns_since_copy += count;
+	}
+	
+	// Uploads a chunk's instance data: what spawned since last time, and for CPU systems, the position and alpha of every used slot.
+	// GPU systems with compute shaders send their spawns to opengl_spawn_on_gpu instead, which changes the current program.
+	static void opengl_upload_chunk(ParticleSystem_GL* system, ParticleChunk_GL* chunk) {
+		if (system->simulation == ParticleSimulation::GPU && gpu_spawn_program) {
+			opengl_spawn_on_gpu(system, chunk);
+			return;
+		}
+		
+		ParticleArena_GL* arena = system->arena;
+		bool ballistic = system->simulation == ParticleSimulation::BALLISTIC;
+		bool spawns_only = system->simulation != ParticleSimulation::CPU;
+		bool has_attributes = system->attribute_stride > 0;
+		uint32_t base = chunk->base;
+		
+		uint32_t dirty_begin, dirty_end;
+		bool has_spawns = particle_chunk_take_dirty_range(system, chunk, &dirty_begin, &dirty_end);
+		
+		if (chunk->used == 0) return;
+		
+		// Because of sync issues, we probably want to use a smarter approach here.
+		// #opengl_sync_performance
+		// Ballistic particles never change after they spawn, GPU ones only change on the GPU, and CPU ones only change their position and alpha, so we only upload the new ones.
+		if (has_spawns) {
+			uint32_t count = dirty_end - dirty_begin;
+			glBindBuffer(GL_ARRAY_BUFFER, arena->particles_vbo);
+			glBufferSubData(GL_ARRAY_BUFFER, (base + dirty_begin) * sizeof(Particle), count * sizeof(Particle), &chunk->particles[dirty_begin]);
+			if (ballistic) {
+				glBindBuffer(GL_ARRAY_BUFFER, arena->birth_times_vbo);
+				glBufferSubData(GL_ARRAY_BUFFER, (base + dirty_begin) * sizeof(float), count * sizeof(float), &chunk->birth_times[dirty_begin]);
+			}
+		}
+		
+		if (!spawns_only) {
+			// A third of the size of the particles.
+			opengl_pack_frame(system, chunk);
+			glBindBuffer(GL_ARRAY_BUFFER, arena->frame_vbo);
+			glBufferSubData(GL_ARRAY_BUFFER, base * sizeof(vec4), chunk->used * sizeof(vec4), system->frame_packing_buffer);
+		}
+		
+		if (has_attributes) {
+			// Same ranges as the particles themselves.
+			uint32_t begin = spawns_only ? dirty_begin : 0;
+			uint32_t end   = spawns_only ? dirty_end   : chunk->used;
+			if (!spawns_only || has_spawns) {
+				opengl_pack_attributes(system, chunk, begin, end);
+				glBindBuffer(GL_ARRAY_BUFFER, arena->attributes_vbo);
+				glBufferSubData(GL_ARRAY_BUFFER, (base + begin) * system->attribute_stride, (end - begin) * system->attribute_stride, system->packing_buffer);
+			}
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	
+	//
+	// Culling, with glsl_gpu_cull_compute_shader_source: opengl_begin_cull, then opengl_dispatch_cull for each chunk, then opengl_end_cull before drawing them.
+	// The visible particles of each chunk go to the front of its slots in the arena's visible buffers, and their count to its command in the batch.
+	//
+	
+	static void opengl_begin_cull(ParticleArena_GL* arena, Mesh* mesh, RenderState* render_state) {
+		uint32_t stride = arena->layout.attribute_stride;
+		if (!arena->visible_vbo) {
+			arena->visible_vbo = opengl_grow_buffer(0, arena->capacity * sizeof(Particle), 0, GL_DYNAMIC_COPY);
+			if (stride) arena->visible_attributes_vbo = opengl_grow_buffer(0, arena->capacity * stride, 0, GL_DYNAMIC_COPY);
+		}
+		
+		opengl_use_program(gpu_cull_program);
+		glUniform1ui(gpu_cull_attribute_words_loc, stride / 4);
+		glUniform1ui(gpu_cull_mesh_index_count_loc, mesh->index_count);
+		glUniform1f(gpu_cull_mesh_radius_loc, mesh->radius);
+		glUniformMatrix4fv(gpu_cull_projection_loc, 1, GL_TRUE, (float*) &render_state->projection);
+		
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, arena->visible_vbo);
+		if (stride) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, arena->visible_attributes_vbo);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, particle_batch.command_buffer);
+	}
+	
+	static void opengl_dispatch_cull(ParticleSystem_GL* system, ParticleChunk_GL* chunk_gl, uint32_t command_index) {
+		ParticleArena_GL* arena = system->arena;
+		opengl_bind_chunk_storage(0, arena->particles_vbo, chunk_gl->base, system->chunk_capacity, sizeof(Particle));
+		if (system->attribute_stride) opengl_bind_chunk_storage(2, arena->attributes_vbo, chunk_gl->base, system->chunk_capacity, system->attribute_stride);
+		
+		glUniform1ui(gpu_cull_particle_count_loc, chunk_gl->used);
+		glUniform1ui(gpu_cull_visible_base_loc, chunk_gl->base);
+		glUniform1ui(gpu_cull_command_index_loc, command_index);
+		glDispatchCompute(1, 1, 1); // A single group walks the whole chunk, so that it can keep the particles in order.
+	}
+	
+	static void opengl_end_cull() {
+		glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+		for (GLuint binding = 0; binding <= 4; binding += 1) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+	
+	// The vertex shader particle draws fall back to when their render state has none.
+	static Shader* opengl_instancing_vertex_shader(ParticleSimulation simulation) {
+		switch (simulation) {
+		  case ParticleSimulation::GPU:       return gpu_instancing_vertex_shader;
+		  case ParticleSimulation::BALLISTIC: return ballistic_batch_vertex_shader ? ballistic_batch_vertex_shader : ballistic_instancing_vertex_shader;
+		  default:                            return default_instancing_vertex_shader;
+		}
+	}
 	
-	struct ParticleSystem_GL : ParticleSystem {
-		GLuint instances_vbo = 0; // Eventually we will want to use multiple buffers to avoid OpenGL synchronization delays. #opengl_sync_performance
-	};
+	static void opengl_set_ballistic_uniforms(ShaderLinkage* linkage, ParticleSystem* system) {
+		if (linkage->time_loc >= 0) glUniform1f(linkage->time_loc, system->time);
+		if (linkage->gravity_loc >= 0) glUniform2f(linkage->gravity_loc, system->ballistic.gravity.x, system->ballistic.gravity.y);
+		if (linkage->drag_loc >= 0) glUniform1f(linkage->drag_loc, system->ballistic.drag);
+	}
 	
-	struct ShaderLinkage {
-		GLuint program = 0;
-		Shader* vertex_shader = nullptr;
-		Shader* pixel_shader = nullptr;
-	};
+	// Binds the arena's instance data, from slot 'base' on, to the current vertex array, which is one of the arena's. Culled GPU systems draw their visible particles.
+	static void opengl_bind_arena_instances(ParticleArena_GL* arena, uint32_t base, bool ballistic_format, bool visible) {
+		uint32_t stride = arena->layout.attribute_stride;
+		opengl_bind_vertex_buffer(1, visible ? arena->visible_vbo : arena->particles_vbo, base * sizeof(Particle), sizeof(Particle));
+		if (ballistic_format) opengl_bind_vertex_buffer(2, arena->birth_times_vbo, base * sizeof(float), sizeof(float)); // The GPU shader doesn't read them.
+		else                  opengl_bind_vertex_buffer(4, arena->frame_vbo, base * sizeof(vec4), sizeof(vec4));
+		if (stride) opengl_bind_vertex_buffer(3, visible ? arena->visible_attributes_vbo : arena->attributes_vbo, base * stride, stride);
+	}
 	
-	// These are global variables. Maybe we should have a backend struct to hold global data?
-	static Shader* default_instancing_vertex_shader;
-	static Shader* default_vertex_shader;
-	static Shader* default_pixel_shader;
-	static GLuint default_vao;
-	static GLuint default_instancing_vao;
-	static bool backend_initialized;
-
-	// #temporary: Eventually we will want an actual table here.
-	constexpr int shader_linkage_table_capacity = 128;
-	int shader_linkage_table_length;
-	ShaderLinkage shader_linkage_table[shader_linkage_table_capacity]; 
+	static void opengl_prepare_batch(uint32_t command_count) {
+		ParticleBatch_GL* batch = &particle_batch;
+		if (!batch->command_buffer) {
+			glGenBuffers(1, &batch->command_buffer);
+			glGenBuffers(1, &batch->draw_params_vbo);
+		}
+		
+		if (batch->command_capacity < command_count) {
+			while (batch->command_capacity < command_count) batch->command_capacity = batch->command_capacity ? batch->command_capacity * 2 : 64;
+			delete[] batch->commands;
+			delete[] batch->draw_params;
+			batch->commands = new DrawElementsIndirectCommand[batch->command_capacity]; // #memory_cleanup
+			batch->draw_params = new vec4[batch->command_capacity];
+		}
+		
+		// The previous batch may still be drawing from it, so we ask for new storage instead of waiting. #opengl_sync_performance
+		glBindBuffer(GL_COPY_WRITE_BUFFER, batch->command_buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, batch->command_capacity * sizeof(DrawElementsIndirectCommand), nullptr, GL_STREAM_DRAW);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
 	
-	bool initialize() {		
-		{
-			// Create default shader program
-			default_instancing_vertex_shader = shader_create(ShaderLanguage::GLSL, ShaderType::VERTEX, glsl_default_instancing_vertex_shader_source);
-			SPARKLES_ASSERT(default_instancing_vertex_shader);
+	// Draws 'systems', which share an arena and a simulation, right from the arena, with one glMultiDrawElementsIndirect.
+	// Each chunk has a command, whose base instance is where its slots start, so nothing is copied, and the commands keep the order of the systems.
+	// OpenGL 4.1 has neither, so there, each chunk is drawn on its own, with its slots bound where they start.
+	static void opengl_render_batch(ParticleSystem** systems, uint32_t system_count, Mesh* mesh, RenderState* render_state) {
+		ParticleBatch_GL* batch = &particle_batch;
+		auto first_gl = (ParticleSystem_GL*) systems[0];
+		ParticleArena_GL* arena = first_gl->arena;
+		bool ballistic = first_gl->simulation == ParticleSimulation::BALLISTIC;
+		bool gpu = first_gl->simulation == ParticleSimulation::GPU;
+		bool culled = gpu && gpu_cull_program;
+		bool multi_draw = GLAD_GL_VERSION_4_3 != 0; // glMultiDrawElementsIndirect and base instances came with OpenGL 4.3 (and 4.2).
+		
+		// Upload instance data to the GPU. GPU systems with compute shaders run a program of their own for their spawns.
+		uint32_t command_count = 0;
+		for (uint32_t s = 0; s < system_count; s += 1) {
+			auto system_gl = (ParticleSystem_GL*) systems[s];
+			for (uint32_t c = 0; c < system_gl->chunk_count; c += 1) {
+				auto chunk_gl = (ParticleChunk_GL*) system_gl->chunks[c];
+				opengl_upload_chunk(system_gl, chunk_gl);
+				if (chunk_gl->used) command_count += 1;
+			}
+		}
+		if (command_count == 0) return;
+		
+		if (multi_draw) opengl_prepare_batch(command_count);
+		
+		if (culled) {
+			// Before the render state, which the compute shader would undo.
+			opengl_begin_cull(arena, mesh, render_state);
 			
-			default_vertex_shader = shader_create(ShaderLanguage::GLSL, ShaderType::VERTEX, glsl_default_vertex_shader_source);
-			SPARKLES_ASSERT(default_vertex_shader);
+			uint32_t command_index = 0;
+			for (uint32_t s = 0; s < system_count; s += 1) {
+				auto system_gl = (ParticleSystem_GL*) systems[s];
+				for (uint32_t c = 0; c < system_gl->chunk_count; c += 1) {
+					auto chunk_gl = (ParticleChunk_GL*) system_gl->chunks[c];
+					if (chunk_gl->used) opengl_dispatch_cull(system_gl, chunk_gl, command_index++);
+				}
+			}
 			
-			default_pixel_shader = shader_create(ShaderLanguage::GLSL, ShaderType::PIXEL, glsl_default_pixel_shader_source);
-			SPARKLES_ASSERT(default_pixel_shader);
+			opengl_end_cull();
 		}
 		
-		{
-			// Create default VAOs.
-			
-			{
-				glGenVertexArrays(1, &default_vao);
-				glBindVertexArray(default_vao);
-				
-				// Vertex position
-				glEnableVertexAttribArray(0);
-				glVertexAttribBinding(0, 0);
-				glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position));
-				
-				// Vertex color
-				glEnableVertexAttribArray(1);
-				glVertexAttribBinding(1, 0);
-				glVertexAttribFormat(1, 4, GL_FLOAT, GL_FALSE, offsetof(Vertex, color));
+		// GPU particles are laid out like BALLISTIC ones, as they spawned, except that backend_particle_system_simulate keeps them current.
+		bool ballistic_format = ballistic || gpu;
+		VertexArray_GL* vertex_array = ballistic_format ? &arena->ballistic_instancing_vao : &arena->instancing_vao;
+		ShaderLinkage* linkage = opengl_apply_render_state(render_state, opengl_instancing_vertex_shader(first_gl->simulation), vertex_array);
+		
+		// Bind the vertex format and mesh buffers
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+		opengl_bind_vertex_buffer(0, mesh->vbo, 0, sizeof(Vertex));
+		
+		if (!multi_draw) {
+			for (uint32_t s = 0; s < system_count; s += 1) {
+				ParticleSystem* system = systems[s];
+				if (ballistic) opengl_set_ballistic_uniforms(linkage, system);
 				
-				// Vertex uv
-				glEnableVertexAttribArray(2);
-				glVertexAttribBinding(2, 0);
-				glVertexAttribFormat(2, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, uv));
+				for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+					auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+					if (chunk_gl->used == 0) continue;
+					
+					// Draw all particles of this chunk in a single draw call. Dead particles have scale (or alpha) 0, so they are never rasterized.
+					opengl_bind_arena_instances(arena, chunk_gl->base, ballistic_format, false);
+					glDrawElementsInstanced(GL_TRIANGLES, mesh->index_count, GL_UNSIGNED_INT, (void*) 0, chunk_gl->used);
+				}
+			}
+			return;
+		}
+		
+		opengl_bind_arena_instances(arena, 0, ballistic_format, culled);
+		
+		// Our shader reads the parameters of BALLISTIC systems for each command. Custom ones read them from uniforms, so each system needs draws of its own.
+		bool draw_params = ballistic && linkage->draw_params_loc >= 0;
+		bool draw_per_system = ballistic && !draw_params;
+		
+		if (!culled) {
+			uint32_t command_index = 0;
+			for (uint32_t s = 0; s < system_count; s += 1) {
+				ParticleSystem* system = systems[s];
+				vec4 params = {system->time, system->ballistic.gravity.x, system->ballistic.gravity.y, system->ballistic.drag};
 				
-				glBindVertexArray(0);
+				for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+					auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+					if (chunk_gl->used == 0) continue;
+					
+					batch->commands[command_index] = {mesh->index_count, chunk_gl->used, 0, 0, chunk_gl->base};
+					batch->draw_params[command_index] = params;
+					command_index += 1;
+				}
 			}
 			
-			{
-				glGenVertexArrays(1, &default_instancing_vao);
-				glBindVertexArray(default_instancing_vao);
-				
-				// Vertex position
-				glEnableVertexAttribArray(0);
-				glVertexAttribBinding(0, 0);
-				glVertexAttribFormat(0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position));
-				
-				// Vertex color
-				glEnableVertexAttribArray(1);
-				glVertexAttribBinding(1, 0);
-				glVertexAttribFormat(1, 4, GL_FLOAT, GL_FALSE, offsetof(Vertex, color));
-				
-				// Vertex uv
-				glEnableVertexAttribArray(2);
-				glVertexAttribBinding(2, 0);
-				glVertexAttribFormat(2, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, uv));
-				
-				// Particle position
-				glEnableVertexAttribArray(3);
-				glVertexAttribBinding(3, 1);
-				glVertexAttribFormat(3, 3, GL_FLOAT, GL_FALSE, offsetof(Particle, position));
-				
-				// Particle scale
-				glEnableVertexAttribArray(4);
-				glVertexAttribBinding(4, 1);
-				glVertexAttribFormat(4, 1, GL_FLOAT, GL_FALSE, offsetof(Particle, scale));
+			glBindBuffer(GL_COPY_WRITE_BUFFER, batch->command_buffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, 0, command_count * sizeof(DrawElementsIndirectCommand), batch->commands);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+		
+		if (draw_params) {
+			glBindBuffer(GL_TEXTURE_BUFFER, batch->draw_params_vbo);
+			glBufferData(GL_TEXTURE_BUFFER, command_count * sizeof(vec4), batch->draw_params, GL_STREAM_DRAW);
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+			if (!batch->draw_params_texture) batch->draw_params_texture = opengl_create_buffer_texture(batch->draw_params_vbo, GL_RGBA32F);
+			
+			glActiveTexture(GL_TEXTURE0 + draw_params_texture_unit);
+			glBindTexture(GL_TEXTURE_BUFFER, batch->draw_params_texture);
+			glActiveTexture(GL_TEXTURE0);
+			glUniform1i(linkage->draw_params_loc, draw_params_texture_unit);
+		}
+		
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch->command_buffer);
+		if (draw_per_system) {
+			uint32_t first_command = 0;
+			for (uint32_t s = 0; s < system_count; s += 1) {
+				ParticleSystem* system = systems[s];
+				uint32_t count = 0;
+				for (uint32_t c = 0; c < system->chunk_count; c += 1) count += system->chunks[c]->used ? 1 : 0;
+				if (count == 0) continue;
 				
-				// Particle color
-				glEnableVertexAttribArray(5);
-				glVertexAttribBinding(5, 1);
-				glVertexAttribFormat(5, 4, GL_FLOAT, GL_FALSE, offsetof(Particle, color));
+				opengl_set_ballistic_uniforms(linkage, system);
+				glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*) (first_command * sizeof(DrawElementsIndirectCommand)), count, 0);
+				first_command += count;
+			}
+		} else {
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*) 0, command_count, 0);
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	
+	void particle_system_upload_and_render(ParticleSystem* system, Mesh* mesh, RenderState* render_state) {
+		opengl_render_batch(&system, 1, mesh, render_state);
+	}
+	
+	void particle_systems_upload_and_render(ParticleSystem* systems[], uint32_t system_count, Mesh* mesh, RenderState* render_state) {
+		// Runs of systems that share an arena and a simulation share a draw.
+		uint32_t first = 0;
+		while (first < system_count) {
+			auto first_gl = (ParticleSystem_GL*) systems[first];
+			
+			uint32_t end = first + 1;
+			while (end < system_count && ((ParticleSystem_GL*) systems[end])->arena == first_gl->arena && systems[end]->simulation == first_gl->simulation) end += 1;
+			
+			opengl_render_batch(&systems[first], end - first, mesh, render_state);
+			first = end;
+		}
+	}
+	
+	bool particle_gpu_simulation_supported() {
+		return gpu_simulation_program || gpu_feedback_program;
+	}
+	
+	// Without compute shaders, each chunk goes through a vertex shader, one particle per point, with the rasterizer off.
+	// Transform feedback can't write to the buffer it reads from, so it writes the results to the system's feedback buffer, which we copy back to the chunk's slots.
+	// The particles never leave the GPU.
+	static void opengl_simulate_with_feedback(ParticleSystem_GL* system_gl, float dt) {
+		ParticleSystem* system = system_gl;
+		ParticleArena_GL* arena = system_gl->arena;
+		
+		if (!system_gl->feedback_vbo) {
+			glGenBuffers(1, &system_gl->feedback_vbo);
+			glBindBuffer(GL_ARRAY_BUFFER, system_gl->feedback_vbo);
+			glBufferData(GL_ARRAY_BUFFER, system->chunk_capacity * sizeof(Particle), nullptr, GL_DYNAMIC_COPY);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		
+		opengl_use_program(gpu_feedback_program);
+		glUniform1f(gpu_feedback_dt_loc, dt);
+		opengl_bind_vertex_array(gpu_feedback_vao);
+		glEnable(GL_RASTERIZER_DISCARD);
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+			
+			// New particles start from where they spawned. Nothing else is ever uploaded, or read back.
+			opengl_upload_chunk(system_gl, chunk_gl);
+			if (chunk_gl->used == 0) continue;
+			
+			uint32_t size = chunk_gl->used * sizeof(Particle);
+			opengl_set_feedback_source(arena->particles_vbo, chunk_gl->base * sizeof(Particle));
+			glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, system_gl->feedback_vbo, 0, size);
+			
+			glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, chunk_gl->used);
+			glEndTransformFeedback();
+			
+			glBindBuffer(GL_COPY_READ_BUFFER, system_gl->feedback_vbo);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, arena->particles_vbo);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, chunk_gl->base * sizeof(Particle), size);
+		}
+		
+		glDisable(GL_RASTERIZER_DISCARD);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	
+	// Only the GPU knows when its particles die. Each step copies the counters of the system's chunks, and a later step reads them, once the GPU is done with that copy,
+	// so that we never wait for it. The counts are then a step or so old, and particles that spawned since are added to them, which keeps them an upper bound.
+	static void opengl_read_slot_counters(ParticleSystem_GL* system_gl) {
+		ParticleSystem* system = system_gl;
+		
+		if (system_gl->slot_counters_fence) {
+			if (glClientWaitSync(system_gl->slot_counters_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) return; // Maybe next step.
+			glDeleteSync(system_gl->slot_counters_fence);
+			system_gl->slot_counters_fence = 0;
+			
+			for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+				auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+				if (!chunk_gl->slot_counters_in_flight) continue; // Reset since, or created since.
 				
-				glVertexBindingDivisor(1, 1);
+				GpuSlotCounters counters;
+				glBindBuffer(GL_COPY_READ_BUFFER, chunk_gl->slot_counters_readback);
+				glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(counters), &counters);
 				
-				glBindVertexArray(0);
+				// Spawns that are still on the CPU would count too, but the step sent them all.
+				chunk_gl->alive = counters.alive_count + chunk_gl->spawns_since_copy;
+				chunk_gl->slot_counters_in_flight = false;
 			}
 		}
 		
-		{
-			// Set default blend state. #temporary
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+			if (!chunk_gl->slot_counters_buffer || chunk_gl->slots_reset_pending) continue;
+			
+			glBindBuffer(GL_COPY_READ_BUFFER, chunk_gl->slot_counters_buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, chunk_gl->slot_counters_readback);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GpuSlotCounters));
+			chunk_gl->slot_counters_in_flight = true;
+			chunk_gl->spawns_since_copy = 0;
 		}
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 		
-		backend_initialized = true;
-		return true;
+		system_gl->slot_counters_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 	}
 	
-	static ShaderLinkage* opengl_get_or_create_shader_program(Shader* vertex_shader, Shader* pixel_shader, bool instancing) {
-		if (!vertex_shader) vertex_shader = instancing ? default_instancing_vertex_shader : default_vertex_shader;
-		if (!pixel_shader)  pixel_shader  = default_pixel_shader;
+	void backend_particle_system_simulate(ParticleSystem* system, float dt) {
+		auto system_gl = (ParticleSystem_GL*) system;
+		SPARKLES_ASSERT(gpu_simulation_program || gpu_feedback_program, "GPU simulation is not supported. See particle_gpu_simulation_supported.");
 		
-		for (int i = 0; i < shader_linkage_table_length; i += 1) {
-			ShaderLinkage* entry = &shader_linkage_table[i];
-			if (vertex_shader == entry->vertex_shader && pixel_shader == entry->pixel_shader) {
-				return entry;
+		{
+			//
+			// Upload the parameters. They are small, so we do it every step.
+			//
+			GpuSimulationParams* params = &system->gpu;
+			SPARKLES_ASSERT(params->attractor_count <= particle_gpu_max_attractor_count && params->kill_volume_count <= particle_gpu_max_kill_volume_count);
+			
+			GpuSimulationParams_GL packed = {};
+			packed.gravity = params->gravity;
+			packed.drag = params->drag;
+			packed.attractor_count = params->attractor_count;
+			packed.kill_volume_count = params->kill_volume_count;
+			for (uint32_t a = 0; a < params->attractor_count; a += 1) packed.attractors[a].attractor = params->attractors[a];
+			for (uint32_t v = 0; v < params->kill_volume_count; v += 1) {
+				KillVolume* volume = &params->kill_volumes[v];
+				KillVolume_GL* destination = &packed.kill_volumes[v];
+				destination->min = volume->min;
+				destination->max = volume->max;
+				destination->normal = volume->normal;
+				destination->distance = volume->distance;
+				destination->type = (uint32_t) volume->type;
 			}
+			
+			if (!system_gl->simulation_params_buffer) {
+				glGenBuffers(1, &system_gl->simulation_params_buffer);
+				glBindBuffer(GL_UNIFORM_BUFFER, system_gl->simulation_params_buffer);
+				glBufferData(GL_UNIFORM_BUFFER, sizeof(packed), nullptr, GL_DYNAMIC_DRAW);
+			}
+			glBindBuffer(GL_UNIFORM_BUFFER, system_gl->simulation_params_buffer);
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(packed), &packed);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
 		}
 		
-		SPARKLES_ASSERT(shader_linkage_table_length < shader_linkage_table_capacity); // Not being robust here because we plan to turn shader_linkage_table into an actual table.
+		glBindBufferBase(GL_UNIFORM_BUFFER, gpu_simulation_params_binding, system_gl->simulation_params_buffer);
 		
-		// If we get here, it means we did not find both shaders linked together in a program, so we generate a new one.
-		GLuint program = glCreateProgram();
-		glAttachShader(program, vertex_shader->handle);
-		glAttachShader(program, pixel_shader->handle);
-		glLinkProgram(program);
+		if (!gpu_simulation_program) {
+			opengl_simulate_with_feedback(system_gl, dt);
+			glBindBufferBase(GL_UNIFORM_BUFFER, gpu_simulation_params_binding, 0);
+			return;
+		}
 		
-		int program_linked = 0;
-		glGetProgramiv(program, GL_LINK_STATUS, &program_linked);
-		if (!program_linked) {
-			char message[512];
-			glGetProgramInfoLog(program, sizeof(message), nullptr, message);
-			SPARKLES_LOG("Failed to link vertex and fragment shaders:\n%s\n", message);
-			glDeleteProgram(program);
-			return 0;
+		// New particles take their slots, and start from where they spawned. Nothing else is ever uploaded.
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) opengl_upload_chunk(system_gl, (ParticleChunk_GL*) system->chunks[c]);
+		
+		opengl_use_program(gpu_simulation_program);
+		glUniform1f(gpu_simulation_dt_loc, dt);
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+			if (chunk_gl->used == 0) continue;
+			
+			// The particles are simulated in place, in the arena we draw them from.
+			opengl_bind_chunk_storage(0, system_gl->arena->particles_vbo, chunk_gl->base, system->chunk_capacity, sizeof(Particle));
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, chunk_gl->free_slots_buffer);
+			glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, gpu_slot_counters_binding, chunk_gl->slot_counters_buffer);
+			glUniform1ui(gpu_simulation_particle_count_loc, chunk_gl->used);
+			glDispatchCompute((chunk_gl->used + gpu_simulation_group_size - 1) / gpu_simulation_group_size, 1, 1);
 		}
 		
-		auto entry = &shader_linkage_table[shader_linkage_table_length++];
-		entry->program = program;
-		entry->vertex_shader = vertex_shader;
-		entry->pixel_shader = pixel_shader;
-		return entry;
+		// Next, the particles are drawn, simulated again, or overwritten by spawns, and their counters are copied.
+		glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_ATOMIC_COUNTER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+		
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, 0);
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, gpu_slot_counters_binding, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, gpu_simulation_params_binding, 0);
+		
+		opengl_read_slot_counters(system_gl);
 	}
 	
-	static void opengl_apply_render_state(RenderState* render_state, bool instancing) {
-		ShaderLinkage* linkage = opengl_get_or_create_shader_program(render_state->vertex_shader, render_state->pixel_shader, instancing);
-		glUseProgram(linkage->program);
-		
-		auto render_target_gl = (RenderTarget_GL*) render_state->render_target;
-		glBindFramebuffer(GL_FRAMEBUFFER, render_target_gl ? render_target_gl->fbo : 0);
+	void backend_particle_system_download(ParticleSystem* system) {
+		auto system_gl = (ParticleSystem_GL*) system;
+		ParticleArena_GL* arena = system_gl->arena;
+		Particle* simulated = new Particle[system->chunk_capacity]; // Only when switching modes, so we don't keep it around.
 		
-		Rect viewport = render_state->viewport;
-		glViewport(viewport.x, viewport.y, viewport.w, viewport.h);
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+			
+			// Pending spawns go up first, so that the GPU has the whole chunk.
+			opengl_upload_chunk(system_gl, chunk_gl);
+			if (chunk_gl->used == 0) continue;
+			
+			glBindBuffer(GL_ARRAY_BUFFER, arena->particles_vbo);
+			glGetBufferSubData(GL_ARRAY_BUFFER, chunk_gl->base * sizeof(Particle), chunk_gl->used * sizeof(Particle), simulated);
+			
+			ParticleBounds bounds = particle_bounds_empty();
+			if (gpu_spawn_program) {
+				// The GPU picked the slots, so the particles come back to those, along with their GPU-visible attributes.
+				if (system_gl->attribute_stride) {
+					glBindBuffer(GL_ARRAY_BUFFER, arena->attributes_vbo);
+					glGetBufferSubData(GL_ARRAY_BUFFER, chunk_gl->base * system_gl->attribute_stride, chunk_gl->used * system_gl->attribute_stride, system_gl->packing_buffer);
+					opengl_unpack_attributes(system_gl, chunk_gl, chunk_gl->used);
+				}
+				
+				chunk_gl->alive = 0;
+				chunk_gl->free_count = 0;
+				for (uint32_t i = 0; i < chunk_gl->used; i += 1) {
+					Particle* p = &chunk_gl->particles[i];
+					*p = simulated[i];
+					if (p->life < 0) {
+						chunk_gl->free_slots[chunk_gl->free_count++] = i;
+						continue;
+					}
+					
+					chunk_gl->alive += 1;
+					p->color.w = fmin(p->color.w, p->life); // Same fade the shader applies.
+					particle_bounds_add(&bounds, p->position.xy);
+				}
+				
+				if (chunk_gl->alive == 0) {
+					chunk_gl->used = 0;
+					chunk_gl->free_count = 0;
+				}
+				particle_chunk_store_bounds(chunk_gl, &bounds);
+				continue;
+			}
+			
+			for (uint32_t i = 0; i < chunk_gl->used; i += 1) {
+				Particle* p = &chunk_gl->particles[i];
+				if (p->life < 0) continue; // A free slot.
+				
+				*p = simulated[i];
+				if (p->life < 0) {
+					particle_kill(chunk_gl, i); // Resets the chunk after its last particle, which ends the loop.
+					continue;
+				}
+				
+				p->color.w = fmin(p->color.w, p->life); // Same fade the shader applies.
+				particle_bounds_add(&bounds, p->position.xy);
+			}
+			particle_chunk_store_bounds(chunk_gl, &bounds);
+		}
 		
-		// Apply uniforms
-		GLuint projection_uniform_loc = glGetUniformLocation(linkage->program, "projection");
-		if (projection_uniform_loc >= 0) {
-			glUniformMatrix4fv(projection_uniform_loc, 1, GL_TRUE, (float*) &render_state->projection);
-		} else {
-			// #incomplete #robustness: Provide a helpful error message here.
-		}	
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		delete[] simulated;
+	}
+	
+	void particle_system_render_trails(ParticleSystem* system, RenderState* render_state) {
+		if (!system->trail_length) return;
+		SPARKLES_ASSERT(system->simulation == ParticleSimulation::CPU, "Trails need CPU positions.");
 		
-		GLuint use_texture_uniform_loc = glGetUniformLocation(linkage->program, "use_texture");
-		if (use_texture_uniform_loc >= 0) {
-			glUniform1i(use_texture_uniform_loc, render_state->texture0 != nullptr);
-		} else {
-			// #incomplete #robustness: Provide a helpful error message here.
-		}	
+		ShaderLinkage* linkage = opengl_apply_render_state(render_state, trail_vertex_shader, &trail_vao);
+		ParticleArena_GL* arena = ((ParticleSystem_GL*) system)->arena;
 		
+		// Texture unit 0 is texture0's.
+		if (linkage->trail_positions_loc >= 0) glUniform1i(linkage->trail_positions_loc, 1);
+		if (linkage->trail_counts_loc >= 0) glUniform1i(linkage->trail_counts_loc, 2);
+		if (linkage->trail_length_loc >= 0) glUniform1i(linkage->trail_length_loc, system->trail_length);
+		if (linkage->trail_head_loc >= 0) glUniform1i(linkage->trail_head_loc, system->trail_head);
+		if (linkage->chunk_capacity_loc >= 0) glUniform1i(linkage->chunk_capacity_loc, system->chunk_capacity);
 		
-		if (render_state->texture0) {
-			auto texture0_gl = (Texture_GL*) render_state->texture0;
+		uint32_t length = system->trail_length;
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			auto chunk_gl = (ParticleChunk_GL*) system->chunks[c];
+			if (chunk_gl->used == 0) continue;
 			
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, texture0_gl->handle);
+			opengl_prepare_trail_buffers(system, chunk_gl);
+			
+			{
+				//
+				// Upload the rows pushed since last time (usually just one), and the counts, which spawns reset at any time.
+				//
+				uint32_t row_size = system->chunk_capacity * sizeof(vec2);
+				glBindBuffer(GL_TEXTURE_BUFFER, chunk_gl->trail_positions_vbo);
+				for (uint32_t r = 0; r < chunk_gl->trail_dirty_rows; r += 1) {
+					uint32_t row = (system->trail_head + length - r) % length;
+					glBufferSubData(GL_TEXTURE_BUFFER, row * row_size, chunk_gl->used * sizeof(vec2), &chunk_gl->trail_positions[row * system->chunk_capacity]);
+				}
+				chunk_gl->trail_dirty_rows = 0;
+				
+				glBindBuffer(GL_TEXTURE_BUFFER, chunk_gl->trail_counts_vbo);
+				glBufferSubData(GL_TEXTURE_BUFFER, 0, chunk_gl->used, chunk_gl->trail_counts);
+				glBindBuffer(GL_TEXTURE_BUFFER, 0);
+			}
+			
+			{
+				//
+				// Render
+				//
+				glActiveTexture(GL_TEXTURE1);
+				glBindTexture(GL_TEXTURE_BUFFER, chunk_gl->trail_positions_texture);
+				glActiveTexture(GL_TEXTURE2);
+				glBindTexture(GL_TEXTURE_BUFFER, chunk_gl->trail_counts_texture);
+				
+				opengl_bind_vertex_buffer(1, arena->particles_vbo, chunk_gl->base * sizeof(Particle), sizeof(Particle));
+				opengl_bind_vertex_buffer(4, arena->frame_vbo, chunk_gl->base * sizeof(vec4), sizeof(vec4));
+				
+				// Dead particles have 0 alpha, so their strips have no width.
+				glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 2 * (length + 1), chunk_gl->used);
+			}
 		}
 		
-		glBindVertexArray(instancing ? default_instancing_vao : default_vao);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glActiveTexture(GL_TEXTURE0);
 	}
 	
-	static void opengl_reset_render_state() {
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glUseProgram(0);
-		glBindVertexArray(0);
-	}
+	//
+	// Draw queue
+	//
+	
+	enum class DrawType : uint32_t {
+		PARTICLES,
+		TRAILS,
+		MESH,
+	};
+	
+	struct Draw_GL {
+		uint64_t key; // See opengl_draw_key.
+		uint32_t sequence; // When it was added, so that draws with the same key keep their order.
+		DrawType type;
+		ParticleSystem* system;
+		Mesh* mesh;
+		int32_t index_count; // Meshes only.
+		RenderState render_state;
+	};
+	
+	// The OpenGL objects of one field of the keys, in the order the queue first saw them. See opengl_draw_key_index.
+	struct DrawKeyObjects {
+		GLuint* names = nullptr;
+		uint32_t count = 0;
+		uint32_t capacity = 0;
+	};
 	
-	ParticleSystem* particle_system_create(uint32_t particle_count) {		
-		uint32_t instance_buffer_size = particle_count * sizeof(Particle);
+	enum DrawKeyField {
+		DRAW_KEY_RENDER_TARGET,
+		DRAW_KEY_PROGRAM,
+		DRAW_KEY_TEXTURE,
+		DRAW_KEY_MESH,
+		DRAW_KEY_FIELD_COUNT,
+	};
+	
+	struct DrawQueue {
+		Draw_GL* draws = nullptr;
+		ParticleSystem** batch = nullptr; // Room for as many systems as there are draws, for the runs we hand to particle_systems_upload_and_render.
+		uint32_t count = 0;
+		uint32_t capacity = 0;
+		DrawKeyObjects key_objects[DRAW_KEY_FIELD_COUNT]; // Emptied on submit, like the draws.
+	};
+	
+	// The index of OpenGL object 'name' among the ones the queue has seen in 'field', added if it is new. The indices of a field fit in 'bits' bits.
+	// Past that, objects share the last index, and only sort together. Their draws still bind what they need.
+	// #performance: A linear search, since queues only see a few of each.
+	static uint64_t opengl_draw_key_index(DrawQueue* queue, DrawKeyField field, GLuint name, uint32_t bits) {
+		DrawKeyObjects* objects = &queue->key_objects[field];
+		for (uint32_t i = 0; i < objects->count; i += 1) {
+			if (objects->names[i] == name) return i;
+		}
 		
-		auto system = new ParticleSystem_GL; // #memory_cleanup
-		system->count = particle_count;
-		system->particles = new Particle[particle_count]; // #memory_cleanup
-		memset(system->particles, 0, instance_buffer_size);
+		uint32_t max_index = (1u << bits) - 1;
+		if (objects->count > max_index) return max_index;
 		
-		// #cleanup: This should be factored out into a function, so that it can be used for other backends.
-		for (int i = 0; i < system->count; i += 1) {
-			Particle* p = &system->particles[i];
-			p->life = -1;
+		if (objects->count == objects->capacity) {
+			uint32_t new_capacity = objects->capacity ? objects->capacity * 2 : 16;
+			GLuint* names = new GLuint[new_capacity];
+			for (uint32_t i = 0; i < objects->count; i += 1) names[i] = objects->names[i];
+			delete[] objects->names;
+			objects->names = names;
+			objects->capacity = new_capacity;
 		}
 		
-		GLuint vbo;
-		glGenBuffers(1, &vbo);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, instance_buffer_size, system->particles, GL_STREAM_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		system->instances_vbo = vbo;
-		
-		return system;
+		objects->names[objects->count] = name;
+		return objects->count++;
 	}
 	
-	void particle_system_upload_and_render(ParticleSystem* system, Mesh* mesh, RenderState* render_state) {
-		auto system_gl = (ParticleSystem_GL*) system;
+	static const uint32_t draw_key_sequence_shift = 32;
+	static const uint64_t draw_key_sequence_mask = (uint64_t) 0xFFFFF << draw_key_sequence_shift;
+	
+	// From the most significant bits down: render target (8 bits), blend mode (4 bits), sequence (20 bits), pass (2 bits), program (10 bits), texture (10 bits), mesh (10 bits).
+	// ALPHA draws blend over one another, so they keep the order they were queued in: their sequence is that of the draw, and comes before their state. Other draws have none.
+	// Objects are numbered by opengl_draw_key_index, so that any OpenGL names fit.
+	static uint64_t opengl_draw_key(DrawQueue* queue, RenderState* render_state, uint32_t pass, ShaderLinkage* linkage, Mesh* mesh) {
+		auto render_target_gl = (RenderTarget_GL*) render_state->render_target;
+		auto texture0_gl = (Texture_GL*) render_state->texture0;
 		
-		{	
-			//
-			// Upload instance data to the GPU. 
-			//
-			
-			// Because of sync issues, we probably want to use a smarter approach here.
-			// #opengl_sync_performance
-			uint32_t instance_buffer_size = system->count * sizeof(Particle);
-			glBindBuffer(GL_ARRAY_BUFFER, system_gl->instances_vbo);
-			glBufferSubData(GL_ARRAY_BUFFER, 0, instance_buffer_size, system->particles);
-			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		uint64_t target   = 0xFF; // Our window last, as it usually shows the render targets.
+		if (render_target_gl) {
+			target = opengl_draw_key_index(queue, DRAW_KEY_RENDER_TARGET, render_target_gl->fbo, 8);
+			if (target == 0xFF) target = 0xFE; // Past that, render targets share the index before it.
 		}
 		
-		{
-			//
-			// Render 
-			// 
+		uint64_t blend    = (uint64_t) render_state->blend_mode;
+		uint64_t sequence = render_state->blend_mode == BlendMode::ALPHA ? queue->count & 0xFFFFF : 0;
+		uint64_t program  = opengl_draw_key_index(queue, DRAW_KEY_PROGRAM, linkage ? linkage->program : 0, 10);
+		uint64_t texture  = opengl_draw_key_index(queue, DRAW_KEY_TEXTURE, texture0_gl ? texture0_gl->handle : 0, 10);
+		uint64_t mesh_vbo = opengl_draw_key_index(queue, DRAW_KEY_MESH, mesh ? mesh->vbo : 0, 10);
+		
+		return (target << 56) | ((blend & 0xF) << 52) | (sequence << draw_key_sequence_shift) | ((uint64_t) pass << 30) | (program << 20) | (texture << 10) | mesh_vbo;
+	}
+	
+	static void opengl_draw_queue_add(DrawQueue* queue, Draw_GL draw) {
+		if (queue->count == queue->capacity) {
+			uint32_t new_capacity = queue->capacity ? queue->capacity * 2 : 64;
+			
+			Draw_GL* draws = new Draw_GL[new_capacity];
+			for (uint32_t i = 0; i < queue->count; i += 1) draws[i] = queue->draws[i];
+			delete[] queue->draws;
+			queue->draws = draws;
 			
-			opengl_apply_render_state(render_state, true);
+			delete[] queue->batch;
+			queue->batch = new ParticleSystem*[new_capacity];
+			queue->capacity = new_capacity;
+		}
+		
+		draw.sequence = queue->count;
+		queue->draws[queue->count++] = draw;
+	}
+	
+	static int opengl_compare_draws(const void* a, const void* b) {
+		auto draw_a = (const Draw_GL*) a;
+		auto draw_b = (const Draw_GL*) b;
+		if (draw_a->key != draw_b->key) return draw_a->key < draw_b->key ? -1 : +1;
+		return draw_a->sequence < draw_b->sequence ? -1 : +1;
+	}
+	
+	// Whether two particle draws can go out as one call to particle_systems_upload_and_render.
+	// Sorted ALPHA draws that are next to each other were queued one after the other, so a batch, which renders its systems in order, keeps them in that order.
+	static bool opengl_can_draw_together(Draw_GL* a, Draw_GL* b) {
+		if (a->type != DrawType::PARTICLES || b->type != DrawType::PARTICLES) return false;
+		if ((a->key & ~draw_key_sequence_mask) != (b->key & ~draw_key_sequence_mask) || a->mesh != b->mesh) return false;
+		
+		RenderState* state_a = &a->render_state;
+		RenderState* state_b = &b->render_state;
+		return state_a->vertex_shader == state_b->vertex_shader && state_a->pixel_shader == state_b->pixel_shader
+			&& state_a->render_target == state_b->render_target && state_a->texture0 == state_b->texture0 && state_a->blend_mode == state_b->blend_mode
+			&& memcmp(&state_a->viewport, &state_b->viewport, sizeof(Rect)) == 0 && memcmp(&state_a->projection, &state_b->projection, sizeof(mat4)) == 0;
+	}
+	
+	DrawQueue* draw_queue_create() {
+		return new DrawQueue;
+	}
+	
+	void draw_queue_destroy(DrawQueue* queue) {
+		delete[] queue->draws;
+		delete[] queue->batch;
+		for (uint32_t f = 0; f < DRAW_KEY_FIELD_COUNT; f += 1) delete[] queue->key_objects[f].names;
+		delete queue;
+	}
+	
+	void draw_queue_add_particles(DrawQueue* queue, ParticleSystem* system, Mesh* mesh, RenderState* render_state) {
+		// The same vertex shader particle_system_upload_and_render falls back to.
+		ShaderLinkage* linkage = opengl_get_or_create_shader_program(render_state->vertex_shader, render_state->pixel_shader, opengl_instancing_vertex_shader(system->simulation));
+		
+		Draw_GL draw = {};
+		draw.key = opengl_draw_key(queue, render_state, 0, linkage, mesh);
+		draw.type = DrawType::PARTICLES;
+		draw.system = system;
+		draw.mesh = mesh;
+		draw.render_state = *render_state;
+		opengl_draw_queue_add(queue, draw);
+	}
+	
+	void draw_queue_add_trails(DrawQueue* queue, ParticleSystem* system, RenderState* render_state) {
+		if (!system->trail_length) return;
+		ShaderLinkage* linkage = opengl_get_or_create_shader_program(render_state->vertex_shader, render_state->pixel_shader, trail_vertex_shader);
+		
+		Draw_GL draw = {};
+		draw.key = opengl_draw_key(queue, render_state, 1, linkage, nullptr);
+		draw.type = DrawType::TRAILS;
+		draw.system = system;
+		draw.render_state = *render_state;
+		opengl_draw_queue_add(queue, draw);
+	}
+	
+	void draw_queue_add_mesh(DrawQueue* queue, Mesh* mesh, RenderState* render_state, int32_t index_count) {
+		ShaderLinkage* linkage = opengl_get_or_create_shader_program(render_state->vertex_shader, render_state->pixel_shader, default_vertex_shader);
+		
+		Draw_GL draw = {};
+		draw.key = opengl_draw_key(queue, render_state, 0, linkage, mesh);
+		draw.type = DrawType::MESH;
+		draw.mesh = mesh;
+		draw.index_count = index_count;
+		draw.render_state = *render_state;
+		opengl_draw_queue_add(queue, draw);
+	}
+	
+	void draw_queue_submit(DrawQueue* queue) {
+		// Sorted draws share most of their state with the previous one, which our state cache then doesn't bind again.
+		qsort(queue->draws, queue->count, sizeof(Draw_GL), opengl_compare_draws);
+		
+		uint32_t first = 0;
+		while (first < queue->count) {
+			Draw_GL* draw = &queue->draws[first];
+			uint32_t end = first + 1;
 			
-			// Bind the vertex format and mesh buffers
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-			glBindVertexBuffer(0, mesh->vbo, 0, sizeof(Vertex));
-			glBindVertexBuffer(1, system_gl->instances_vbo, 0, sizeof(Particle));
+			switch (draw->type) {
+			  case DrawType::PARTICLES: {
+					queue->batch[0] = draw->system;
+					while (end < queue->count && opengl_can_draw_together(draw, &queue->draws[end])) {
+						queue->batch[end - first] = queue->draws[end].system;
+						end += 1;
+					}
+					particle_systems_upload_and_render(queue->batch, end - first, draw->mesh, &draw->render_state);
+				} break;
 			
-			// Draw all particles in a single draw call.
-			glDrawElementsInstanced(GL_TRIANGLES, mesh->index_count, GL_UNSIGNED_INT, (void*) 0, system->count);
+			  case DrawType::TRAILS: particle_system_render_trails(draw->system, &draw->render_state); break;
+			  case DrawType::MESH:   mesh_render(draw->mesh, &draw->render_state, draw->index_count); break;
+			  default: SPARKLES_ASSERT(false, "Unknown draw type.");
+			}
 			
-			opengl_reset_render_state();
+			first = end;
 		}
+		
+		queue->count = 0;
+		for (uint32_t f = 0; f < DRAW_KEY_FIELD_COUNT; f += 1) queue->key_objects[f].count = 0;
 	}
 	
 	Shader* shader_create(ShaderLanguage language, ShaderType type, const char* shader_source_code) {
-		
-		GLenum gl_shader_type = -1;
-		switch (type) {
-		  case ShaderType::VERTEX: gl_shader_type = GL_VERTEX_SHADER;   break;
-		  case ShaderType::PIXEL:  gl_shader_type = GL_FRAGMENT_SHADER; break;
-		  default: SPARKLES_ASSERT(false);
+		if (language != ShaderLanguage::GLSL) {
+			SPARKLES_LOG("The OpenGL backend only compiles GLSL shaders.\n");
+			return nullptr;
 		}
 		
-		GLuint handle = glCreateShader(gl_shader_type);
-		glShaderSource(handle, 1, &shader_source_code, nullptr);
-		glCompileShader(handle);
+		return opengl_shader_create(type, &shader_source_code, 1);
+	}
+	
+	void shader_cache_set_directory(const char* directory) {
+		delete[] shader_cache_directory;
+		shader_cache_directory = nullptr;
+		if (!directory) return;
 		
-		int shader_compiled;
-		glGetShaderiv(handle, GL_COMPILE_STATUS, &shader_compiled);
-		if (!shader_compiled) {
-			char message[512];
-			glGetShaderInfoLog(handle, sizeof(message), nullptr, message);
-			SPARKLES_LOG("Failed to compile vertex shader:\n%s\n", message);
-			glDeleteShader(handle);
-			return nullptr;
-		}
+		size_t length = strlen(directory);
+		shader_cache_directory = new char[length + 1];
+		memcpy(shader_cache_directory, directory, length + 1);
+		
+		// It may exist already. If we can't create it, we just fail to save programs, and log it.
+#if _WIN32
+		_mkdir(directory);
+#else
+		mkdir(directory, 0755);
+#endif
+	}
 	
-		Shader* result = new Shader; // #memory_cleanup
-		result->handle = handle;
-		return result;
+	static float opengl_mesh_radius(Vertex vertices[], uint32_t vertex_count) {
+		float radius2 = 0;
+		for (uint32_t i = 0; i < vertex_count; i += 1) {
+			vec3 p = vertices[i].position;
+			float distance2 = p.x * p.x + p.y * p.y + p.z * p.z;
+			if (distance2 > radius2) radius2 = distance2;
+		}
+		return sqrtf(radius2);
 	}
 	
 	Mesh* mesh_create(uint32_t vertex_count, uint32_t index_count, Vertex vertices[], uint32_t indices[]) { 
@@ -385,17 +2655,19 @@ namespace Sparkles {
 		glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size, vertices, usage);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		
+		// Not through GL_ELEMENT_ARRAY_BUFFER, which belongs to whichever VAO our last draw left bound.
 		GLuint ibo;
 		glGenBuffers(1, &ibo);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_buffer_size, indices, usage);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, ibo);
+		glBufferData(GL_COPY_WRITE_BUFFER, index_buffer_size, indices, usage);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 		
 		Mesh* result = new Mesh; // #memory_cleanup
 		result->vbo = vbo;
 		result->ibo = ibo;
 		result->vertex_count = vertex_count;
 		result->index_count = index_count;
+		if (vertices) result->radius = opengl_mesh_radius(vertices, vertex_count);
 		return result;
 	}
 	
@@ -409,26 +2681,24 @@ namespace Sparkles {
 		glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
 		glBufferSubData(GL_ARRAY_BUFFER, 0, vertex_buffer_size, vertices);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		mesh->radius = opengl_mesh_radius(vertices, vertex_count);
 		
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, index_buffer_size, indices);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, mesh->ibo); // See mesh_create.
+		glBufferSubData(GL_COPY_WRITE_BUFFER, 0, index_buffer_size, indices);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 	}
 	
 	void mesh_render(Mesh* mesh, RenderState* render_state, int32_t index_count) {
 		if (index_count < 0) index_count = mesh->index_count;
 		
-		opengl_apply_render_state(render_state, false);
+		opengl_apply_render_state(render_state, default_vertex_shader, &default_vao);
 		
 		// Bind the vertex format and mesh buffers
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-		glBindVertexBuffer(0, mesh->vbo, 0, sizeof(Vertex));
+		opengl_bind_vertex_buffer(0, mesh->vbo, 0, sizeof(Vertex));
 		
 		// Draw all particles in a single draw call.
 		glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, (void*) 0);
-		
-		opengl_reset_render_state();
-		
 	}
 	
 	struct OpenGLTextureFormatInfo {
@@ -482,15 +2752,13 @@ namespace Sparkles {
 		
 		GLuint handle;
 		glGenTextures(1, &handle);
-		glBindTexture(GL_TEXTURE_2D, handle);
+		opengl_bind_texture0(handle);
 		glTexImage2D(GL_TEXTURE_2D, 0, format_info.gl_internal_format, width, height, 0, format_info.gl_format, format_info.gl_type, image_data);
 		
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, format_info.gl_swizzle);
 		
-		glBindTexture(GL_TEXTURE_2D, 0);
-		
 		Texture_GL* texture = new Texture_GL; // #memory_cleanup
 		texture->width = width;
 		texture->height = height;
@@ -502,7 +2770,7 @@ namespace Sparkles {
 	RenderTarget* render_target_create(TextureFormat format, uint32_t width, uint32_t height) {		
 		GLuint fbo;
 		glGenFramebuffers(1, &fbo);
-		glBindFramebuffer(GL_FRAMEBUFFER, fbo); 
+		opengl_bind_framebuffer(fbo);
 		
 		auto color_attachment = (Texture_GL*) texture_create(format, width, height, nullptr);
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_attachment->handle, 0);
@@ -510,8 +2778,6 @@ namespace Sparkles {
 		GLenum completion_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
 		SPARKLES_ASSERT(completion_status == GL_FRAMEBUFFER_COMPLETE);
 		
-		glBindFramebuffer(GL_FRAMEBUFFER, 0); 
-		
 		RenderTarget_GL* result = new RenderTarget_GL;
 		result->width = width;
 		result->height = height;
@@ -527,9 +2793,9 @@ namespace Sparkles {
 	
 	void render_target_clear(RenderTarget* render_target, vec4 color) {
 		if (render_target) {
-			glBindFramebuffer(GL_FRAMEBUFFER, ((RenderTarget_GL*) render_target)->fbo);
+			opengl_bind_framebuffer(((RenderTarget_GL*) render_target)->fbo);
 		} else {	
-			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			opengl_bind_framebuffer(0);
 		}
 		
 		glClearColor(color.x, color.y, color.z, color.w);
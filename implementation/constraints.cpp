@@ -0,0 +1,320 @@
+#include "sparkles_internal.h"
+#include "sparkles_utils.h"
+
+#include <math.h>
+#include <string.h> // For memset
+
+// XPBD constraint solver.
+// Each iteration projects every constraint in turn, moving its particles in proportion to their inverse masses.
+// The Lagrange multipliers carry the compliance over the iterations, so that soft constraints stay equally soft however many iterations we run.
+// See "XPBD: Position-Based Simulation of Compliant Constrained Dynamics", Macklin, Müller and Chentanez, 2016.
+
+namespace Sparkles {
+	
+	static constexpr uint32_t constraint_batch_size = 256; // Constraints per job. Fewer means more time spent handing out jobs than solving.
+	static constexpr uint32_t overflow_color = constraint_max_colors - 1;
+	
+	template <typename T>
+	static void resize_array(T** array, uint32_t count, uint32_t new_capacity) {
+		T* result = new T[new_capacity];
+		for (uint32_t i = 0; i < count; i += 1) result[i] = (*array)[i];
+		delete[] *array;
+		*array = result;
+	}
+	
+	ConstraintSolver* constraint_solver_create(uint32_t particle_capacity, uint32_t constraint_capacity) {
+		ConstraintSolver* solver = new ConstraintSolver();
+		
+		solver->particle_capacity = particle_capacity;
+		solver->particles = new Particle*[particle_capacity];
+		solver->inverse_masses = new float[particle_capacity];
+		solver->weights = new float[particle_capacity];
+		solver->start_positions = new vec2[particle_capacity];
+		
+		solver->constraint_capacity = constraint_capacity;
+		solver->constraints = new Constraint[constraint_capacity];
+		solver->lambdas = new float[constraint_capacity];
+		
+		constraint_solver_clear(solver);
+		return solver;
+	}
+	
+	void constraint_solver_destroy(ConstraintSolver* solver) {
+		delete[] solver->particles;
+		delete[] solver->inverse_masses;
+		delete[] solver->weights;
+		delete[] solver->start_positions;
+		delete[] solver->constraints;
+		delete[] solver->lambdas;
+		delete solver;
+	}
+	
+	void constraint_solver_clear(ConstraintSolver* solver) {
+		solver->particle_count = 0;
+		solver->constraint_count = 0;
+		solver->colored = false;
+		solver->color_count = 0;
+		memset(solver->color_offsets, 0, sizeof(solver->color_offsets));
+	}
+	
+	uint32_t constraint_solver_add_particle(ConstraintSolver* solver, Particle* particle, float inverse_mass) {
+		if (solver->particle_count == solver->particle_capacity) {
+			uint32_t new_capacity = solver->particle_capacity ? solver->particle_capacity * 2 : 64;
+			resize_array(&solver->particles, solver->particle_count, new_capacity);
+			resize_array(&solver->inverse_masses, solver->particle_count, new_capacity);
+			resize_array(&solver->weights, 0, new_capacity);
+			resize_array(&solver->start_positions, 0, new_capacity);
+			solver->particle_capacity = new_capacity;
+		}
+		
+		uint32_t index = solver->particle_count++;
+		solver->particles[index] = particle;
+		solver->inverse_masses[index] = inverse_mass;
+		return index;
+	}
+	
+	uint32_t constraint_solver_remove_particle(ConstraintSolver* solver, uint32_t index) {
+		SPARKLES_ASSERT(index < solver->particle_count, "Invalid particle.");
+		uint32_t last = solver->particle_count - 1;
+		
+		// Colored constraints are sorted by color, and dropping some keeps the colors of the others valid, so we only move the offsets.
+		// Renaming the last particle doesn't change which constraints share a particle either, since the removed one has none left.
+		uint32_t range_count = solver->colored ? solver->color_count : 1;
+		uint32_t kept = 0;
+		for (uint32_t c = 0; c < range_count; c += 1) {
+			uint32_t begin = solver->colored ? solver->color_offsets[c] : 0;
+			uint32_t end = solver->colored ? solver->color_offsets[c + 1] : solver->constraint_count;
+			if (solver->colored) solver->color_offsets[c] = kept;
+			
+			for (uint32_t i = begin; i < end; i += 1) {
+				Constraint constraint = solver->constraints[i];
+				uint32_t* p = constraint.particles;
+				if (p[0] == index || p[1] == index || p[2] == index) continue;
+				
+				for (int k = 0; k < 3; k += 1) {
+					if (p[k] == last) p[k] = index;
+				}
+				solver->constraints[kept++] = constraint;
+			}
+		}
+		if (solver->colored) {
+			for (uint32_t c = range_count; c <= constraint_max_colors; c += 1) solver->color_offsets[c] = kept;
+		}
+		solver->constraint_count = kept;
+		
+		solver->particles[index] = solver->particles[last];
+		solver->inverse_masses[index] = solver->inverse_masses[last];
+		solver->particle_count = last;
+		return last;
+	}
+	
+	static void constraint_solver_add(ConstraintSolver* solver, Constraint constraint) {
+		if (solver->constraint_count == solver->constraint_capacity) {
+			uint32_t new_capacity = solver->constraint_capacity ? solver->constraint_capacity * 2 : 64;
+			resize_array(&solver->constraints, solver->constraint_count, new_capacity);
+			resize_array(&solver->lambdas, 0, new_capacity);
+			solver->constraint_capacity = new_capacity;
+		}
+		
+		solver->constraints[solver->constraint_count++] = constraint;
+		solver->colored = false;
+	}
+	
+	void constraint_solver_add_distance(ConstraintSolver* solver, uint32_t a, uint32_t b, float compliance) {
+		SPARKLES_ASSERT(a < solver->particle_count && b < solver->particle_count && a != b, "Invalid particles for a distance constraint.");
+		
+		Constraint constraint = {};
+		constraint.type = ConstraintType::DISTANCE;
+		constraint.particles[0] = a;
+		constraint.particles[1] = b;
+		constraint.particles[2] = b; // Unused, but the coloring looks at all three.
+		constraint.rest = norm(solver->particles[a]->position.xy - solver->particles[b]->position.xy);
+		constraint.compliance = compliance;
+		constraint_solver_add(solver, constraint);
+	}
+	
+	void constraint_solver_add_bending(ConstraintSolver* solver, uint32_t a, uint32_t b, uint32_t c, float compliance) {
+		SPARKLES_ASSERT(a < solver->particle_count && b < solver->particle_count && c < solver->particle_count, "Invalid particles for a bending constraint.");
+		SPARKLES_ASSERT(a != b && b != c && a != c, "A bending constraint needs three different particles.");
+		
+		vec2 xa = solver->particles[a]->position.xy;
+		vec2 xb = solver->particles[b]->position.xy;
+		vec2 xc = solver->particles[c]->position.xy;
+		
+		Constraint constraint = {};
+		constraint.type = ConstraintType::BENDING;
+		constraint.particles[0] = a;
+		constraint.particles[1] = b;
+		constraint.particles[2] = c;
+		constraint.rest = norm(xb - (xa + xb + xc) / 3);
+		constraint.compliance = compliance;
+		constraint_solver_add(solver, constraint);
+	}
+	
+	// Greedy coloring: each constraint takes the lowest color that none of its particles has yet.
+	// Then we sort the constraints by color, so that each color is a contiguous range we can split into jobs.
+	static void constraint_solver_color(ConstraintSolver* solver) {
+		uint32_t count = solver->constraint_count;
+		
+		uint64_t* particle_colors = new uint64_t[solver->particle_count]; // Bit c is set when one of the particle's constraints has color c.
+		memset(particle_colors, 0, solver->particle_count * sizeof(uint64_t));
+		uint8_t* colors = new uint8_t[count];
+		uint32_t color_sizes[constraint_max_colors] = {};
+		
+		for (uint32_t i = 0; i < count; i += 1) {
+			uint32_t* p = solver->constraints[i].particles;
+			uint64_t taken = particle_colors[p[0]] | particle_colors[p[1]] | particle_colors[p[2]];
+			
+			uint32_t color = 0;
+			while (color < overflow_color && (taken >> color) & 1) color += 1;
+			
+			// The overflow color is solved serially, so it doesn't need to be kept apart from anything.
+			if (color < overflow_color) {
+				for (int k = 0; k < 3; k += 1) particle_colors[p[k]] |= (uint64_t) 1 << color;
+			}
+			
+			colors[i] = (uint8_t) color;
+			color_sizes[color] += 1;
+		}
+		
+		solver->color_count = 0;
+		solver->color_offsets[0] = 0;
+		for (uint32_t c = 0; c < constraint_max_colors; c += 1) {
+			solver->color_offsets[c + 1] = solver->color_offsets[c] + color_sizes[c];
+			if (color_sizes[c]) solver->color_count = c + 1;
+		}
+		
+		// Counting sort. Constraints keep their order within a color, which keeps neighbors of a rope close together in memory.
+		uint32_t cursors[constraint_max_colors];
+		for (uint32_t c = 0; c < constraint_max_colors; c += 1) cursors[c] = solver->color_offsets[c];
+		
+		Constraint* sorted = new Constraint[solver->constraint_capacity];
+		for (uint32_t i = 0; i < count; i += 1) sorted[cursors[colors[i]]++] = solver->constraints[i];
+		delete[] solver->constraints;
+		solver->constraints = sorted;
+		
+		delete[] particle_colors;
+		delete[] colors;
+		solver->colored = true;
+	}
+	
+	static void solve_distance(ConstraintSolver* solver, Constraint* constraint, float* lambda, float alpha) {
+		uint32_t a = constraint->particles[0];
+		uint32_t b = constraint->particles[1];
+		float wa = solver->weights[a];
+		float wb = solver->weights[b];
+		if (wa + wb == 0) return;
+		
+		vec2* xa = &solver->particles[a]->position.xy;
+		vec2* xb = &solver->particles[b]->position.xy;
+		
+		vec2 d = *xa - *xb;
+		float length = norm(d);
+		if (length < 1e-6f) return; // No direction to push them apart in.
+		
+		vec2 n = d / length;
+		float C = length - constraint->rest;
+		float delta_lambda = (-C - alpha * *lambda) / (wa + wb + alpha);
+		*lambda += delta_lambda;
+		
+		*xa += n * (wa * delta_lambda);
+		*xb -= n * (wb * delta_lambda);
+	}
+	
+	static void solve_bending(ConstraintSolver* solver, Constraint* constraint, float* lambda, float alpha) {
+		uint32_t a = constraint->particles[0];
+		uint32_t b = constraint->particles[1];
+		uint32_t c = constraint->particles[2];
+		float wa = solver->weights[a];
+		float wb = solver->weights[b];
+		float wc = solver->weights[c];
+		
+		vec2* xa = &solver->particles[a]->position.xy;
+		vec2* xb = &solver->particles[b]->position.xy;
+		vec2* xc = &solver->particles[c]->position.xy;
+		
+		// How far the middle particle is from the centroid, which is 0 when the three are in line.
+		// The gradients are -n/3 for the ends, and 2n/3 for the middle.
+		vec2 d = (2.0f * *xb - *xa - *xc) / 3;
+		float length = norm(d);
+		if (length < 1e-6f) return;
+		
+		float w = (wa + wc + 4 * wb) / 9;
+		if (w == 0) return;
+		
+		vec2 n = d / length;
+		float C = length - constraint->rest;
+		float delta_lambda = (-C - alpha * *lambda) / (w + alpha);
+		*lambda += delta_lambda;
+		
+		vec2 end_step = n * (-delta_lambda / 3);
+		*xa += wa * end_step;
+		*xc += wc * end_step;
+		*xb += n * (wb * delta_lambda * 2 / 3);
+	}
+	
+	static void solve_constraint_range(ConstraintSolver* solver, uint32_t begin, uint32_t end, float inverse_dt2) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			Constraint* constraint = &solver->constraints[i];
+			float alpha = constraint->compliance * inverse_dt2;
+			
+			switch (constraint->type) {
+			  case ConstraintType::DISTANCE: solve_distance(solver, constraint, &solver->lambdas[i], alpha); break;
+			  case ConstraintType::BENDING:  solve_bending(solver, constraint, &solver->lambdas[i], alpha); break;
+			  default: SPARKLES_ASSERT(false, "Unknown constraint type.");
+			}
+		}
+	}
+	
+	struct ConstraintColorJob {
+		ConstraintSolver* solver;
+		uint32_t begin;
+		uint32_t end;
+		float inverse_dt2;
+	};
+	
+	static void solve_constraint_batch(void* data, uint32_t batch_index) {
+		auto job = (ConstraintColorJob*) data;
+		uint32_t begin = job->begin + batch_index * constraint_batch_size;
+		uint32_t end = begin + constraint_batch_size < job->end ? begin + constraint_batch_size : job->end;
+		solve_constraint_range(job->solver, begin, end, job->inverse_dt2);
+	}
+	
+	void constraint_solver_solve(ConstraintSolver* solver, float dt) {
+		if (solver->constraint_count == 0 || dt <= 0) return;
+		if (!solver->colored) constraint_solver_color(solver);
+		
+		for (uint32_t i = 0; i < solver->particle_count; i += 1) {
+			Particle* p = solver->particles[i];
+			solver->weights[i] = p->life < 0 ? 0 : solver->inverse_masses[i];
+			solver->start_positions[i] = p->position.xy;
+		}
+		memset(solver->lambdas, 0, solver->constraint_count * sizeof(float));
+		
+		float inverse_dt2 = 1 / (dt * dt);
+		
+		for (uint32_t iteration = 0; iteration < solver->iterations; iteration += 1) {
+			for (uint32_t color = 0; color < solver->color_count; color += 1) {
+				uint32_t begin = solver->color_offsets[color];
+				uint32_t end = solver->color_offsets[color + 1];
+				if (begin == end) continue;
+				
+				if (color == overflow_color) {
+					solve_constraint_range(solver, begin, end, inverse_dt2);
+					continue;
+				}
+				
+				ConstraintColorJob job = {solver, begin, end, inverse_dt2};
+				jobs_parallel_for((end - begin + constraint_batch_size - 1) / constraint_batch_size, solve_constraint_batch, &job);
+			}
+		}
+		
+		// The corrections were position changes over the step, so they change the velocity by as much over 'dt'.
+		for (uint32_t i = 0; i < solver->particle_count; i += 1) {
+			if (solver->weights[i] == 0) continue;
+			
+			Particle* p = solver->particles[i];
+			p->velocity.xy += (p->position.xy - solver->start_positions[i]) / dt;
+		}
+	}
+}
@@ -0,0 +1,225 @@
+#include <math.h>
+
+#include "sparkles.h"
+#include "sparkles_utils.h"
+
+// Emission shapes turn meshes, curves and images into spawn areas.
+// Each one is split into elements (triangles, curve segments or pixels), weighted by their area, length or alpha, and put in an alias table.
+// Sampling a position is then one table lookup, plus a uniform point within the chosen element.
+
+namespace Sparkles {
+	
+	// One random_get can have as few as 15 bits, which is not enough to pick among the pixels of a big image, so we take two. #random_number_cleanup
+	static uint32_t random_index(uint32_t count) {
+		uint32_t high = (uint32_t) (random_get() * 0xffff);
+		uint32_t low = (uint32_t) (random_get() * 0xffff);
+		return ((high << 16) | low) % count;
+	}
+	
+	AliasTable alias_table_create(float* weights, uint32_t count) {
+		SPARKLES_ASSERT(count > 0, "An alias table needs at least one slot.");
+		
+		AliasTable result = {};
+		result.count = count;
+		result.probabilities = new float[count];
+		result.aliases = new uint32_t[count];
+		
+		double total = 0;
+		for (uint32_t i = 0; i < count; i += 1) total += weights[i];
+		
+		// Scale the weights so that they average 1. Then, each slot under 1 is topped up by a slot over 1, which becomes its alias.
+		float* scaled = new float[count];
+		uint32_t* small = new uint32_t[count];
+		uint32_t* large = new uint32_t[count];
+		uint32_t small_count = 0;
+		uint32_t large_count = 0;
+		
+		for (uint32_t i = 0; i < count; i += 1) {
+			scaled[i] = total > 0 ? (float) (weights[i] * count / total) : 1;
+			if (scaled[i] < 1) small[small_count++] = i;
+			else               large[large_count++] = i;
+		}
+		
+		while (small_count && large_count) {
+			uint32_t s = small[--small_count];
+			uint32_t l = large[--large_count];
+			
+			result.probabilities[s] = scaled[s];
+			result.aliases[s] = l;
+			
+			scaled[l] = (scaled[l] + scaled[s]) - 1;
+			if (scaled[l] < 1) small[small_count++] = l;
+			else               large[large_count++] = l;
+		}
+		
+		// Whatever is left is 1, up to rounding errors.
+		while (large_count) {
+			uint32_t l = large[--large_count];
+			result.probabilities[l] = 1;
+			result.aliases[l] = l;
+		}
+		while (small_count) {
+			uint32_t s = small[--small_count];
+			result.probabilities[s] = 1;
+			result.aliases[s] = s;
+		}
+		
+		delete[] scaled;
+		delete[] small;
+		delete[] large;
+		
+		return result;
+	}
+	
+	void alias_table_destroy(AliasTable* table) {
+		delete[] table->probabilities;
+		delete[] table->aliases;
+		*table = {};
+	}
+	
+	uint32_t alias_table_sample(AliasTable* table) {
+		uint32_t slot = random_index(table->count);
+		return random_get() < table->probabilities[slot] ? slot : table->aliases[slot];
+	}
+	
+	static Rect points_bounds(vec2* points, uint32_t count) {
+		vec2 min = points[0];
+		vec2 max = points[0];
+		for (uint32_t i = 1; i < count; i += 1) {
+			min = {fmin(min.x, points[i].x), fmin(min.y, points[i].y)};
+			max = {fmax(max.x, points[i].x), fmax(max.y, points[i].y)};
+		}
+		
+		return {min.x, min.y, max.x - min.x, max.y - min.y};
+	}
+	
+	EmissionShape* emission_shape_create_from_mesh(MeshBuilder* builder) {
+		uint32_t triangle_count = builder->index_cursor / 3;
+		SPARKLES_ASSERT(triangle_count > 0, "The mesh has no triangles.");
+		
+		EmissionShape* shape = new EmissionShape();
+		shape->type = EmissionShapeType::MESH;
+		shape->points = new vec2[triangle_count * 3];
+		
+		float* areas = new float[triangle_count];
+		for (uint32_t t = 0; t < triangle_count; t += 1) {
+			vec2* corners = &shape->points[t * 3];
+			for (int k = 0; k < 3; k += 1) corners[k] = builder->vertices[builder->indices[t * 3 + k]].position.xy;
+			
+			vec2 e0 = corners[1] - corners[0];
+			vec2 e1 = corners[2] - corners[0];
+			areas[t] = 0.5f * fabs(e0.x * e1.y - e0.y * e1.x);
+		}
+		
+		shape->table = alias_table_create(areas, triangle_count);
+		shape->bounds = points_bounds(shape->points, triangle_count * 3);
+		delete[] areas;
+		
+		return shape;
+	}
+	
+	EmissionShape* emission_shape_create_from_curves(CubicBezier* curves, uint32_t curve_count, uint32_t segments_per_curve) {
+		uint32_t segment_count = curve_count * segments_per_curve;
+		SPARKLES_ASSERT(segment_count > 0, "No curves to sample from.");
+		
+		EmissionShape* shape = new EmissionShape();
+		shape->type = EmissionShapeType::CURVE;
+		shape->points = new vec2[segment_count * 2];
+		
+		// We approximate each curve by a polyline, fine enough that nobody can tell.
+		float* lengths = new float[segment_count];
+		float dt = 1.0f / segments_per_curve;
+		for (uint32_t c = 0; c < curve_count; c += 1) {
+			for (uint32_t i = 0; i < segments_per_curve; i += 1) {
+				uint32_t segment = c * segments_per_curve + i;
+				vec2 a = bezier_get_position(curves[c], dt * i);
+				vec2 b = bezier_get_position(curves[c], dt * (i + 1));
+				
+				shape->points[segment * 2 + 0] = a;
+				shape->points[segment * 2 + 1] = b;
+				lengths[segment] = norm(b - a);
+			}
+		}
+		
+		shape->table = alias_table_create(lengths, segment_count);
+		shape->bounds = points_bounds(shape->points, segment_count * 2);
+		delete[] lengths;
+		
+		return shape;
+	}
+	
+	EmissionShape* emission_shape_create_from_image(TextureFormat format, uint32_t width, uint32_t height, void* image_data, Rect rect) {
+		uint32_t pixel_count = width * height;
+		SPARKLES_ASSERT(pixel_count > 0 && image_data, "The image is empty.");
+		
+		float* weights = new float[pixel_count];
+		switch (format) {
+		  case TextureFormat::RGBA_UINT8: {
+				uint8_t* pixels = (uint8_t*) image_data;
+				for (uint32_t i = 0; i < pixel_count; i += 1) weights[i] = pixels[i * 4 + 3] / 255.0f;
+			} break;
+		
+		  case TextureFormat::ALPHA_FLOAT32: {
+				float* pixels = (float*) image_data;
+				for (uint32_t i = 0; i < pixel_count; i += 1) weights[i] = fmax(pixels[i], 0.0f);
+			} break;
+		
+		  default: SPARKLES_ASSERT(false, "Unsupported image format for emission shapes.");
+		}
+		
+		EmissionShape* shape = new EmissionShape();
+		shape->type = EmissionShapeType::MASK;
+		shape->points = nullptr;
+		shape->mask_width = width;
+		shape->mask_height = height;
+		shape->bounds = rect;
+		shape->table = alias_table_create(weights, pixel_count);
+		delete[] weights;
+		
+		return shape;
+	}
+	
+	void emission_shape_destroy(EmissionShape* shape) {
+		alias_table_destroy(&shape->table);
+		delete[] shape->points;
+		delete shape;
+	}
+	
+	vec2 emission_shape_sample(EmissionShape* shape) {
+		uint32_t element = alias_table_sample(&shape->table);
+		
+		switch (shape->type) {
+		  case EmissionShapeType::MESH: {
+				// Folding the unit square in half gives a uniform point in the triangle.
+				vec2* corners = &shape->points[element * 3];
+				float u = random_get();
+				float v = random_get();
+				if (u + v > 1) {
+					u = 1 - u;
+					v = 1 - v;
+				}
+				return corners[0] + u * (corners[1] - corners[0]) + v * (corners[2] - corners[0]);
+			}
+		
+		  case EmissionShapeType::CURVE: {
+				vec2* ends = &shape->points[element * 2];
+				return lerp(ends[0], ends[1], random_get());
+			}
+		
+		  case EmissionShapeType::MASK: {
+				// Anywhere within the pixel. Rows go along y, like the uvs of put_rect.
+				float x = (element % shape->mask_width + random_get()) / shape->mask_width;
+				float y = (element / shape->mask_width + random_get()) / shape->mask_height;
+				return {shape->bounds.x + x * shape->bounds.w, shape->bounds.y + y * shape->bounds.h};
+			}
+		
+		  default: SPARKLES_ASSERT(false, "Unknown emission shape type.");
+		}
+		
+		return {0, 0};
+	}
+	
+	void emission_shape_sample(EmissionShape* shape, vec2* positions, uint32_t count) {
+		for (uint32_t i = 0; i < count; i += 1) positions[i] = emission_shape_sample(shape);
+	}
+}
@@ -0,0 +1,154 @@
+#include "sparkles.h"
+#include "sparkles_utils.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// A very small job system: a pool of worker threads that help the calling thread run parallel-for loops.
+// One loop runs at a time. Loops started from inside a job run serially on the calling thread.
+
+namespace Sparkles {
+	
+	// What a thread needs to run jobs from a batch. Written under the job system's mutex, where workers copy it when they wake up.
+	struct JobBatchInfo {
+		JobFunction function = nullptr;
+		void* data = nullptr;
+		uint32_t count = 0;
+		uint32_t generation = 0; // The low bits of JobSystem::batch_generation.
+	};
+	
+	struct JobBatch {
+		JobBatchInfo info;
+		
+		// The batch's generation in the high 32 bits, and the next index to run in the low ones.
+		// Threads only advance it while it holds the generation they woke up for, so that a worker that is late from the previous batch never takes an index of this one.
+		std::atomic<uint64_t> cursor;
+		std::atomic<uint32_t> completed;
+	};
+	
+	static constexpr uint32_t max_worker_count = 63;
+	
+	struct JobSystem {
+		std::mutex mutex;
+		std::condition_variable wake_up;  // Workers wait here for a new batch.
+		std::condition_variable finished; // The caller waits here for the batch to complete.
+		
+		std::mutex submission_mutex; // Only one parallel-for at a time.
+		
+		JobBatch batch;
+		uint64_t batch_generation = 0; // Incremented for every batch, so that workers don't run the same batch twice.
+		uint32_t worker_count = 0;
+		bool workers_started = false;
+	};
+	
+	// Workers are detached and never stop, so this is never destroyed: destroying a condition variable that still has waiters blocks at exit.
+	static JobSystem* the_job_system = new JobSystem; // #memory_cleanup
+	
+	static thread_local bool inside_job;
+	
+	// Runs jobs from the batch described by 'info' until there are none left, or until the next batch replaced it. Returns how many this thread ran.
+	static uint32_t jobs_run_batch(JobBatch* batch, JobBatchInfo info) {
+		uint32_t ran = 0;
+		uint64_t cursor = batch->cursor.load();
+		for (;;) {
+			if ((uint32_t) (cursor >> 32) != info.generation) break;
+			
+			uint32_t index = (uint32_t) cursor;
+			if (index >= info.count) break;
+			
+			// On failure, 'cursor' gets the current value, and we look again.
+			if (!batch->cursor.compare_exchange_weak(cursor, cursor + 1)) continue;
+			
+			info.function(info.data, index);
+			ran += 1;
+			cursor = batch->cursor.load();
+		}
+		return ran;
+	}
+	
+	static void jobs_worker_loop() {
+		JobSystem* jobs = the_job_system;
+		inside_job = true;
+		uint64_t last_generation = 0;
+		
+		for (;;) {
+			JobBatch* batch = &jobs->batch;
+			JobBatchInfo info;
+			{
+				std::unique_lock<std::mutex> lock(jobs->mutex);
+				jobs->wake_up.wait(lock, [&] { return jobs->batch_generation != last_generation; });
+				last_generation = jobs->batch_generation;
+				info = batch->info;
+			}
+			
+			// The submitter waits for every job of the batch, so it can't start the next one before we have counted ours.
+			uint32_t ran = jobs_run_batch(batch, info);
+			if (ran && batch->completed.fetch_add(ran) + ran >= info.count) {
+				std::lock_guard<std::mutex> lock(jobs->mutex);
+				jobs->finished.notify_all();
+			}
+		}
+	}
+	
+	static void jobs_start_workers(JobSystem* jobs) {
+		uint32_t hardware_threads = std::thread::hardware_concurrency();
+		jobs->worker_count = hardware_threads > 1 ? hardware_threads - 1 : 0; // The calling thread also runs jobs.
+		if (jobs->worker_count > max_worker_count) jobs->worker_count = max_worker_count;
+		
+		for (uint32_t i = 0; i < jobs->worker_count; i += 1) {
+			// Workers live for as long as the program does.
+			std::thread(jobs_worker_loop).detach();
+		}
+		
+		jobs->workers_started = true;
+	}
+	
+	uint32_t jobs_worker_count() {
+		JobSystem* jobs = the_job_system;
+		if (inside_job) return jobs->worker_count + 1; // The submitting thread holds the submission lock, and the workers are already running.
+		
+		std::lock_guard<std::mutex> lock(jobs->submission_mutex);
+		if (!jobs->workers_started) jobs_start_workers(jobs);
+		return jobs->worker_count + 1;
+	}
+	
+	void jobs_parallel_for(uint32_t count, JobFunction function, void* data) {
+		if (count == 0) return;
+		
+		// Not worth waking anybody up for a single job, and nested loops would deadlock waiting for themselves.
+		if (count == 1 || inside_job) {
+			for (uint32_t i = 0; i < count; i += 1) function(data, i);
+			return;
+		}
+		
+		JobSystem* jobs = the_job_system;
+		std::lock_guard<std::mutex> submission_lock(jobs->submission_mutex);
+		if (!jobs->workers_started) jobs_start_workers(jobs);
+		
+		JobBatch* batch = &jobs->batch;
+		JobBatchInfo info;
+		{
+			std::lock_guard<std::mutex> lock(jobs->mutex);
+			jobs->batch_generation += 1;
+			
+			info.function = function;
+			info.data = data;
+			info.count = count;
+			info.generation = (uint32_t) jobs->batch_generation;
+			batch->info = info;
+			batch->completed = 0;
+			batch->cursor = (uint64_t) info.generation << 32;
+		}
+		jobs->wake_up.notify_all();
+		
+		inside_job = true;
+		uint32_t ran = jobs_run_batch(batch, info);
+		inside_job = false;
+		
+		std::unique_lock<std::mutex> lock(jobs->mutex);
+		batch->completed.fetch_add(ran);
+		jobs->finished.wait(lock, [&] { return batch->completed.load() >= count; });
+	}
+}
@@ -0,0 +1,1171 @@
+#include "sparkles_internal.h"
+#include "sparkles_utils.h"
+
+#include <math.h>
+#include <stdlib.h> // For malloc
+#include <string.h> // For memset
+#include <atomic>
+
+#if _WIN32
+#include <malloc.h> // For _aligned_malloc
+#endif
+
+namespace Sparkles {
+	
+	void* memory_allocate_aligned(size_t size, size_t alignment) {
+#if _WIN32
+		return _aligned_malloc(size, alignment);
+#else
+		void* result = nullptr;
+		if (posix_memalign(&result, alignment, size) != 0) return nullptr;
+		return result;
+#endif
+	}
+	
+	void memory_free_aligned(void* memory) {
+#if _WIN32
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+	
+	//
+	// Spawn requests from other threads.
+	// A fixed ring of requests, allocated with the system, so that requesting never allocates. Producers claim a request by moving the shared write cursor,
+	// then publish it through its sequence number. The consumer (the thread that simulates the system) is alone on the read side, so it needs no atomic cursor.
+	// Sequence numbers tell which lap of the ring each request is on, which also rules out the ABA problem.
+	//
+	static_assert((particle_spawn_request_capacity & (particle_spawn_request_capacity - 1)) == 0, "particle_spawn_request_capacity must be a power of two.");
+	
+	struct ParticleSpawnRequest {
+		std::atomic<uint32_t> sequence; // Its cursor when it is free to claim, its cursor + 1 once published.
+		uint32_t count;
+		ParticleSpawnParams params;
+	};
+	
+	struct ParticleSpawnQueue {
+		ParticleSpawnRequest requests[particle_spawn_request_capacity];
+		std::atomic<uint32_t> write_cursor;
+		uint32_t read_cursor;
+	};
+	
+	static ParticleSpawnQueue* particle_spawn_queue_create() {
+		auto queue = new ParticleSpawnQueue;
+		for (uint32_t i = 0; i < particle_spawn_request_capacity; i += 1) queue->requests[i].sequence.store(i, std::memory_order_relaxed);
+		queue->write_cursor.store(0, std::memory_order_relaxed);
+		queue->read_cursor = 0;
+		return queue;
+	}
+	
+	bool particle_system_request_spawn(ParticleSystem* system, ParticleSpawnParams* params, uint32_t count) {
+		if (!count) return true;
+		
+		auto queue = system->spawn_queue;
+		uint32_t cursor = queue->write_cursor.load(std::memory_order_relaxed);
+		while (true) {
+			ParticleSpawnRequest* request = &queue->requests[cursor & (particle_spawn_request_capacity - 1)];
+			int32_t lap = (int32_t) (request->sequence.load(std::memory_order_acquire) - cursor);
+			
+			if (lap < 0) return false; // The consumer has not taken the request from the last lap yet: the ring is full.
+			if (lap > 0) {
+				cursor = queue->write_cursor.load(std::memory_order_relaxed); // Another producer claimed it first.
+				continue;
+			}
+			
+			// A failed exchange reloads 'cursor' for us.
+			if (queue->write_cursor.compare_exchange_weak(cursor, cursor + 1, std::memory_order_relaxed, std::memory_order_relaxed)) {
+				request->count = count;
+				request->params = *params;
+				request->sequence.store(cursor + 1, std::memory_order_release);
+				return true;
+			}
+		}
+	}
+	
+	// Called by particle_system_advance, from the thread that simulates the system. Returns how many particles were spawned.
+	static uint32_t particle_system_process_spawn_requests(ParticleSystem* system) {
+		auto queue = system->spawn_queue;
+		
+		uint32_t spawned = 0;
+		while (true) {
+			uint32_t cursor = queue->read_cursor;
+			ParticleSpawnRequest* request = &queue->requests[cursor & (particle_spawn_request_capacity - 1)];
+			if (request->sequence.load(std::memory_order_acquire) != cursor + 1) break; // Empty, or its producer is still filling it in, in which case it waits for the next step.
+			
+			for (uint32_t i = 0; i < request->count; i += 1) {
+				Particle* p = particle_system_spawn(system);
+				if (!p) break;
+				
+				particle_spawn(p, &request->params);
+				spawned += 1;
+			}
+			
+			// Free for producers on the next lap.
+			request->sequence.store(cursor + particle_spawn_request_capacity, std::memory_order_release);
+			queue->read_cursor = cursor + 1;
+		}
+		
+		return spawned;
+	}
+	
+	static uint32_t round_up_to_power_of_two(uint32_t value) {
+		uint32_t result = 1;
+		while (result < value) result <<= 1;
+		return result;
+	}
+	
+	static void particle_spawn_window_clear(ParticleSpawnWindow* window) {
+		window->min = {+INFINITY, +INFINITY};
+		window->max = {-INFINITY, -INFINITY};
+		window->max_speed = 0;
+		window->max_life = 0;
+		window->death_time = -INFINITY;
+	}
+	
+	static void particle_chunk_clear_bounds(ParticleChunk* chunk) {
+		chunk->bounds_min = {+INFINITY, +INFINITY};
+		chunk->bounds_max = {-INFINITY, -INFINITY};
+		particle_spawn_window_clear(&chunk->spawn_windows[0]);
+		particle_spawn_window_clear(&chunk->spawn_windows[1]);
+	}
+	
+	static void particle_chunk_allocate_trails(ParticleSystem* system, ParticleChunk* chunk) {
+		uint32_t capacity = system->chunk_capacity;
+		
+		chunk->trail_positions = (vec2*) memory_allocate_aligned(system->trail_length * capacity * sizeof(vec2), particle_chunk_alignment);
+		SPARKLES_ASSERT(chunk->trail_positions);
+		
+		chunk->trail_counts = new uint8_t[capacity];
+		memset(chunk->trail_counts, 0, capacity);
+		chunk->trail_dirty_rows = system->trail_length;
+	}
+	
+	static void particle_chunk_free_trails(ParticleChunk* chunk) {
+		memory_free_aligned(chunk->trail_positions);
+		delete[] chunk->trail_counts;
+		chunk->trail_positions = nullptr;
+		chunk->trail_counts = nullptr;
+		chunk->trail_dirty_rows = 0;
+	}
+	
+	static ParticleChunk* particle_chunk_create(ParticleSystem* system) {
+		uint32_t capacity = system->chunk_capacity;
+		
+		ParticleChunk* chunk = backend_particle_chunk_allocate(system);
+		chunk->used = 0;
+		chunk->alive = 0;
+		chunk->free_count = 0;
+		chunk->free_slots = new uint32_t[capacity];
+		
+		chunk->particles = (Particle*) memory_allocate_aligned(capacity * sizeof(Particle), particle_chunk_alignment);
+		SPARKLES_ASSERT(chunk->particles);
+		for (uint32_t i = 0; i < capacity; i += 1) {
+			chunk->particles[i] = {};
+			chunk->particles[i].life = -1;
+		}
+		
+		chunk->birth_times = (float*) memory_allocate_aligned(capacity * sizeof(float), particle_chunk_alignment);
+		SPARKLES_ASSERT(chunk->birth_times);
+		memset(chunk->birth_times, 0, capacity * sizeof(float));
+		
+		for (uint32_t a = 0; a < particle_max_attribute_count; a += 1) chunk->attributes[a] = nullptr;
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			uint32_t size = capacity * particle_attribute_size(&system->attributes[a]);
+			chunk->attributes[a] = (uint8_t*) memory_allocate_aligned(size, particle_chunk_alignment);
+			SPARKLES_ASSERT(chunk->attributes[a]);
+			memset(chunk->attributes[a], 0, size);
+		}
+		
+		chunk->dirty_begin = UINT32_MAX; // Empty range.
+		chunk->dirty_end = 0;
+		chunk->latest_death_time = 0;
+		chunk->death_pending_begin = UINT32_MAX;
+		chunk->death_pending_end = 0;
+		particle_chunk_clear_bounds(chunk);
+		
+		chunk->trail_positions = nullptr;
+		chunk->trail_counts = nullptr;
+		chunk->trail_dirty_rows = 0;
+		if (system->trail_length) particle_chunk_allocate_trails(system, chunk);
+		
+		return chunk;
+	}
+	
+	static void particle_chunk_destroy(ParticleSystem* system, ParticleChunk* chunk) {
+		memory_free_aligned(chunk->particles);
+		memory_free_aligned(chunk->birth_times);
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) memory_free_aligned(chunk->attributes[a]);
+		if (chunk->trail_positions) particle_chunk_free_trails(chunk);
+		delete[] chunk->free_slots;
+		backend_particle_chunk_release(system, chunk);
+	}
+	
+	static ParticleChunk* particle_system_add_chunk(ParticleSystem* system) {
+		if (system->chunk_count == system->chunk_array_capacity) {
+			// Only the array of pointers grows. The chunks themselves stay where they are.
+			uint32_t new_capacity = system->chunk_array_capacity ? system->chunk_array_capacity * 2 : 4;
+			auto new_chunks = new ParticleChunk*[new_capacity];
+			for (uint32_t c = 0; c < system->chunk_count; c += 1) new_chunks[c] = system->chunks[c];
+			delete[] system->chunks;
+			
+			system->chunks = new_chunks;
+			system->chunk_array_capacity = new_capacity;
+		}
+		
+		auto chunk = particle_chunk_create(system);
+		system->chunks[system->chunk_count++] = chunk;
+		return chunk;
+	}
+	
+	ParticleSystem* particle_system_create(uint32_t particle_count, ParticleAttribute attributes[], uint32_t attribute_count) {
+		SPARKLES_ASSERT(attribute_count <= particle_max_attribute_count);
+		
+		uint32_t chunk_capacity = round_up_to_power_of_two(particle_count);
+		if (chunk_capacity < particle_chunk_min_capacity) chunk_capacity = particle_chunk_min_capacity;
+		if (chunk_capacity > particle_chunk_max_capacity) chunk_capacity = particle_chunk_max_capacity;
+		
+		ParticleSystem* system = backend_particle_system_allocate();
+		system->chunk_capacity = chunk_capacity;
+		system->chunk_count = 0;
+		system->chunks = nullptr;
+		system->max_particle_count = 0;
+		system->simulation = ParticleSimulation::CPU;
+		system->ballistic = {};
+		system->gpu = {};
+		system->time = 0;
+		system->trail_length = 0;
+		system->trail_head = 0;
+		system->reorder_cursor = 0;
+		system->reorder_scratch = nullptr;
+		system->reorder_scratch_chunks = 0;
+		system->chunk_array_capacity = 0;
+		
+		system->attribute_count = attribute_count;
+		for (uint32_t a = 0; a < attribute_count; a += 1) {
+			SPARKLES_ASSERT(attributes[a].components >= 1 && attributes[a].components <= 4);
+			system->attributes[a] = attributes[a];
+		}
+		
+		system->spawn_queue = particle_spawn_queue_create();
+		
+		backend_particle_system_configure(system);
+		particle_system_reserve(system, particle_count);
+		return system;
+	}
+	
+	void particle_system_destroy(ParticleSystem* system) {
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) particle_chunk_destroy(system, system->chunks[c]);
+		delete[] system->chunks;
+		memory_free_aligned(system->reorder_scratch);
+		
+		delete system->spawn_queue; // Along with requests that never made it to a step.
+		
+		backend_particle_system_release(system);
+	}
+	
+	// GPU systems whose slots are handed out on the GPU, see ParticleSimulation::GPU.
+	static bool particle_system_has_gpu_slots(ParticleSystem* system) {
+		return system->simulation == ParticleSimulation::GPU && backend_particle_gpu_slots_supported();
+	}
+	
+	Particle* particle_system_spawn(ParticleSystem* system, float age) {
+		// First fit: we always fill the earliest chunks first, so that the last chunks are the first ones to become empty and be released.
+		// Other GPU systems only take fresh slots, so that each chunk's spawns stay one range that holds nothing else.
+		bool gpu_slots = particle_system_has_gpu_slots(system);
+		bool reuse_slots = system->simulation != ParticleSimulation::GPU;
+		ParticleChunk* chunk = nullptr;
+		uint32_t index = 0;
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* candidate = system->chunks[c];
+			if (gpu_slots) {
+				// The GPU has at least as many free slots as the chunk has room for particles.
+				if (candidate->alive < system->chunk_capacity) {
+					chunk = candidate;
+					break;
+				}
+				continue;
+			}
+			
+			if (candidate->free_count > 0 && reuse_slots) {
+				chunk = candidate;
+				index = candidate->free_slots[--candidate->free_count];
+				break;
+			}
+			
+			if (candidate->used < system->chunk_capacity) {
+				chunk = candidate;
+				index = candidate->used++;
+				break;
+			}
+		}
+		
+		if (!chunk) {
+			uint32_t capacity = particle_system_capacity(system);
+			if (system->max_particle_count && capacity >= system->max_particle_count) return nullptr;
+			
+			chunk = particle_system_add_chunk(system);
+			if (!gpu_slots) index = chunk->used++;
+		}
+		
+		if (gpu_slots) {
+			// The particle waits at the end of the chunk's spawns, until the backend hands them to the GPU, which picks their slots.
+			// Fresh slots come out lowest first, and no faster than particles spawn, so the ones from 'used' on are still untouched.
+			index = chunk->dirty_end;
+			if (chunk->used < system->chunk_capacity) chunk->used += 1;
+		}
+		
+		chunk->alive += 1;
+		chunk->birth_times[index] = system->simulation == ParticleSimulation::BALLISTIC ? system->time - age : system->time;
+		if (index < chunk->dirty_begin) chunk->dirty_begin = index;
+		if (index + 1 > chunk->dirty_end) chunk->dirty_end = index + 1;
+		if (index < chunk->death_pending_begin) chunk->death_pending_begin = index;
+		if (index + 1 > chunk->death_pending_end) chunk->death_pending_end = index + 1;
+		
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			uint32_t size = particle_attribute_size(&system->attributes[a]);
+			memset(&chunk->attributes[a][index * size], 0, size);
+		}
+		
+		if (chunk->trail_counts) chunk->trail_counts[index] = 0; // The history of the slot's previous particle.
+		
+		Particle* result = &chunk->particles[index];
+		*result = {};
+		return result;
+	}
+	
+	static void particle_chunk_reset(ParticleSystem* system, ParticleChunk* chunk) {
+		chunk->used = 0;
+		chunk->alive = 0;
+		chunk->free_count = 0;
+		chunk->dirty_begin = UINT32_MAX;
+		chunk->dirty_end = 0;
+		chunk->death_pending_begin = UINT32_MAX;
+		chunk->death_pending_end = 0;
+		particle_chunk_clear_bounds(chunk);
+		backend_particle_chunk_reset(system, chunk);
+	}
+	
+	void particle_kill(ParticleChunk* chunk, uint32_t index) {
+		SPARKLES_ASSERT(index < chunk->used && chunk->alive > 0);
+		
+		Particle* p = &chunk->particles[index];
+		p->life = -1;
+		p->scale = 0; // So that it is never rendered.
+		
+		chunk->alive -= 1;
+		if (chunk->alive == 0) {
+			// The whole chunk is dead, so we can start over. This keeps 'used' (and thus our upload and simulation ranges) tight.
+			chunk->used = 0;
+			chunk->free_count = 0;
+			chunk->dirty_begin = UINT32_MAX; // Nothing left worth uploading.
+			chunk->dirty_end = 0;
+			chunk->death_pending_begin = UINT32_MAX;
+			chunk->death_pending_end = 0;
+			particle_chunk_clear_bounds(chunk);
+		} else {
+			chunk->free_slots[chunk->free_count++] = index;
+		}
+	}
+	
+	void particle_mark_changed(ParticleChunk* chunk, uint32_t index) {
+		SPARKLES_ASSERT(index < chunk->used);
+		if (index < chunk->dirty_begin) chunk->dirty_begin = index;
+		if (index + 1 > chunk->dirty_end) chunk->dirty_end = index + 1;
+	}
+	
+	void particle_system_clear(ParticleSystem* system) {
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			for (uint32_t i = 0; i < chunk->used; i += 1) {
+				chunk->particles[i].life = -1;
+				chunk->particles[i].scale = 0;
+			}
+			particle_chunk_reset(system, chunk);
+		}
+	}
+	
+	void particle_system_reserve(ParticleSystem* system, uint32_t particle_count) {
+		while (particle_system_capacity(system) < particle_count) {
+			particle_system_add_chunk(system);
+		}
+	}
+	
+	void particle_system_trim(ParticleSystem* system, uint32_t particle_count_to_keep) {
+		// We walk backwards, because spawning fills the first chunks first.
+		for (int32_t c = (int32_t) system->chunk_count - 1; c >= 0; c -= 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			if (chunk->alive > 0) continue;
+			if (particle_system_capacity(system) - system->chunk_capacity < particle_count_to_keep) break;
+			
+			particle_chunk_destroy(system, chunk);
+			
+			for (uint32_t i = c; i < system->chunk_count - 1; i += 1) system->chunks[i] = system->chunks[i + 1];
+			system->chunk_count -= 1;
+		}
+	}
+	
+	void particle_system_fit(ParticleSystem* system, uint32_t particle_count) {
+		// An estimate that oscillates around a chunk boundary would otherwise keep allocating and releasing the same chunk.
+		uint32_t capacity = particle_system_capacity(system);
+		if (capacity < particle_count) {
+			particle_system_reserve(system, particle_count);
+		} else if (capacity > 2 * particle_count + system->chunk_capacity) {
+			particle_system_trim(system, particle_count);
+		}
+	}
+	
+	uint32_t particle_system_capacity(ParticleSystem* system) {
+		return system->chunk_count * system->chunk_capacity;
+	}
+	
+	uint32_t particle_system_alive_count(ParticleSystem* system) {
+		uint32_t result = 0;
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) result += system->chunks[c]->alive;
+		return result;
+	}
+	
+	int32_t particle_system_find_attribute(ParticleSystem* system, const char* name) {
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			if (strcmp(system->attributes[a].name, name) == 0) return a;
+		}
+		return -1;
+	}
+	
+	ParticleChunk* particle_system_find_chunk(ParticleSystem* system, Particle* particle, uint32_t* particle_index) {
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			if (particle < chunk->particles || particle >= chunk->particles + system->chunk_capacity) continue;
+			
+			*particle_index = (uint32_t) (particle - chunk->particles);
+			return chunk;
+		}
+		return nullptr;
+	}
+	
+	uint32_t particle_attribute_size(const ParticleAttribute* attribute) {
+		switch (attribute->type) {
+		  case AttributeType::FLOAT:  return attribute->components * 4;
+		  case AttributeType::HALF:   return attribute->components * 2;
+		  case AttributeType::UNORM8: return attribute->components * 1;
+		}
+		SPARKLES_ASSERT(false, "Unknown attribute type.");
+		return 0;
+	}
+	
+	void* particle_chunk_attribute(ParticleSystem* system, ParticleChunk* chunk, uint32_t attribute_index, uint32_t particle_index) {
+		SPARKLES_ASSERT(attribute_index < system->attribute_count);
+		return &chunk->attributes[attribute_index][particle_index * particle_attribute_size(&system->attributes[attribute_index])];
+	}
+	
+	static uint16_t float_to_half(float value) {
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		
+		uint32_t sign = (bits >> 16) & 0x8000;
+		uint32_t float_exponent = (bits >> 23) & 0xff;
+		int32_t exponent = (int32_t) float_exponent - 127 + 15;
+		uint32_t mantissa = bits & 0x7fffff;
+		
+		if (float_exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0); // Infinity or NaN.
+		if (exponent >= 31) return sign | 0x7c00; // Too big: infinity.
+		if (exponent <= 0) {
+			if (exponent < -10) return sign; // Too small, even for a denormal.
+			mantissa |= 0x800000;
+			uint32_t shift = 14 - exponent;
+			return sign | ((mantissa + (1 << (shift - 1))) >> shift);
+		}
+		
+		uint32_t result = sign | (exponent << 10) | (mantissa >> 13);
+		return result + ((mantissa >> 12) & 1); // Round to nearest. A carry correctly bumps the exponent.
+	}
+	
+	static float half_to_float(uint16_t value) {
+		uint32_t sign = (uint32_t) (value & 0x8000) << 16;
+		uint32_t exponent = (value >> 10) & 0x1f;
+		uint32_t mantissa = value & 0x3ff;
+		
+		uint32_t bits;
+		if (exponent == 0x1f) {
+			bits = sign | 0x7f800000 | (mantissa << 13); // Infinity or NaN.
+		} else if (exponent == 0) {
+			if (!mantissa) {
+				bits = sign;
+			} else {
+				// A denormal, which is a normal float.
+				exponent = 127 - 15 + 1;
+				while (!(mantissa & 0x400)) {
+					mantissa <<= 1;
+					exponent -= 1;
+				}
+				bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+			}
+		} else {
+			bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+		}
+		
+		float result;
+		memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+	
+	void particle_chunk_set_attribute(ParticleSystem* system, ParticleChunk* chunk, uint32_t attribute_index, uint32_t particle_index, const float values[]) {
+		void* destination = particle_chunk_attribute(system, chunk, attribute_index, particle_index);
+		ParticleAttribute* attribute = &system->attributes[attribute_index];
+		
+		switch (attribute->type) {
+		  case AttributeType::FLOAT:
+			memcpy(destination, values, attribute->components * sizeof(float));
+			break;
+		  case AttributeType::HALF:
+			for (uint32_t k = 0; k < attribute->components; k += 1) ((uint16_t*) destination)[k] = float_to_half(values[k]);
+			break;
+		  case AttributeType::UNORM8:
+			for (uint32_t k = 0; k < attribute->components; k += 1) {
+				float value = values[k] < 0 ? 0 : (values[k] > 1 ? 1 : values[k]);
+				((uint8_t*) destination)[k] = (uint8_t) (value * 255 + 0.5f);
+			}
+			break;
+		}
+	}
+	
+	void particle_chunk_get_attribute(ParticleSystem* system, ParticleChunk* chunk, uint32_t attribute_index, uint32_t particle_index, float values[]) {
+		void* source = particle_chunk_attribute(system, chunk, attribute_index, particle_index);
+		ParticleAttribute* attribute = &system->attributes[attribute_index];
+		
+		switch (attribute->type) {
+		  case AttributeType::FLOAT:
+			memcpy(values, source, attribute->components * sizeof(float));
+			break;
+		  case AttributeType::HALF:
+			for (uint32_t k = 0; k < attribute->components; k += 1) values[k] = half_to_float(((uint16_t*) source)[k]);
+			break;
+		  case AttributeType::UNORM8:
+			for (uint32_t k = 0; k < attribute->components; k += 1) values[k] = ((uint8_t*) source)[k] / 255.0f;
+			break;
+		}
+	}
+	
+	// Grows the bounds of a CPU chunk by the live particles in [begin, end), which have spawned since its bounds were last stored.
+	static void particle_chunk_grow_bounds(ParticleChunk* chunk, uint32_t begin, uint32_t end, vec2* min, vec2* max) {
+		ParticleBounds bounds = particle_bounds_empty();
+		for (uint32_t i = begin; i < end; i += 1) {
+			Particle* p = &chunk->particles[i];
+			if (p->life >= 0) particle_bounds_add(&bounds, p->position.xy);
+		}
+		
+		vec2 new_min, new_max;
+		particle_bounds_get(&bounds, &new_min, &new_max);
+		*min = {fmin(min->x, new_min.x), fmin(min->y, new_min.y)};
+		*max = {fmax(max->x, new_max.x), fmax(max->y, new_max.y)};
+	}
+	
+	// Same for BALLISTIC and GPU chunks, whose particles go to a spawn window.
+	static void particle_chunk_grow_spawn_window(ParticleChunk* chunk, uint32_t begin, uint32_t end, ParticleSpawnWindow* window) {
+		ParticleBounds bounds = particle_bounds_empty();
+		float speed2 = window->max_speed * window->max_speed;
+		float life = window->max_life;
+		float death_time = window->death_time;
+		
+		for (uint32_t i = begin; i < end; i += 1) {
+			Particle* p = &chunk->particles[i];
+			if (p->life < 0) continue;
+			
+			particle_bounds_add(&bounds, p->position.xy);
+			speed2 = fmax(speed2, norm2(p->velocity.xy));
+			life = fmax(life, p->life);
+			death_time = fmax(death_time, chunk->birth_times[i] + p->life);
+		}
+		
+		vec2 new_min, new_max;
+		particle_bounds_get(&bounds, &new_min, &new_max);
+		window->min = {fmin(window->min.x, new_min.x), fmin(window->min.y, new_min.y)};
+		window->max = {fmax(window->max.x, new_max.x), fmax(window->max.y, new_max.y)};
+		window->max_speed = sqrt(speed2);
+		window->max_life = life;
+		window->death_time = death_time;
+	}
+	
+	// Takes the death times of the particles spawned since the last call into latest_death_time.
+	static void particle_chunk_update_latest_death_time(ParticleChunk* chunk) {
+		for (uint32_t i = chunk->death_pending_begin; i < chunk->death_pending_end; i += 1) {
+			float death_time = chunk->birth_times[i] + chunk->particles[i].life;
+			if (chunk->particles[i].life >= 0 && death_time > chunk->latest_death_time) chunk->latest_death_time = death_time;
+		}
+		
+		chunk->death_pending_begin = UINT32_MAX;
+		chunk->death_pending_end = 0;
+	}
+	
+	bool particle_chunk_take_dirty_range(ParticleSystem* system, ParticleChunk* chunk, uint32_t* begin, uint32_t* end) {
+		if (chunk->dirty_begin >= chunk->dirty_end) return false;
+		
+		*begin = chunk->dirty_begin;
+		*end = chunk->dirty_end;
+		
+		// GPU slot spawns only wait in the chunk until this upload, and the next ones take their place.
+		if (system->simulation != ParticleSimulation::CPU) particle_chunk_update_latest_death_time(chunk);
+		
+		// Particles get their position after particle_system_spawn returns, so this is the first moment we can see where they are.
+		// (Slots in this range that were not spawned again are either dead, or already in the bounds.)
+		if (system->simulation == ParticleSimulation::CPU) particle_chunk_grow_bounds(chunk, *begin, *end, &chunk->bounds_min, &chunk->bounds_max);
+		else particle_chunk_grow_spawn_window(chunk, *begin, *end, &chunk->spawn_windows[0]);
+		
+		chunk->dirty_begin = UINT32_MAX;
+		chunk->dirty_end = 0;
+		return true;
+	}
+	
+	void particle_ballistic_evaluate(ParticleSystem* system, Particle* particle, float birth_time, vec3* position, vec3* velocity) {
+		// This must match glsl_ballistic_instancing_vertex_shader_source in the backend.
+		vec2 gravity = system->ballistic.gravity;
+		float drag = system->ballistic.drag;
+		float age = system->time - birth_time;
+		
+		vec2 p0 = particle->position.xy;
+		vec2 v0 = particle->velocity.xy;
+		
+		*position = particle->position;
+		*velocity = particle->velocity;
+		
+		if (drag > 0) {
+			// dv/dt = gravity - drag * v, so v approaches the terminal velocity exponentially.
+			float decay = exp(-drag * age);
+			vec2 terminal_velocity = gravity / drag;
+			position->xy = p0 + terminal_velocity * age + (v0 - terminal_velocity) * ((1 - decay) / drag);
+			velocity->xy = terminal_velocity + (v0 - terminal_velocity) * decay;
+		} else {
+			position->xy = p0 + v0 * age + gravity * (0.5f * age * age);
+			velocity->xy = v0 + gravity * age;
+		}
+	}
+	
+	// Bakes the current point of each trajectory into the particles, so that the CPU can carry on from there.
+	static void particle_chunk_bake_ballistic(ParticleSystem* system, ParticleChunk* chunk) {
+		ParticleBounds bounds = particle_bounds_empty();
+		for (uint32_t i = 0; i < chunk->used; i += 1) {
+			Particle* p = &chunk->particles[i];
+			if (p->life < 0) continue;
+			
+			float remaining_life = p->life - (system->time - chunk->birth_times[i]);
+			if (remaining_life < 0) {
+				particle_kill(chunk, i);
+				continue;
+			}
+			
+			particle_ballistic_evaluate(system, p, chunk->birth_times[i], &p->position, &p->velocity);
+			p->life = remaining_life;
+			p->color.w = fmin(p->color.w, remaining_life); // Same fade the shader applies.
+			particle_bounds_add(&bounds, p->position.xy);
+		}
+		particle_chunk_store_bounds(chunk, &bounds);
+	}
+	
+	// Every live particle starts over from where it is now, as if it had just spawned, so that the GPU gets all of them again.
+	// They are all in the dirty range, so their new bounds are gathered with the next upload.
+	// With 'gpu_slots', they line up at the front of the chunk first, which is where spawns wait for the GPU to pick their slots.
+	static void particle_chunk_restart(ParticleSystem* system, ParticleChunk* chunk, bool gpu_slots) {
+		if (gpu_slots) {
+			uint32_t count = 0;
+			for (uint32_t i = 0; i < chunk->used; i += 1) {
+				if (chunk->particles[i].life < 0) continue;
+				
+				if (i != count) {
+					chunk->particles[count] = chunk->particles[i];
+					chunk->birth_times[count] = chunk->birth_times[i];
+					for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+						uint32_t size = particle_attribute_size(&system->attributes[a]);
+						memcpy(&chunk->attributes[a][count * size], &chunk->attributes[a][i * size], size);
+					}
+					chunk->particles[i].life = -1;
+				}
+				count += 1;
+			}
+			
+			chunk->used = count;
+			chunk->alive = count;
+			chunk->free_count = 0;
+			backend_particle_chunk_reset(system, chunk); // Whatever the GPU had in the chunk is gone.
+		}
+		
+		particle_chunk_clear_bounds(chunk);
+		chunk->latest_death_time = system->time;
+		for (uint32_t i = 0; i < chunk->used; i += 1) {
+			Particle* p = &chunk->particles[i];
+			if (p->life < 0) continue;
+			
+			chunk->birth_times[i] = system->time;
+			if (system->time + p->life > chunk->latest_death_time) chunk->latest_death_time = system->time + p->life;
+		}
+		
+		chunk->dirty_begin = 0;
+		chunk->dirty_end = chunk->used;
+		chunk->death_pending_begin = UINT32_MAX;
+		chunk->death_pending_end = 0;
+	}
+	
+	void particle_system_set_simulation(ParticleSystem* system, ParticleSimulation simulation) {
+		if (system->simulation == simulation) return;
+		
+		// Whatever the switch, we go through the CPU mode, where the particles hold their current state.
+		if (system->simulation == ParticleSimulation::GPU) {
+			backend_particle_system_download(system);
+		} else if (system->simulation == ParticleSimulation::BALLISTIC) {
+			for (uint32_t c = 0; c < system->chunk_count; c += 1) particle_chunk_bake_ballistic(system, system->chunks[c]);
+		}
+		
+		if (simulation != ParticleSimulation::CPU) {
+			bool gpu_slots = simulation == ParticleSimulation::GPU && backend_particle_gpu_slots_supported();
+			for (uint32_t c = 0; c < system->chunk_count; c += 1) particle_chunk_restart(system, system->chunks[c], gpu_slots);
+		}
+		
+		system->simulation = simulation;
+	}
+	
+	static void particle_system_reclaim_by_death_time(ParticleSystem* system) {
+		// BALLISTIC and GPU particles are never touched on the CPU after they spawn, so we reclaim their slots lazily:
+		// a chunk whose particles are all past their death time is reset at once, and we only sweep BALLISTIC chunks that have run out of room.
+		// GPU systems free single slots on the GPU, when they have compute shaders (see particle_system_spawn). Resetting their chunks still keeps 'used' tight.
+		bool sweep = system->simulation == ParticleSimulation::BALLISTIC;
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			if (chunk->alive == 0) {
+				if (chunk->used) particle_chunk_reset(system, chunk); // The GPU counted them all dead.
+				continue;
+			}
+			
+			// Particles spawned since the last step have their life by now.
+			particle_chunk_update_latest_death_time(chunk);
+			if (system->time >= chunk->latest_death_time) {
+				particle_chunk_reset(system, chunk);
+				continue;
+			}
+			
+			// Once the particles of the previous spawn window are gone, the bounds forget where they were.
+			if (system->time >= chunk->spawn_windows[1].death_time) {
+				chunk->spawn_windows[1] = chunk->spawn_windows[0];
+				particle_spawn_window_clear(&chunk->spawn_windows[0]);
+			}
+			
+			if (sweep && chunk->used == system->chunk_capacity && chunk->free_count == 0) {
+				for (uint32_t i = 0; i < chunk->used && chunk->alive > 0; i += 1) {
+					Particle* p = &chunk->particles[i];
+					if (p->life >= 0 && chunk->birth_times[i] + p->life <= system->time) particle_kill(chunk, i);
+				}
+			}
+		}
+	}
+	
+	bool particle_system_bounds(ParticleSystem* system, Rect* bounds) {
+		bool ballistic = system->simulation == ParticleSimulation::BALLISTIC;
+		bool gpu = system->simulation == ParticleSimulation::GPU;
+		
+		// GPU particles can be pushed around by attractors, but by no more than all of them (and gravity) at once.
+		float max_acceleration = 0;
+		if (gpu) {
+			max_acceleration = norm(system->gpu.gravity);
+			for (uint32_t a = 0; a < system->gpu.attractor_count; a += 1) max_acceleration += fabs(system->gpu.attractors[a].max_force);
+		}
+		
+		vec2 min = {+INFINITY, +INFINITY};
+		vec2 max = {-INFINITY, -INFINITY};
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			if (chunk->alive == 0) continue;
+			
+			// Particles spawned since the last upload are not in the chunk's bounds yet.
+			bool has_pending_spawns = chunk->dirty_begin < chunk->dirty_end;
+			
+			if (!ballistic && !gpu) {
+				vec2 chunk_min = chunk->bounds_min;
+				vec2 chunk_max = chunk->bounds_max;
+				if (has_pending_spawns) particle_chunk_grow_bounds(chunk, chunk->dirty_begin, chunk->dirty_end, &chunk_min, &chunk_max);
+				if (chunk_min.x > chunk_max.x) continue;
+				
+				min = {fmin(min.x, chunk_min.x), fmin(min.y, chunk_min.y)};
+				max = {fmax(max.x, chunk_max.x), fmax(max.y, chunk_max.y)};
+				continue;
+			}
+			
+			for (uint32_t w = 0; w < 2; w += 1) {
+				ParticleSpawnWindow window = chunk->spawn_windows[w];
+				if (w == 0 && has_pending_spawns) particle_chunk_grow_spawn_window(chunk, chunk->dirty_begin, chunk->dirty_end, &window);
+				if (window.min.x > window.max.x || system->time >= window.death_time) continue;
+				
+				vec2 window_min = window.min;
+				vec2 window_max = window.max;
+				float max_speed = window.max_speed;
+				float max_life = window.max_life;
+				if (ballistic) {
+					// No particle has moved further than its top speed allows over its life, plus the fall due to gravity, which drag can only make shorter.
+					vec2 reach = {max_speed * max_life, max_speed * max_life};
+					vec2 fall = system->ballistic.gravity * (0.5f * max_life * max_life);
+					window_min = window_min - reach + vec2{fmin(fall.x, 0.0f), fmin(fall.y, 0.0f)};
+					window_max = window_max + reach + vec2{fmax(fall.x, 0.0f), fmax(fall.y, 0.0f)};
+				} else {
+					// Drag only ever slows particles down.
+					float distance = max_speed * max_life + 0.5f * max_acceleration * max_life * max_life;
+					window_min = window_min - vec2{distance, distance};
+					window_max = window_max + vec2{distance, distance};
+				}
+				
+				min = {fmin(min.x, window_min.x), fmin(min.y, window_min.y)};
+				max = {fmax(max.x, window_max.x), fmax(max.y, window_max.y)};
+			}
+		}
+		
+		if (min.x > max.x) return false;
+		
+		*bounds = {min.x, min.y, max.x - min.x, max.y - min.y};
+		return true;
+	}
+	
+	void particle_system_set_trail_length(ParticleSystem* system, uint32_t length) {
+		SPARKLES_ASSERT(length <= particle_max_trail_length, "Trail too long.");
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			if (chunk->trail_positions) particle_chunk_free_trails(chunk);
+		}
+		
+		system->trail_length = length;
+		system->trail_head = 0;
+		if (!length) return;
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) particle_chunk_allocate_trails(system, system->chunks[c]);
+	}
+	
+	void particle_system_push_trails(ParticleSystem* system) {
+		if (!system->trail_length) return;
+		SPARKLES_ASSERT(system->simulation == ParticleSimulation::CPU, "Trails need CPU positions.");
+		
+		uint32_t length = system->trail_length;
+		system->trail_head = (system->trail_head + 1) % length;
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			if (chunk->used == 0) continue;
+			
+			// Dead slots get written too: it's cheaper than skipping them, and they are reset when handed out again.
+			vec2* row = &chunk->trail_positions[system->trail_head * system->chunk_capacity];
+			uint8_t* counts = chunk->trail_counts;
+			for (uint32_t i = 0; i < chunk->used; i += 1) {
+				row[i] = chunk->particles[i].position.xy;
+				counts[i] += (uint8_t) (counts[i] < length);
+			}
+			
+			if (chunk->trail_dirty_rows < length) chunk->trail_dirty_rows += 1;
+		}
+	}
+	
+	//
+	// Spatial reordering.
+	// Each chunk is sorted on its own, in a job. A chunk fits in cache, so a plain LSD radix sort over (key, slot) pairs is fast enough,
+	// and then every column of the chunk is gathered through the sorted slots.
+	//
+	
+	static constexpr uint32_t morton_radix_bits = 8;
+	static constexpr uint32_t morton_radix_size = 1 << morton_radix_bits;
+	
+	// Spreads the low 16 bits of 'x' over the even bits.
+	static uint32_t morton_spread_bits(uint32_t x) {
+		x &= 0xffff;
+		x = (x | (x << 8)) & 0x00ff00ff;
+		x = (x | (x << 4)) & 0x0f0f0f0f;
+		x = (x | (x << 2)) & 0x33333333;
+		x = (x | (x << 1)) & 0x55555555;
+		return x;
+	}
+	
+	template <typename T>
+	static void permute_column(T* column, uint32_t* order, uint32_t count, uint32_t components, void* scratch) {
+		T* gathered = (T*) scratch;
+		for (uint32_t i = 0; i < count; i += 1) {
+			for (uint32_t k = 0; k < components; k += 1) gathered[i * components + k] = column[order[i] * components + k];
+		}
+		memcpy(column, gathered, count * components * sizeof(T));
+	}
+	
+	// Scratch memory for one chunk's sort: keys and slots (twice each, for the radix passes), positions, and the gathered column.
+	static size_t particle_reorder_scratch_size(ParticleSystem* system) {
+		size_t size = system->chunk_capacity * (4 * sizeof(uint32_t) + sizeof(vec2));
+		size = (size + particle_chunk_alignment - 1) & ~(size_t) (particle_chunk_alignment - 1);
+		return size + system->chunk_capacity * sizeof(Particle);
+	}
+	
+	static void particle_chunk_reorder(ParticleSystem* system, ParticleChunk* chunk, uint8_t* memory) {
+		uint32_t count = chunk->alive;
+		if (count == 0) return;
+		
+		uint32_t capacity = system->chunk_capacity;
+		uint32_t* keys[2]  = {(uint32_t*) memory, (uint32_t*) memory + capacity};
+		uint32_t* slots[2] = {(uint32_t*) memory + 2 * capacity, (uint32_t*) memory + 3 * capacity};
+		vec2* positions = (vec2*) ((uint32_t*) memory + 4 * capacity);
+		
+		// Where the live particles are.
+		vec2 min = {+INFINITY, +INFINITY};
+		vec2 max = {-INFINITY, -INFINITY};
+		uint32_t live = 0;
+		for (uint32_t i = 0; i < chunk->used; i += 1) {
+			Particle* p = &chunk->particles[i];
+			if (p->life < 0) continue;
+			
+			vec2 position = p->position.xy;
+			positions[live] = position;
+			slots[0][live] = i;
+			live += 1;
+			
+			min = {fmin(min.x, position.x), fmin(min.y, position.y)};
+			max = {fmax(max.x, position.x), fmax(max.y, position.y)};
+		}
+		SPARKLES_ASSERT(live == count);
+		
+		// 16 bits per axis, over the bounds of the chunk's own particles.
+		vec2 extent = max - min;
+		vec2 scale = {extent.x > 0 ? 65535 / extent.x : 0, extent.y > 0 ? 65535 / extent.y : 0};
+		for (uint32_t i = 0; i < count; i += 1) {
+			uint32_t x = (uint32_t) ((positions[i].x - min.x) * scale.x);
+			uint32_t y = (uint32_t) ((positions[i].y - min.y) * scale.y);
+			keys[0][i] = morton_spread_bits(x) | (morton_spread_bits(y) << 1);
+		}
+		
+		// LSD radix sort, 8 bits at a time. It's stable, so slots with the same key keep their order.
+		uint32_t from = 0;
+		for (uint32_t shift = 0; shift < 32; shift += morton_radix_bits) {
+			uint32_t histogram[morton_radix_size] = {};
+			for (uint32_t i = 0; i < count; i += 1) histogram[(keys[from][i] >> shift) & (morton_radix_size - 1)] += 1;
+			
+			// Particles that are close together often share their high bits, in which case the pass would not change anything.
+			if (histogram[(keys[from][0] >> shift) & (morton_radix_size - 1)] == count) continue;
+			
+			uint32_t offset = 0;
+			for (uint32_t d = 0; d < morton_radix_size; d += 1) {
+				uint32_t size = histogram[d];
+				histogram[d] = offset;
+				offset += size;
+			}
+			
+			uint32_t to = 1 - from;
+			for (uint32_t i = 0; i < count; i += 1) {
+				uint32_t destination = histogram[(keys[from][i] >> shift) & (morton_radix_size - 1)]++;
+				keys[to][destination] = keys[from][i];
+				slots[to][destination] = slots[from][i];
+			}
+			from = to;
+		}
+		uint32_t* order = slots[from];
+		
+		// Gather every column through the sorted slots. Particles are the widest column, so their scratch fits any other.
+		void* scratch = memory + particle_reorder_scratch_size(system) - capacity * sizeof(Particle);
+		
+		permute_column(chunk->particles, order, count, 1, scratch);
+		permute_column(chunk->birth_times, order, count, 1, scratch);
+		for (uint32_t a = 0; a < system->attribute_count; a += 1) {
+			permute_column(chunk->attributes[a], order, count, particle_attribute_size(&system->attributes[a]), scratch);
+		}
+		if (chunk->trail_positions) {
+			for (uint32_t row = 0; row < system->trail_length; row += 1) {
+				permute_column(&chunk->trail_positions[row * system->chunk_capacity], order, count, 1, scratch);
+			}
+			permute_column(chunk->trail_counts, order, count, 1, scratch);
+			chunk->trail_dirty_rows = system->trail_length;
+		}
+		
+		// The live particles are now packed in [0, count), so the rest of the used slots are dead.
+		for (uint32_t i = count; i < chunk->used; i += 1) {
+			chunk->particles[i].life = -1;
+			chunk->particles[i].scale = 0;
+		}
+		chunk->used = count;
+		chunk->free_count = 0;
+		
+		// Every slot changed, so it all needs uploading again.
+		chunk->dirty_begin = 0;
+		chunk->dirty_end = count;
+	}
+	
+	struct ParticleReorderJob {
+		ParticleSystem* system;
+		uint32_t first_chunk;
+	};
+	
+	static void particle_reorder_job(void* data, uint32_t index) {
+		auto job = (ParticleReorderJob*) data;
+		ParticleSystem* system = job->system;
+		uint8_t* memory = (uint8_t*) system->reorder_scratch + index * particle_reorder_scratch_size(system);
+		particle_chunk_reorder(system, system->chunks[(job->first_chunk + index) % system->chunk_count], memory);
+	}
+	
+	void particle_system_reorder_step(ParticleSystem* system, uint32_t chunk_count) {
+		if (system->chunk_count == 0) return;
+		
+		// Only the GPU knows where GPU particles are. BALLISTIC chunks upload their particles once, at spawn, so moving them would mean uploading the whole chunk again.
+		if (system->simulation != ParticleSimulation::CPU) return;
+		if (chunk_count > system->chunk_count) chunk_count = system->chunk_count;
+		
+		// Kept from one step to the next, one slice per chunk we sort in parallel.
+		if (chunk_count > system->reorder_scratch_chunks) {
+			memory_free_aligned(system->reorder_scratch);
+			system->reorder_scratch = memory_allocate_aligned(chunk_count * particle_reorder_scratch_size(system), particle_chunk_alignment);
+			SPARKLES_ASSERT(system->reorder_scratch, "Out of memory for the reorder scratch.");
+			system->reorder_scratch_chunks = chunk_count;
+		}
+		
+		// Chunks come and go, so the cursor may be past the end.
+		ParticleReorderJob job = {system, system->reorder_cursor % system->chunk_count};
+		jobs_parallel_for(chunk_count, particle_reorder_job, &job);
+		
+		system->reorder_cursor = (job.first_chunk + chunk_count) % system->chunk_count;
+	}
+	
+	//
+	// Kill volumes.
+	// We test a block of particles at a time: positions are copied into flat arrays, then each volume adds to a kill mask in a branch-free loop that the compiler can vectorize.
+	//
+	
+	static constexpr uint32_t kill_block_size = 256;
+	
+	static void kill_mask_add(KillVolume* volume, float* xs, float* ys, uint8_t* kill, uint32_t count) {
+		vec2 min = volume->min;
+		vec2 max = volume->max;
+		vec2 normal = volume->normal;
+		float distance = volume->distance;
+		
+		switch (volume->type) {
+		  case KillVolumeType::OUTSIDE_BOX:
+			SPARKLES_LOOP_INDEPENDENT
+			for (uint32_t i = 0; i < count; i += 1) kill[i] |= (uint8_t) ((xs[i] < min.x) | (xs[i] > max.x) | (ys[i] < min.y) | (ys[i] > max.y));
+			break;
+			
+		  case KillVolumeType::INSIDE_BOX:
+			SPARKLES_LOOP_INDEPENDENT
+			for (uint32_t i = 0; i < count; i += 1) kill[i] |= (uint8_t) ((xs[i] >= min.x) & (xs[i] <= max.x) & (ys[i] >= min.y) & (ys[i] <= max.y));
+			break;
+			
+		  case KillVolumeType::HALF_PLANE:
+			SPARKLES_LOOP_INDEPENDENT
+			for (uint32_t i = 0; i < count; i += 1) kill[i] |= (uint8_t) (xs[i] * normal.x + ys[i] * normal.y > distance);
+			break;
+		}
+	}
+	
+	uint32_t particle_chunk_kill_in_volumes(ParticleSystem* system, ParticleChunk* chunk, KillVolume* volumes, uint32_t volume_count) {
+		if (volume_count == 0) return 0;
+		if (system->simulation == ParticleSimulation::GPU) return 0; // Their CPU positions are where they spawned.
+		
+		bool ballistic = system->simulation == ParticleSimulation::BALLISTIC;
+		uint32_t killed = 0;
+		
+		float xs[kill_block_size];
+		float ys[kill_block_size];
+		uint8_t kill[kill_block_size];
+		
+		for (uint32_t begin = 0; begin < chunk->used && chunk->alive > 0; begin += kill_block_size) {
+			uint32_t count = chunk->used - begin < kill_block_size ? chunk->used - begin : kill_block_size;
+			Particle* particles = &chunk->particles[begin];
+			
+			if (ballistic) {
+				for (uint32_t i = 0; i < count; i += 1) {
+					vec3 position, velocity;
+					particle_ballistic_evaluate(system, &particles[i], chunk->birth_times[begin + i], &position, &velocity);
+					xs[i] = position.x;
+					ys[i] = position.y;
+				}
+			} else {
+				for (uint32_t i = 0; i < count; i += 1) {
+					xs[i] = particles[i].position.x;
+					ys[i] = particles[i].position.y;
+				}
+			}
+			
+			memset(kill, 0, count);
+			for (uint32_t v = 0; v < volume_count; v += 1) kill_mask_add(&volumes[v], xs, ys, kill, count);
+			
+			for (uint32_t i = 0; i < count; i += 1) {
+				if (!kill[i] || particles[i].life < 0) continue;
+				
+				uint32_t index = begin + i;
+				particle_kill(chunk, index);
+				killed += 1;
+				if (chunk->alive == 0) break; // The chunk was reset, and every other slot is already dead.
+				
+				if (ballistic) {
+					// The GPU only hears about BALLISTIC particles through uploads. Uploading the killed slot makes it disappear there too.
+					if (index < chunk->dirty_begin) chunk->dirty_begin = index;
+					if (index + 1 > chunk->dirty_end) chunk->dirty_end = index + 1;
+				}
+			}
+		}
+		
+		return killed;
+	}
+	
+	struct KillVolumesJob {
+		ParticleSystem* system;
+		KillVolume* volumes;
+		uint32_t volume_count;
+		std::atomic<uint32_t> killed;
+	};
+	
+	static void kill_in_volumes_job(void* data, uint32_t chunk_index) {
+		auto job = (KillVolumesJob*) data;
+		uint32_t killed = particle_chunk_kill_in_volumes(job->system, job->system->chunks[chunk_index], job->volumes, job->volume_count);
+		if (killed) job->killed += killed;
+	}
+	
+	uint32_t particle_system_kill_in_volumes(ParticleSystem* system, KillVolume* volumes, uint32_t volume_count) {
+		if (volume_count == 0) return 0;
+		
+		KillVolumesJob job;
+		job.system = system;
+		job.volumes = volumes;
+		job.volume_count = volume_count;
+		job.killed = 0;
+		
+		jobs_parallel_for(system->chunk_count, kill_in_volumes_job, &job);
+		return job.killed;
+	}
+	
+	// Past this, we pull the system time back to 0. A float of 1024 seconds still has a precision of about 0.1 ms.
+	static constexpr float particle_time_rebase_threshold = 1024;
+	
+	// The BALLISTIC vertex shader subtracts birth times from the system time, which loses precision as it grows, so particles would stutter after a few hours.
+	// Moving the time and everything measured against it by the same amount keeps every age as it is.
+	static void particle_system_rebase_time(ParticleSystem* system) {
+		float base = system->time;
+		system->time = 0;
+		
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) {
+			ParticleChunk* chunk = system->chunks[c];
+			chunk->latest_death_time -= base;
+			chunk->spawn_windows[0].death_time -= base;
+			chunk->spawn_windows[1].death_time -= base;
+			for (uint32_t i = 0; i < chunk->used; i += 1) chunk->birth_times[i] -= base;
+			
+			// BALLISTIC birth times are on the GPU too, so we upload the chunk again. (GPU systems don't read theirs there.)
+			if (system->simulation == ParticleSimulation::BALLISTIC && chunk->used) {
+				chunk->dirty_begin = 0;
+				chunk->dirty_end = chunk->used;
+			}
+		}
+	}
+	
+	void particle_system_advance(ParticleSystem* system, float dt) {
+		system->time += dt;
+		if (system->time >= particle_time_rebase_threshold) particle_system_rebase_time(system);
+		
+		if (system->simulation != ParticleSimulation::CPU) {
+			particle_system_reclaim_by_death_time(system);
+		}
+		
+		// After reclaiming, so that requested particles can reuse the slots of dead ones.
+		particle_system_process_spawn_requests(system);
+		
+		// Requested particles are simulated within this step, like they would be by your own loop in CPU mode.
+		if (system->simulation == ParticleSimulation::GPU) {
+			backend_particle_system_simulate(system, dt);
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+// Declarations shared between our implementation files, which are not part of the public API.
+
+#include "sparkles.h"
+
+#include <stddef.h> // For size_t
+#include <math.h> // For INFINITY
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#include <xmmintrin.h>
+#define SPARKLES_SSE 1
+#else
+#define SPARKLES_SSE 0
+#endif
+
+// Tells the compiler that iterations of the next loop are independent, so that it can vectorize it.
+#ifndef SPARKLES_LOOP_INDEPENDENT
+#if defined(_MSC_VER)
+#define SPARKLES_LOOP_INDEPENDENT __pragma(loop(ivdep))
+#elif defined(__clang__)
+#define SPARKLES_LOOP_INDEPENDENT _Pragma("clang loop vectorize(enable)")
+#elif defined(__GNUC__)
+#define SPARKLES_LOOP_INDEPENDENT _Pragma("GCC ivdep")
+#else
+#define SPARKLES_LOOP_INDEPENDENT
+#endif
+#endif
+
+namespace Sparkles {
+	
+	//
+	// Memory
+	//
+	void* memory_allocate_aligned(size_t size, size_t alignment);
+	void  memory_free_aligned(void* memory);
+	
+	//
+	// Bounds of particle positions, for our own loops over particles. Both coordinates go in one min and one max where we have SSE.
+	// (sparkles_for_each.h has a plain version for your loops.)
+	//
+	struct ParticleBounds {
+#if SPARKLES_SSE
+		__m128 min; // Only the (x, y) lanes are used.
+		__m128 max;
+#else
+		vec2 min;
+		vec2 max;
+#endif
+	};
+	
+	inline ParticleBounds particle_bounds_empty() {
+		ParticleBounds result;
+#if SPARKLES_SSE
+		result.min = _mm_set1_ps(+INFINITY);
+		result.max = _mm_set1_ps(-INFINITY);
+#else
+		result.min = {+INFINITY, +INFINITY};
+		result.max = {-INFINITY, -INFINITY};
+#endif
+		return result;
+	}
+	
+	inline void particle_bounds_add(ParticleBounds* bounds, vec2 position) {
+#if SPARKLES_SSE
+		__m128 p = _mm_loadl_pi(_mm_setzero_ps(), (const __m64*) &position);
+		bounds->min = _mm_min_ps(bounds->min, p);
+		bounds->max = _mm_max_ps(bounds->max, p);
+#else
+		bounds->min = {fmin(bounds->min.x, position.x), fmin(bounds->min.y, position.y)};
+		bounds->max = {fmax(bounds->max.x, position.x), fmax(bounds->max.y, position.y)};
+#endif
+	}
+	
+	inline void particle_bounds_get(ParticleBounds* bounds, vec2* min, vec2* max) {
+#if SPARKLES_SSE
+		_mm_storel_pi((__m64*) min, bounds->min);
+		_mm_storel_pi((__m64*) max, bounds->max);
+#else
+		*min = bounds->min;
+		*max = bounds->max;
+#endif
+	}
+	
+	inline void particle_chunk_store_bounds(ParticleChunk* chunk, ParticleBounds* bounds) {
+		particle_bounds_get(bounds, &chunk->bounds_min, &chunk->bounds_max);
+	}
+	
+	//
+	// Particle storage
+	//
+	
+	uint32_t particle_attribute_size(const ParticleAttribute* attribute); // Bytes per particle.
+	
+	// Called by the backend before uploading a chunk: returns the slots spawned since the last call (if any) and clears them.
+	bool particle_chunk_take_dirty_range(ParticleSystem* system, ParticleChunk* chunk, uint32_t* begin, uint32_t* end);
+	
+	//
+	// Backend hooks
+	// The graphics backend owns the actual ParticleSystem and ParticleChunk structs, so that it can attach its GPU resources to them.
+	// The generic storage code (particles.cpp) fills in everything else.
+	//
+	ParticleSystem* backend_particle_system_allocate();
+	void            backend_particle_system_configure(ParticleSystem* system); // Called once the generic fields (chunk capacity, attributes) are set, before any chunk is allocated.
+	void            backend_particle_system_release(ParticleSystem* system);
+	ParticleChunk*  backend_particle_chunk_allocate(ParticleSystem* system);
+	void            backend_particle_chunk_release(ParticleSystem* system, ParticleChunk* chunk);
+	void            backend_particle_chunk_reset(ParticleSystem* system, ParticleChunk* chunk); // Every slot of the chunk is free again, on the GPU too. The backend catches up when it next uploads the chunk.
+	
+	// ParticleSimulation::GPU
+	bool backend_particle_gpu_slots_supported(); // Whether the GPU hands out the slots of GPU systems, and frees them when their particles die. See ParticleSimulation::GPU.
+	void backend_particle_system_simulate(ParticleSystem* system, float dt); // Uploads what spawned, then runs one simulation step on the GPU.
+	void backend_particle_system_download(ParticleSystem* system); // Brings the particles back into their chunks, kills the ones that died on the GPU, and stores the chunks' bounds.
+}
@@ -229,6 +229,29 @@ namespace Sparkles {
 		p->life = random_get1(spawn->life);
 	}
 	
+	ParticleCountEstimate particle_count_estimate(Range1 emission_interval, Range1 particles_per_emission, Range1 life) {
+		constexpr float min_interval = 0.001f; // Avoid dividing by zero for emitters that fire every frame.
+		
+		float average_interval = fmax(0.5f * (emission_interval.min + emission_interval.max), min_interval);
+		float average_count    = 0.5f * (particles_per_emission.min + particles_per_emission.max);
+		float average_life     = 0.5f * (life.min + life.max);
+		
+		float shortest_interval = fmax(fmin(emission_interval.min, emission_interval.max), min_interval);
+		float largest_count     = fmax(particles_per_emission.min, particles_per_emission.max);
+		float longest_life      = fmax(life.min, life.max);
+		
+		ParticleCountEstimate result;
+		
+		// Little's law: particles alive = spawn rate * time each one stays alive.
+		result.average = (average_count / average_interval) * average_life;
+		
+		// Right after an emission, every emission from the last 'longest_life' seconds can still be alive.
+		float overlapping_emissions = floor(longest_life / shortest_interval) + 1;
+		result.peak = (uint32_t) ceil(overlapping_emissions * largest_count);
+		
+		return result;
+	}
+	
 	float norm2(vec2 v) {
 		return v.x * v.x + v.y * v.y;
 	}
@@ -300,7 +323,20 @@ namespace Sparkles {
 	}
 	
 	float bezier_get_length(CubicBezier curve, float start_t, float end_t, float dt) {
-		return 0;
+		// Sum of the chords of steps of 'dt', with a shorter last step to land on 'end_t'.
+		SPARKLES_ASSERT(dt > 0, "bezier_get_length needs a positive step.");
+		if (dt <= 0) dt = 0.01f; // The default. Otherwise, we would never get to 'end_t'.
+		
+		float length = 0;
+		vec2 previous = bezier_get_position(curve, start_t);
+		for (float t = start_t; t < end_t; ) {
+			t = fmin(t + dt, end_t);
+			vec2 position = bezier_get_position(curve, t);
+			length += norm(position - previous);
+			previous = position;
+		}
+		
+		return length;
 	}
 	
 	mat4 mat4_identity() {
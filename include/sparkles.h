@@ -83,9 +83,184 @@ namespace Sparkles {
 		float life;
 	};
 	
+	//
+	// Custom attributes.
+	// Besides the fields of Particle, a system can store any attributes you declare when you create it, each one in its own array (column) per chunk.
+	// An attribute is stored as 'components' values of its type per particle, on the CPU and on the GPU alike, so uploading it is a plain copy.
+	// If it is GPU-visible, we bind it to the next vertex attribute location, in declaration order, starting at particle_attribute_first_location.
+	// Particles only pay memory and bandwidth for the attributes their system declares.
+	//
+	constexpr uint32_t particle_attribute_first_location = 9; // The first location our own instancing shaders don't use.
+	constexpr uint32_t particle_max_attribute_count = 16 - particle_attribute_first_location; // OpenGL only guarantees 16 vertex attribute locations.
+	
+	enum class AttributeType : uint32_t {
+		FLOAT,  // 4 bytes per component.
+		HALF,   // 2 bytes per component.
+		UNORM8, // 1 byte per component. Values are clamped to [0, 1].
+	};
+	
+	enum class AttributeVisibility : uint32_t {
+		CPU, // Never uploaded.
+		GPU, // Uploaded along with the particles.
+	};
+	
+	struct ParticleAttribute {
+		const char* name; // Not copied.
+		uint32_t components; // 1 to 4.
+		AttributeType type;
+		AttributeVisibility visibility;
+	};
+	
+	//
+	// Particles are stored in fixed-size chunks. A system grows by adding chunks and shrinks by releasing empty ones,
+	// so a particle never moves in memory while it is alive (unless you ask us to reorder them, see particle_system_reorder_step).
+	// A chunk is also our unit of GPU upload and of parallel work.
+	//
+	constexpr uint32_t particle_chunk_min_capacity = 256;
+	constexpr uint32_t particle_chunk_max_capacity = 16384;
+	constexpr uint32_t particle_chunk_alignment = 64; // Cache line size.
+	constexpr uint32_t particle_max_trail_length = 64;
+	
+	// Where the particles of a BALLISTIC or GPU chunk spawned over a window of time, along with their top speed and longest life, to bound where they can have gone.
+	struct ParticleSpawnWindow {
+		vec2 min;
+		vec2 max;
+		float max_speed;
+		float max_life;
+		float death_time; // System time at which the last of them dies.
+	};
+	
+	struct ParticleChunk {
+		uint32_t used;  // Slots [0, used) have been handed out at least once. Slots past 'used' are untouched, so we never upload or simulate them.
+		uint32_t alive; // Number of live particles in this chunk. GPU systems with compute shaders: an upper bound, see particle_system_alive_count.
+		
+		uint32_t free_count; // Slots below 'used' whose particles have died and can be reused. Unused by GPU systems with compute shaders, whose free list lives on the GPU.
+		uint32_t* free_slots;
+		
+		Particle* particles; // 'chunk_capacity' particles, aligned to particle_chunk_alignment.
+		float* birth_times;  // System time at which each particle was spawned. Only meaningful for ParticleSimulation::BALLISTIC and GPU.
+		uint8_t* attributes[particle_max_attribute_count]; // One column per custom attribute, with 'components' values of its type per particle. See particle_chunk_attribute.
+		
+		// Slots [dirty_begin, dirty_end) were spawned (or marked changed) since the last upload.
+		// GPU systems with compute shaders: spawns wait in [0, dirty_end) until the GPU gives them their slots, so the CPU doesn't know where they end up.
+		uint32_t dirty_begin;
+		uint32_t dirty_end;
+		
+		float latest_death_time; // BALLISTIC and GPU only: once the system time passes this, every particle in the chunk is dead.
+		// Slots [death_pending_begin, death_pending_end) were spawned since latest_death_time last took them in.
+		// Particles get their life after particle_system_spawn returns, so the next particle_system_advance does that.
+		uint32_t death_pending_begin;
+		uint32_t death_pending_end;
+		
+		// Bounds of the positions of the chunk's particles. See particle_system_bounds.
+		// CPU: where your simulation last stored them (particle_chunk_store_bounds), grown by the particles spawned since.
+		vec2 bounds_min;
+		vec2 bounds_max;
+		
+		// BALLISTIC and GPU: spawns go to the current window, [0]. Once every particle of the previous one, [1], has died, the current one takes its place,
+		// so that the bounds follow an emitter that moves, even though its chunks never empty.
+		ParticleSpawnWindow spawn_windows[2];
+		
+		// Trails. See particle_system_set_trail_length.
+		vec2* trail_positions;     // 'trail_length' rows of 'chunk_capacity' positions, one row per push, so that a push writes contiguous memory.
+		uint8_t* trail_counts;     // How many rows hold a position of each particle. Reset when its slot is handed out again.
+		uint32_t trail_dirty_rows; // Rows pushed since the last upload, counting back from the system's 'trail_head'.
+	};
+	
+	enum class ParticleSimulation {
+		CPU,       // You simulate the particles yourself. We upload the position and alpha of every used slot each frame, but scale and color only when particles spawn, or when you call particle_mark_changed.
+		BALLISTIC, // Particles follow a closed-form trajectory (constant gravity, exponential drag), evaluated in the vertex shader. They are only uploaded when spawned.
+		
+		// Particles are simulated on the GPU, as GpuSimulationParams says, in particle_system_advance. They are only uploaded when spawned, and never read back,
+		// so past that, their CPU copy is stale: don't read it, kill them or mark them changed. Needs compute shaders or transform feedback, see particle_gpu_simulation_supported.
+		// With compute shaders, the GPU hands out slots to spawns and takes them back when particles die, with a free list of its own, so slots are reused right away.
+		// Custom attributes that only the CPU sees don't follow particles to their GPU slots. Particles are also culled against the projection on the GPU when rendered,
+		// and drawn as many as it finds, without the CPU ever knowing.
+		// With transform feedback, slots are only reused a whole chunk at a time, once all its particles are past their life, so that uploading spawns never overwrites live particles.
+		GPU,
+	};
+	
+	//
+	// Kill volumes.
+	// Particles that end up in a kill volume die right away, so that their slots can be reused instead of simulating, uploading and drawing them until their life runs out.
+	// See particle_system_kill_in_volumes in sparkles_utils.h. GPU systems test theirs in their simulation pass.
+	//
+	enum class KillVolumeType : uint32_t {
+		OUTSIDE_BOX = 0, // Kills what leaves the box [min, max]. Use it for the bounds of your world.
+		INSIDE_BOX = 1,  // Kills what enters the box [min, max].
+		HALF_PLANE = 2,  // Kills what is past 'distance' along 'normal', that is, where dot(position, normal) > distance.
+	};
+	
+	struct KillVolume {
+		KillVolumeType type;
+		vec2 min;
+		vec2 max;
+		vec2 normal; // Need not be normalized. 'distance' is then in multiples of its length.
+		float distance;
+	};
+	
+	struct ParticleSpawnQueue; // Internal. See particle_system_request_spawn in sparkles_utils.h.
+	
+	struct BallisticParams {
+		vec2  gravity; // Units per second squared.
+		float drag;    // Velocity decays as exp(-drag * age). 0 means no drag.
+	};
+	
+	constexpr uint32_t particle_gpu_max_attractor_count = 16;
+	constexpr uint32_t particle_gpu_max_kill_volume_count = 16;
+	
+	// How an attractor's pull depends on the distance 'r' to it.
+	enum class GpuForceFalloff : uint32_t {
+		LINEAR = 0,          // strength * r
+		INVERSE = 1,         // strength / r
+		INVERSE_SQUARED = 2, // strength / r^2
+	};
+	
+	struct GpuAttractor {
+		vec2 position;
+		float radius;    // No pull past this distance.
+		float strength;  // Negative values push particles away.
+		float max_force; // Caps the pull near the center, where INVERSE and INVERSE_SQUARED blow up.
+		GpuForceFalloff falloff;
+	};
+	
+	// Each step, in this order: gravity and attractors change the velocity, the velocity moves the particle and then decays with drag,
+	// life goes down by the step, and particles out of life or in a kill volume die. Alpha fades with the remaining life, like BALLISTIC particles.
+	struct GpuSimulationParams {
+		vec2  gravity; // Units per second squared.
+		float drag;    // Velocity decays as exp(-drag * dt). 0 means no drag.
+		
+		uint32_t attractor_count;
+		GpuAttractor attractors[particle_gpu_max_attractor_count];
+		
+		uint32_t kill_volume_count;
+		KillVolume kill_volumes[particle_gpu_max_kill_volume_count];
+	};
+	
 	struct ParticleSystem {
-		uint32_t count;
-		Particle* particles;
+		uint32_t chunk_capacity; // Number of particles per chunk. Fixed at creation.
+		uint32_t chunk_count;
+		ParticleChunk** chunks;
+		
+		uint32_t max_particle_count = 0; // Spawning fails past this point (rounded up to whole chunks). 0 means the system can grow indefinitely.
+		
+		uint32_t attribute_count; // Custom attributes. Fixed at creation.
+		ParticleAttribute attributes[particle_max_attribute_count];
+		
+		ParticleSimulation simulation = ParticleSimulation::CPU; // Change it with particle_system_set_simulation.
+		BallisticParams ballistic = {}; // Used by BALLISTIC systems. Changing it affects live particles as well, as their whole trajectory is recomputed every frame.
+		GpuSimulationParams gpu = {};   // Used by GPU systems, from their next step on.
+		float time = 0; // Advanced by particle_system_advance, which also moves it back to 0 every so often, along with the birth times. Only compare it to birth times, not to a time you kept.
+		
+		uint32_t trail_length = 0; // Past positions kept per particle. Change it with particle_system_set_trail_length.
+		uint32_t trail_head = 0;   // Row of the latest push.
+		
+		uint32_t reorder_cursor = 0; // Internal: the next chunk particle_system_reorder_step sorts.
+		void* reorder_scratch;           // Internal: particle_system_reorder_step's sort memory, kept between steps.
+		uint32_t reorder_scratch_chunks; // Internal: how many chunks 'reorder_scratch' can sort at once.
+		
+		uint32_t chunk_array_capacity; // Internal: size of the 'chunks' array.
+		ParticleSpawnQueue* spawn_queue; // Internal: spawn requests from any thread, waiting for the next particle_system_advance.
 	};
 	
 	//
@@ -154,12 +329,19 @@ namespace Sparkles {
 		int height;
 	};
 	
+	enum class BlendMode {
+		ALPHA,    // Over what is already there, weighted by alpha.
+		ADDITIVE, // Adds to what is already there, scaled by alpha. For glows and sparks.
+		NONE,     // Replaces what is already there.
+	};
+	
 	struct RenderState {
 		Shader* vertex_shader = nullptr;
 		Shader* pixel_shader = nullptr;
 		RenderTarget* render_target = nullptr;
 		
 		Texture* texture0 = nullptr;
+		BlendMode blend_mode = BlendMode::ALPHA;
 		
 		Rect viewport = {0, 0, 0, 0};
 		
@@ -177,8 +359,72 @@ namespace Sparkles {
 	// Basic API
 	// 
 	bool            initialize();
-	ParticleSystem* particle_system_create(uint32_t particle_count);
+	ParticleSystem* particle_system_create(uint32_t particle_count, ParticleAttribute attributes[] = nullptr, uint32_t attribute_count = 0); // 'particle_count' is just the initial capacity; the system grows on demand.
+	void            particle_system_destroy(ParticleSystem* system);
 	void            particle_system_upload_and_render(ParticleSystem* system, Mesh* mesh, RenderState* render_state);
+	void            particle_systems_upload_and_render(ParticleSystem* systems[], uint32_t system_count, Mesh* mesh, RenderState* render_state); // Same as rendering each system in turn, but consecutive systems with the same simulation and the same GPU-visible attributes share a single draw call.
+	
+	// Particle storage
+	Particle* particle_system_spawn(ParticleSystem* system, float age = 0); // Returns a zeroed particle, or nullptr if max_particle_count was reached. 'age' backdates its birth time, for BALLISTIC spawns that happened earlier within the step. Place other particles where they are now.
+	void      particle_kill(ParticleChunk* chunk, uint32_t index); // Returns the slot to its chunk. Call it exactly once per dead particle.
+	void      particle_mark_changed(ParticleChunk* chunk, uint32_t index); // Uploads the particle's scale and color again. Only needed if you animate them after it spawned. Not for GPU systems.
+	void      particle_system_clear(ParticleSystem* system); // Kills every particle at once. Keeps the chunks.
+	void      particle_system_reserve(ParticleSystem* system, uint32_t particle_count);
+	void      particle_system_trim(ParticleSystem* system, uint32_t particle_count_to_keep); // Releases empty chunks, while keeping room for 'particle_count_to_keep' particles.
+	void      particle_system_fit(ParticleSystem* system, uint32_t particle_count); // Grows right away, but only trims once the capacity is well above 'particle_count' (hysteresis).
+	uint32_t  particle_system_capacity(ParticleSystem* system);
+	uint32_t  particle_system_alive_count(ParticleSystem* system); // GPU systems: an upper bound. With compute shaders, the GPU counts them and we read that a step or so late, plus what spawned since.
+	                                                                // With transform feedback, particles that die still count until their whole chunk is past its latest death time.
+	
+	// Custom attributes
+	int32_t        particle_system_find_attribute(ParticleSystem* system, const char* name); // Returns the attribute's index, or -1.
+	ParticleChunk* particle_system_find_chunk(ParticleSystem* system, Particle* particle, uint32_t* particle_index); // The chunk and slot of a particle, say one you just spawned, to set its attributes.
+	void*          particle_chunk_attribute(ParticleSystem* system, ParticleChunk* chunk, uint32_t attribute_index, uint32_t particle_index); // The attribute's 'components' values for one particle, as stored: float, uint16_t (half) or uint8_t (unorm).
+	void           particle_chunk_set_attribute(ParticleSystem* system, ParticleChunk* chunk, uint32_t attribute_index, uint32_t particle_index, const float values[]); // Converts 'components' floats to the attribute's type.
+	void           particle_chunk_get_attribute(ParticleSystem* system, ParticleChunk* chunk, uint32_t attribute_index, uint32_t particle_index, float values[]);       // Converts the attribute back to 'components' floats.
+	
+	// Simulation modes
+	void particle_system_set_simulation(ParticleSystem* system, ParticleSimulation simulation); // Live particles carry over to the new mode.
+	void particle_system_advance(ParticleSystem* system, float dt); // Advances the system time and spawns requested particles. BALLISTIC and GPU systems also reclaim the slots of dead particles here.
+	                                                                // GPU systems are simulated here too, so advance them on the thread that renders.
+	bool particle_gpu_simulation_supported(); // Whether the graphics backend can run ParticleSimulation::GPU. Call it after initialize.
+	void particle_ballistic_evaluate(ParticleSystem* system, Particle* particle, float birth_time, vec3* position, vec3* velocity); // Where a BALLISTIC particle is right now.
+	
+	// Where the live particles of a system are (their positions, not counting their size), for culling, sizing render targets or framing a view.
+	// It only reads a few fields per chunk. Returns false if there are no live particles.
+	// For CPU systems, this relies on your simulation storing each chunk's bounds: particle_system_for_each_alive does it for you, see sparkles_for_each.h otherwise.
+	bool particle_system_bounds(ParticleSystem* system, Rect* bounds);
+	
+	// Spatial reordering
+	// Sorts the live particles of a chunk by the Morton (Z-order) key of their position, so that particles that are close in space are close in memory,
+	// which helps any spatial work on them, and the GPU's texture cache. It also packs them at the start of the chunk, which shrinks what we simulate and upload.
+	// This moves particles, so it invalidates any Particle pointer or slot index you kept. Don't use it on systems whose particles are in a ConstraintSolver.
+	// Only CPU systems are sorted: the others do nothing. A sorted chunk is uploaded whole, so sort every so often rather than every frame.
+	void particle_system_reorder_step(ParticleSystem* system, uint32_t chunk_count = 1); // Sorts the next 'chunk_count' chunks, round-robin, in parallel.
+	
+	// Trails
+	// Each particle keeps a ring of its last 'trail_length' positions, which the GPU expands into a ribbon behind it, with no mesh building on the CPU.
+	// Only for CPU systems, as BALLISTIC particles have no CPU positions to record.
+	void particle_system_set_trail_length(ParticleSystem* system, uint32_t length); // Up to particle_max_trail_length. 0 disables trails. Clears the history of live particles.
+	void particle_system_push_trails(ParticleSystem* system); // Records where every live particle is. Call it as often as you want trail points, say once per step.
+	// One instanced draw per chunk, using the particles uploaded by the last particle_system_upload_and_render, so call it after that.
+	// Ribbons are as wide as their particles, and taper and fade towards their tails. texture0 is mapped along them.
+	void particle_system_render_trails(ParticleSystem* system, RenderState* render_state);
+	
+	// Draw queue
+	// Records draws, then sorts them by their state (render target, blend mode, program, texture, mesh) when you submit them, so that each state change happens once,
+	// and consecutive particle systems that end up with the same state are batched like particle_systems_upload_and_render does.
+	// ALPHA draws blend over one another, so those of a render target keep the order you queued them in. Other draws with different state can be reordered.
+	// Draws to render targets come before draws to our window. Trails read what their particles uploaded: queue them after those, with the same blend mode.
+	// Render states are copied, but systems and meshes are only read when you submit, so keep them as they are until then.
+	struct DrawQueue;
+	
+	DrawQueue* draw_queue_create();
+	void       draw_queue_destroy(DrawQueue* queue);
+	void       draw_queue_add_particles(DrawQueue* queue, ParticleSystem* system, Mesh* mesh, RenderState* render_state); // See particle_system_upload_and_render.
+	void       draw_queue_add_trails(DrawQueue* queue, ParticleSystem* system, RenderState* render_state); // See particle_system_render_trails.
+	void       draw_queue_add_mesh(DrawQueue* queue, Mesh* mesh, RenderState* render_state, int32_t index_count = -1); // See mesh_render.
+	void       draw_queue_submit(DrawQueue* queue); // Draws everything, and empties the queue.
 	
 	//
 	// Graphics Utility
@@ -186,6 +432,7 @@ namespace Sparkles {
 	
 	// Shader
 	Shader* shader_create(ShaderLanguage language, ShaderType type, const char* shader_source_code);
+	void    shader_cache_set_directory(const char* directory); // Where we save the programs we link, so that later runs load them instead. We create the directory if it doesn't exist (but not its parents). nullptr (the default) turns it off.
 	// #todo: shader_hotload
 	// #todo: shader_destroy
 	
@@ -204,5 +451,9 @@ namespace Sparkles {
 	Texture*      render_target_flush(RenderTarget* render_target);
 	void          render_target_clear(RenderTarget* render_target, vec4 color); // nullptr means clearing our window's backbuffer.
 	
+	// Our draws leave their state bound for the next one, and skip binding what is already there.
+	// Call this between our draws and your own graphics API calls (e.g. your UI), so that you start from the defaults and we bind everything again next time.
+	void          render_state_reset();
+	
 	// #todo: render_target_destroy
 }
\ No newline at end of file
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "sparkles.h"
+#include "sparkles_utils.h" // For jobs_parallel_for
+
+#include <math.h> // For INFINITY
+
+// Header-only traversal of a particle system's live particles, so that your own simulation code doesn't need to hand-write chunk loops.
+//
+// Usage:
+//     particle_system_for_each_alive(system, Execution::parallel, [&](Particle* p) {
+//         p->life -= dt;
+//     });
+//
+// Your function is a template argument, so it gets inlined into the loop.
+
+// Tells the compiler that iterations of the next loop are independent, so that it can vectorize it. Our implementation files define the same in sparkles_internal.h.
+#ifndef SPARKLES_LOOP_INDEPENDENT
+#if defined(_MSC_VER)
+#define SPARKLES_LOOP_INDEPENDENT __pragma(loop(ivdep))
+#elif defined(__clang__)
+#define SPARKLES_LOOP_INDEPENDENT _Pragma("clang loop vectorize(enable)")
+#elif defined(__GNUC__)
+#define SPARKLES_LOOP_INDEPENDENT _Pragma("GCC ivdep")
+#else
+#define SPARKLES_LOOP_INDEPENDENT
+#endif
+#endif
+
+namespace Sparkles {
+	
+	namespace Execution {
+		struct Sequential {}; // Chunk after chunk, on the calling thread.
+		struct Parallel   {}; // Chunks are spread over the job system. Your function must only touch the particle (or chunk) it is given.
+		struct Vectorized {}; // Like Parallel, but chunks without dead particles run a branch-free loop the compiler can vectorize. Your function must not depend on the order of particles.
+		
+		constexpr Sequential sequential = {};
+		constexpr Parallel   parallel   = {};
+		constexpr Vectorized vectorized = {};
+	}
+	
+	// A chunk's storage, as handed to particle_system_for_each_chunk.
+	// Slots [0, count) may contain dead particles (life < 0), which you must skip, and you must call particle_kill on the ones that die.
+	struct ParticleChunkView {
+		ParticleChunk* chunk;
+		uint32_t chunk_index;
+		uint32_t count;
+		Particle* particles;
+		float* birth_times;
+	};
+	
+	//
+	// Bounds of particle positions, gathered while you simulate them, so that they cost no extra pass over the particles.
+	// Start from particle_bounds_empty, grow them by each live particle's final position, then call particle_chunk_store_bounds once the chunk is done.
+	//
+	inline void particle_bounds_empty(vec2* min, vec2* max) {
+		*min = {+INFINITY, +INFINITY};
+		*max = {-INFINITY, -INFINITY};
+	}
+	
+	inline void particle_bounds_add(vec2* min, vec2* max, vec2 position) {
+		// Plain comparisons rather than fmin and fmax, which have to handle NaNs, so that they compile to single min and max instructions.
+		min->x = position.x < min->x ? position.x : min->x;
+		min->y = position.y < min->y ? position.y : min->y;
+		max->x = position.x > max->x ? position.x : max->x;
+		max->y = position.y > max->y ? position.y : max->y;
+	}
+	
+	inline void particle_chunk_store_bounds(ParticleChunk* chunk, vec2 min, vec2 max) {
+		chunk->bounds_min = min;
+		chunk->bounds_max = max;
+	}
+	
+	inline ParticleChunkView particle_chunk_view(ParticleSystem* system, uint32_t chunk_index) {
+		ParticleChunk* chunk = system->chunks[chunk_index];
+		
+		ParticleChunkView result;
+		result.chunk = chunk;
+		result.chunk_index = chunk_index;
+		result.count = chunk->used;
+		result.particles = chunk->particles;
+		result.birth_times = chunk->birth_times;
+		return result;
+	}
+	
+	//
+	// Internal: each policy's loop over the live particles of a single chunk.
+	// Particles whose life drops below 0 during 'function' are killed afterwards.
+	//
+	
+	template <typename Function>
+	void particle_chunk_for_each_alive(ParticleChunk* chunk, Function& function) {
+		vec2 min, max;
+		particle_bounds_empty(&min, &max);
+		
+		for (uint32_t i = 0; i < chunk->used; i += 1) {
+			Particle* p = &chunk->particles[i];
+			if (p->life < 0) continue;
+			
+			function(p);
+			
+			if (p->life < 0) particle_kill(chunk, i);
+			else particle_bounds_add(&min, &max, p->position.xy);
+		}
+		
+		particle_chunk_store_bounds(chunk, min, max);
+	}
+	
+	template <typename Function>
+	void particle_chunk_for_each_alive_vectorized(ParticleChunk* chunk, Function& function) {
+		if (chunk->alive != chunk->used) {
+			// There are holes, so we need to check each particle anyway.
+			particle_chunk_for_each_alive(chunk, function);
+			return;
+		}
+		
+		uint32_t count = chunk->used;
+		Particle* particles = chunk->particles;
+		
+		SPARKLES_LOOP_INDEPENDENT
+		for (uint32_t i = 0; i < count; i += 1) function(&particles[i]);
+		
+		// Killing touches the chunk's free list, so it gets its own loop. The particles are still in cache, so we gather the bounds here too.
+		vec2 min, max;
+		particle_bounds_empty(&min, &max);
+		for (uint32_t i = 0; i < chunk->used; i += 1) {
+			if (particles[i].life < 0) particle_kill(chunk, i);
+			else particle_bounds_add(&min, &max, particles[i].position.xy);
+		}
+		particle_chunk_store_bounds(chunk, min, max);
+	}
+	
+	template <typename Function>
+	struct ParticleForEachJob {
+		ParticleSystem* system;
+		Function* function;
+	};
+	
+	template <typename Function>
+	void particle_for_each_alive_job(void* data, uint32_t chunk_index) {
+		auto job = (ParticleForEachJob<Function>*) data;
+		particle_chunk_for_each_alive(job->system->chunks[chunk_index], *job->function);
+	}
+	
+	template <typename Function>
+	void particle_for_each_alive_vectorized_job(void* data, uint32_t chunk_index) {
+		auto job = (ParticleForEachJob<Function>*) data;
+		particle_chunk_for_each_alive_vectorized(job->system->chunks[chunk_index], *job->function);
+	}
+	
+	template <typename Function>
+	void particle_for_each_chunk_job(void* data, uint32_t chunk_index) {
+		auto job = (ParticleForEachJob<Function>*) data;
+		(*job->function)(particle_chunk_view(job->system, chunk_index));
+	}
+	
+	//
+	// Calls 'function(Particle*)' once for each live particle. If 'function' sets a particle's life below 0, we kill it for you.
+	//
+	template <typename Function>
+	void particle_system_for_each_alive(ParticleSystem* system, Execution::Sequential, Function function) {
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) particle_chunk_for_each_alive(system->chunks[c], function);
+	}
+	
+	template <typename Function>
+	void particle_system_for_each_alive(ParticleSystem* system, Execution::Parallel, Function function) {
+		ParticleForEachJob<Function> job = {system, &function};
+		jobs_parallel_for(system->chunk_count, particle_for_each_alive_job<Function>, &job);
+	}
+	
+	template <typename Function>
+	void particle_system_for_each_alive(ParticleSystem* system, Execution::Vectorized, Function function) {
+		ParticleForEachJob<Function> job = {system, &function};
+		jobs_parallel_for(system->chunk_count, particle_for_each_alive_vectorized_job<Function>, &job);
+	}
+	
+	//
+	// Calls 'function(ParticleChunkView)' once for each chunk, for code that wants to work on whole arrays at once.
+	// Vectorized is the same as Parallel here: vectorizing is up to your loop.
+	//
+	template <typename Function>
+	void particle_system_for_each_chunk(ParticleSystem* system, Execution::Sequential, Function function) {
+		for (uint32_t c = 0; c < system->chunk_count; c += 1) function(particle_chunk_view(system, c));
+	}
+	
+	template <typename Function>
+	void particle_system_for_each_chunk(ParticleSystem* system, Execution::Parallel, Function function) {
+		ParticleForEachJob<Function> job = {system, &function};
+		jobs_parallel_for(system->chunk_count, particle_for_each_chunk_job<Function>, &job);
+	}
+	
+	template <typename Function>
+	void particle_system_for_each_chunk(ParticleSystem* system, Execution::Vectorized, Function function) {
+		particle_system_for_each_chunk(system, Execution::parallel, function);
+	}
+}
@@ -67,6 +67,74 @@ namespace Sparkles {
 		Range1 life;
 	};
 	
+	// Picks one of 'count' slots, each with its own weight, in constant time (Vose's alias method).
+	struct AliasTable {
+		uint32_t count;
+		float* probabilities; // Chance of keeping slot i, rather than taking its alias.
+		uint32_t* aliases;
+	};
+	
+	enum class EmissionShapeType {
+		MESH,  // Uniform over the area of a mesh's triangles.
+		CURVE, // Uniform over the length of Bezier curves.
+		MASK,  // Over the pixels of an image, in proportion to their alpha.
+	};
+	
+	// A spawn area, preprocessed once so that sampling a position from it is O(1), however many triangles, curve segments or pixels it has.
+	struct EmissionShape {
+		EmissionShapeType type;
+		AliasTable table;   // One slot per triangle, curve segment or pixel.
+		vec2* points;       // MESH: 3 per triangle. CURVE: 2 per segment. MASK: unused.
+		uint32_t mask_width;
+		uint32_t mask_height;
+		Rect bounds;        // Where sampled positions can land. For MASK, this is where the image is placed.
+	};
+	
+	//
+	// Constraints between particles, for ropes, chains and soft bodies, solved with XPBD (extended position based dynamics).
+	//
+	enum class ConstraintType : uint32_t {
+		DISTANCE = 0, // Keeps particles[0] and particles[1] 'rest' apart.
+		BENDING = 1,  // Keeps particles[1] 'rest' away from the centroid of the triangle it makes with particles[0] and particles[2]. A rest of 0 pulls the three into a straight line.
+	};
+	
+	struct Constraint {
+		ConstraintType type;
+		uint32_t particles[3]; // Indices into the solver's particles. DISTANCE only uses the first two.
+		float rest;
+		float compliance; // Inverse stiffness. 0 is rigid. Unlike plain PBD, the result does not depend on the time step or the number of iterations.
+	};
+	
+	// The solver partitions its constraints by greedy graph coloring, so that no two constraints of the same color share a particle.
+	// Each color is then solved in parallel on the job system, without atomics, and colors run one after another.
+	// Constraints that don't fit in the first colors end up in the last one, which is solved on the calling thread.
+	constexpr uint32_t constraint_max_colors = 64;
+	
+	struct ConstraintSolver {
+		uint32_t iterations = 8;
+		
+		uint32_t particle_count;
+		uint32_t particle_capacity;
+		Particle** particles;   // A particle never moves in memory while it is alive, so we point at it directly.
+		float* inverse_masses;  // 0 pins a particle: the solver leaves it wherever you put it.
+		float* weights;         // Internal: the inverse masses for the current solve, with dead particles pinned.
+		vec2* start_positions;  // Internal: where the particles were before the current solve, to correct their velocities afterwards.
+		
+		uint32_t constraint_count;
+		uint32_t constraint_capacity;
+		Constraint* constraints; // Reordered by color when the solver colors them.
+		float* lambdas;          // Internal: one Lagrange multiplier per constraint, accumulated over the iterations of a solve.
+		
+		bool colored; // Adding constraints clears it. The next solve colors them again.
+		uint32_t color_count;
+		uint32_t color_offsets[constraint_max_colors + 1]; // Color c is constraints [color_offsets[c], color_offsets[c + 1]).
+	};
+	
+	struct ParticleCountEstimate {
+		float    average; // Expected number of live particles, once the emitter reaches its steady state.
+		uint32_t peak;    // Worst case: every emission spawns the maximum number of particles, as often as possible, and they all live as long as possible.
+	};
+	
 	struct MeshBuilder {
 		uint32_t vertex_capacity;
 		uint32_t vertex_cursor;
@@ -82,6 +150,61 @@ namespace Sparkles {
 	//
 	void particle_spawn(Particle* particle, ParticleSpawnParams* spawn);
 	
+	// Kills the live particles of a chunk that are inside any of the volumes, and returns how many. Call it from your simulation loop, after moving the particles.
+	// BALLISTIC particles are tested where their trajectories put them now, and their slots are uploaded again, so that the GPU stops drawing them too.
+	// GPU systems are skipped: they test GpuSimulationParams::kill_volumes as they simulate.
+	uint32_t particle_chunk_kill_in_volumes(ParticleSystem* system, ParticleChunk* chunk, KillVolume* volumes, uint32_t volume_count);
+	uint32_t particle_system_kill_in_volumes(ParticleSystem* system, KillVolume* volumes, uint32_t volume_count); // Every chunk, in parallel.
+	
+	// Unlike particle_system_spawn, this is safe to call from any thread, at any time, without locking or allocating. 
+	// 'params' is copied, and the start of the next particle_system_advance spawns 'count' particles from it, with particle_spawn.
+	// Particles past the system's max_particle_count are dropped. So is the whole request if the system already has particle_spawn_request_capacity of them pending,
+	// in which case this returns false.
+	constexpr uint32_t particle_spawn_request_capacity = 256; // A power of two. Each request can spawn any number of particles.
+	bool particle_system_request_spawn(ParticleSystem* system, ParticleSpawnParams* params, uint32_t count);
+	
+	// Estimates the live particle count of an emitter that spawns 'particles_per_emission' particles every 'emission_interval' seconds, each living for 'life' seconds.
+	// Use it to size particle systems up front.
+	ParticleCountEstimate particle_count_estimate(Range1 emission_interval, Range1 particles_per_emission, Range1 life);
+	
+	//
+	// Constraints
+	// Particles are solved in 2D, on the xy of their positions. The solver keeps pointers to them, so don't reorder their system. Remove the ones that die before you spawn again:
+	// a dead particle is pinned where it died, and its slot may be handed to a new particle.
+	//
+	
+	ConstraintSolver* constraint_solver_create(uint32_t particle_capacity = 0, uint32_t constraint_capacity = 0);
+	void              constraint_solver_destroy(ConstraintSolver* solver);
+	void              constraint_solver_clear(ConstraintSolver* solver); // Removes every particle and constraint. Keeps the memory.
+	
+	uint32_t constraint_solver_add_particle(ConstraintSolver* solver, Particle* particle, float inverse_mass = 1); // Returns the index to use in constraints.
+	// Removes the particle and every constraint on it. The last particle takes its index, so this returns the index that particle had (or 'index', if it was the last).
+	uint32_t constraint_solver_remove_particle(ConstraintSolver* solver, uint32_t index);
+	// Rest lengths are measured from where the particles are now.
+	void     constraint_solver_add_distance(ConstraintSolver* solver, uint32_t a, uint32_t b, float compliance = 0);
+	void     constraint_solver_add_bending(ConstraintSolver* solver, uint32_t a, uint32_t b, uint32_t c, float compliance = 0); // 'b' is the middle particle.
+	
+	// Call it once per step, after moving the particles: their positions are taken as the prediction.
+	// Moves them until they satisfy the constraints, and adds each particle's correction, divided by 'dt', to its velocity.
+	void constraint_solver_solve(ConstraintSolver* solver, float dt);
+	
+	//
+	// Emission shapes
+	//
+	
+	AliasTable alias_table_create(float* weights, uint32_t count); // Weights must not be negative. If they are all 0, every slot is equally likely.
+	void       alias_table_destroy(AliasTable* table);
+	uint32_t   alias_table_sample(AliasTable* table);
+	
+	EmissionShape* emission_shape_create_from_mesh(MeshBuilder* builder);
+	EmissionShape* emission_shape_create_from_curves(CubicBezier* curves, uint32_t curve_count, uint32_t segments_per_curve = 64);
+	// Takes the same pixels as texture_create. RGBA_UINT8 is weighted by its alpha, ALPHA_FLOAT32 by its value. The image is stretched over 'rect'.
+	EmissionShape* emission_shape_create_from_image(TextureFormat format, uint32_t width, uint32_t height, void* image_data, Rect rect);
+	void           emission_shape_destroy(EmissionShape* shape);
+	
+	vec2 emission_shape_sample(EmissionShape* shape);
+	void emission_shape_sample(EmissionShape* shape, vec2* positions, uint32_t count); // For big bursts.
+	
 	//
 	// Texture generation function
 	//
@@ -104,6 +227,15 @@ namespace Sparkles {
 	void put_regular_polygon(MeshBuilder* builder, vec2 center, float radius, int number_of_sides);
 	void put_bezier(MeshBuilder* builder, CubicBezier* curve, float line_width, int number_of_points);
 		
+	//
+	// Job system
+	//
+	typedef void (*JobFunction)(void* data, uint32_t index);
+	
+	// Calls function(data, i) for every i in [0, count), spread across our worker threads and the calling thread. Returns once every call is done.
+	void     jobs_parallel_for(uint32_t count, JobFunction function, void* data);
+	uint32_t jobs_worker_count(); // Including the calling thread.
+	
 	//
 	// Random number generator functions
 	//
@@ -197,7 +329,7 @@ namespace Sparkles {
 	
 	vec2  bezier_get_position(CubicBezier curve, float t);
 	vec2  bezier_get_tangent(CubicBezier curve, float t);
-	float bezier_get_length(CubicBezier curve, float start_t = 0, float end_t = 1, float dt = 0.01);
+	float bezier_get_length(CubicBezier curve, float start_t = 0, float end_t = 1, float dt = 0.01); // Steps of 'dt' in t, which must be positive.
 	
 	mat4 mat4_identity();
 	mat4 mat4_translation(vec3 offset);